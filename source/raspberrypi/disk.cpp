@@ -40,6 +40,21 @@ void SleepUs(int us);
 //#define DISK_LOG
 //#define DISK_LOG_WARNING
 
+#ifndef BAREMETAL
+//---------------------------------------------------------------------------
+//
+//	経過時間取得(ms)
+//
+//---------------------------------------------------------------------------
+static DWORD GetTimeMs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DWORD)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+#endif	// BAREMETAL
+
 //===========================================================================
 //
 //	ディスクトラック
@@ -57,13 +72,17 @@ DiskTrack::DiskTrack()
 	dt.track = 0;
 	dt.size = 0;
 	dt.sectors = 0;
+	dt.trksec = 0;
 	dt.raw = FALSE;
+	dt.rawbuf = NULL;
+	dt.rawlen = 0;
 	dt.init = FALSE;
 	dt.changed = FALSE;
 	dt.length = 0;
 	dt.buffer = NULL;
 	dt.maplen = 0;
 	dt.changemap = NULL;
+	dt.pool = FALSE;
 	dt.imgoffset = 0;
 }
 
@@ -74,6 +93,11 @@ DiskTrack::DiskTrack()
 //---------------------------------------------------------------------------
 DiskTrack::~DiskTrack()
 {
+	// プールのバッファは解放しない
+	if (dt.pool) {
+		return;
+	}
+
 	// メモリ解放は行うが、自動セーブはしない
 	if (dt.buffer) {
 		free(dt.buffer);
@@ -91,12 +115,14 @@ DiskTrack::~DiskTrack()
 //
 //---------------------------------------------------------------------------
 void FASTCALL DiskTrack::Init(
-	Disk *p, int track, int size, int sectors, BOOL raw, fsize_t imgoff)
+	Disk *p, int track, int size, int sectors, int trksec,
+	BOOL raw, fsize_t imgoff)
 {
 	ASSERT(p);
 	ASSERT(track >= 0);
 	ASSERT((size >= 8) && (size <= 11));
-	ASSERT((sectors > 0) && (sectors <= NumSectors));
+	ASSERT((trksec >= MinSectors) && (trksec <= MaxSectors));
+	ASSERT((sectors > 0) && (sectors <= trksec));
 	ASSERT(imgoff >= 0);
 
 	// ディスク
@@ -106,6 +132,7 @@ void FASTCALL DiskTrack::Init(
 	dt.track = track;
 	dt.size = size;
 	dt.sectors = sectors;
+	dt.trksec = trksec;
 	dt.raw = raw;
 
 	// 初期化されていない(ロードする必要あり)
@@ -118,6 +145,44 @@ void FASTCALL DiskTrack::Init(
 	dt.imgoffset = imgoff;
 }
 
+//---------------------------------------------------------------------------
+//
+//	バッファ設定
+//	※プールのバッファを割り当てる。以後ロード時にメモリ確保を行わない
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskTrack::SetBuffer(
+	BYTE *buf, DWORD length, DWORD *map, DWORD maplen)
+{
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(map);
+	ASSERT(!dt.buffer);
+	ASSERT(!dt.changemap);
+
+	dt.buffer = buf;
+	dt.length = length;
+	dt.changemap = map;
+	dt.maplen = maplen;
+	dt.pool = TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	RAW読み込み用バッファ設定
+//	※プールのバッファを割り当てる。以後ロード時にメモリ確保を行わない
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskTrack::SetRawBuffer(BYTE *buf, DWORD length)
+{
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(dt.pool);
+
+	dt.rawbuf = buf;
+	dt.rawlen = length;
+}
+
 //---------------------------------------------------------------------------
 //
 //	ロード
@@ -128,8 +193,10 @@ BOOL FASTCALL DiskTrack::Load()
 	fsize_t offset;
 	int i;
 	int length;
+	DWORD rawlen;
 	Fileio *fio;
-	Filepath path;
+	BYTE *src;
+	BYTE *dst;
 
 	ASSERT(this);
 
@@ -140,104 +207,194 @@ BOOL FASTCALL DiskTrack::Load()
 		return TRUE;
 	}
 
-	// オフセットを計算
-	// これ以前のトラックは固定のセクタ数(NumSectors)を保持とみなす
-	offset = ((fsize_t)dt.track * NumSectors);
+	// バッファを準備
+	if (!Prepare(offset, length)) {
+		return FALSE;
+	}
+
+	// ファイルから読み込む(オープン済みのハンドルを位置指定で使う)
+	fio = disk->GetFio();
 	if (dt.raw) {
-		ASSERT(dt.size == 11);
-		offset *= 0x930;
-		offset += 0x10;
+		// 読み込み用バッファはRAWモード設定時にプールから割り当て済み
+		rawlen = (dt.sectors - 1) * 0x930 + (1 << dt.size);
+		if (!dt.rawbuf || dt.rawlen < rawlen) {
+			return FALSE;
+		}
+
+		// 先頭セクタのユーザデータから最終セクタのユーザデータまでを一括で読む
+		if (!fio->ReadAt(dt.rawbuf, (int)rawlen, offset)) {
+			return FALSE;
+		}
+
+		// ユーザデータのみを詰めてコピー
+		src = dt.rawbuf;
+		dst = dt.buffer;
+		for (i = 0; i < dt.sectors; i++) {
+			memcpy(dst, src, 1 << dt.size);
+			src += 0x930;
+			dst += 1 << dt.size;
+		}
 	} else {
-		offset <<= dt.size;
+		// 連続読み
+		if (!fio->ReadAt(dt.buffer, length, offset)) {
+			return FALSE;
+		}
+
+		// オーバーレイの差分を重ねる
+		if (disk->GetOverlay() &&
+			!disk->GetOverlay()->Merge(dt.buffer, length, offset)) {
+			return FALSE;
+		}
 	}
 
-	// 実イメージまでのオフセットを追加
-	offset += dt.imgoffset;
+	// フラグを立て、正常終了
+	dt.init = TRUE;
+	dt.changed = FALSE;
+	return TRUE;
+}
 
-	// レングスを計算(このトラックのデータサイズ)
-	length = dt.sectors << dt.size;
+#ifndef BAREMETAL
+//---------------------------------------------------------------------------
+//
+//	非同期ロード要求
+//	※要求番号を返す。要求できなければ-1(呼び出し元でLoadする)
+//
+//---------------------------------------------------------------------------
+int FASTCALL DiskTrack::LoadAsync()
+{
+	fsize_t offset;
+	int length;
 
-	// バッファのメモリを確保
-	ASSERT((dt.size >= 8) && (dt.size <= 11));
-	ASSERT((dt.sectors > 0) && (dt.sectors <= NumSectors));
+	ASSERT(this);
+	ASSERT(!dt.init);
 
-	if (dt.buffer == NULL) {
-		dt.buffer = (BYTE *)malloc(length * sizeof(BYTE));
-		dt.length = length;
+	// RAWモードは読み込み後に詰め直すので対象外
+	if (dt.raw) {
+		return -1;
 	}
 
-	if (!dt.buffer) {
-		return FALSE;
+	// バッファを準備
+	if (!Prepare(offset, length)) {
+		return -1;
 	}
 
-	// バッファ長が異なるなら再確保
-	if (dt.length != (DWORD)length) {
-		free(dt.buffer);
-		dt.buffer = (BYTE *)malloc(length * sizeof(BYTE));
-		dt.length = length;
-	}
+	return disk->GetFio()->SubmitReadAt(dt.buffer, length, offset);
+}
 
-	// 変更マップのメモリを確保
-	if (dt.changemap == NULL) {
-		dt.changemap = (BOOL *)malloc(dt.sectors * sizeof(BOOL));
-		dt.maplen = dt.sectors;
-	}
+//---------------------------------------------------------------------------
+//
+//	非同期ロード完了
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskTrack::LoadComplete(int id)
+{
+	ASSERT(this);
+	ASSERT(id >= 0);
 
-	if (!dt.changemap) {
+	if (!disk->GetFio()->Complete(id)) {
 		return FALSE;
 	}
 
-	// バッファ長が異なるなら再確保
-	if (dt.maplen != (DWORD)dt.sectors) {
-		free(dt.changemap);
-		dt.changemap = (BOOL *)malloc(dt.sectors * sizeof(BOOL));
-		dt.maplen = dt.sectors;
+	// オーバーレイの差分を重ねる
+	if (disk->GetOverlay() && !disk->GetOverlay()->Merge(
+		dt.buffer, dt.sectors << dt.size, GetOffset(0))) {
+		return FALSE;
 	}
 
-	// 変更マップクリア
-	memset(dt.changemap, 0x00, dt.sectors * sizeof(BOOL));
+	// フラグを立て、正常終了
+	dt.init = TRUE;
+	dt.changed = FALSE;
+	return TRUE;
+}
 
-	// ファイルから読み込む(fioの再利用を促すためオープンモードを考慮)
-	fio = disk->GetFio();
-	disk->GetPath(path);
-	if (!fio->Open(path,
-		disk->IsWriteP() ? Fileio::ReadOnly : Fileio::ReadWrite)) {
-		return FALSE;
-	}
+//---------------------------------------------------------------------------
+//
+//	非同期ロード完了チェック
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskTrack::IsComplete(int id) const
+{
+	ASSERT(this);
+	ASSERT(id >= 0);
+
+	return disk->GetFio()->IsComplete(id);
+}
+#endif	// BAREMETAL
+
+//---------------------------------------------------------------------------
+//
+//	ロード準備
+//	※バッファを確保して変更マップをクリアし、ファイル上の位置と長さを返す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskTrack::Prepare(fsize_t& offset, int& length)
+{
+	ASSERT(this);
+	ASSERT(!dt.init);
+
+	// オフセットを計算
+	// これ以前のトラックは固定のセクタ数(trksec)を保持とみなす
+	offset = ((fsize_t)dt.track * dt.trksec);
 	if (dt.raw) {
-		// 分割読み
-		for (i = 0; i < dt.sectors; i++) {
-			// シーク
-			if (!fio->Seek(offset)) {
-				fio->Close();
-				return FALSE;
-			}
+		ASSERT(dt.size == 11);
+		offset *= 0x930;
+		offset += 0x10;
+	} else {
+		offset <<= dt.size;
+	}
 
-			// 読み込み
-			if (!fio->Read(&dt.buffer[i << dt.size], 1 << dt.size)) {
-				fio->Close();
-				return FALSE;
-			}
+	// 実イメージまでのオフセットを追加
+	offset += dt.imgoffset;
 
-			// 次のオフセット
-			offset += 0x930;
-		}
+	// レングスを計算(このトラックのデータサイズ)
+	length = dt.sectors << dt.size;
+
+	// バッファのメモリを確保
+	ASSERT((dt.size >= 8) && (dt.size <= 11));
+	ASSERT((dt.sectors > 0) && (dt.sectors <= dt.trksec));
+
+	if (dt.pool) {
+		// プールのバッファは最大トラック分の長さがある
+		ASSERT(dt.length >= (DWORD)length);
+		ASSERT(dt.maplen >= (DWORD)MapWords(dt.sectors));
 	} else {
-		// 連続読み
-		if (!fio->Seek(offset)) {
-			fio->Close();
+		if (dt.buffer == NULL) {
+			dt.buffer = (BYTE *)Fileio::AllocBuffer(length * sizeof(BYTE));
+			dt.length = length;
+		}
+
+		if (!dt.buffer) {
 			return FALSE;
 		}
-		if (!fio->Read(dt.buffer, length)) {
-			fio->Close();
+
+		// バッファ長が異なるなら再確保
+		if (dt.length != (DWORD)length) {
+			free(dt.buffer);
+			dt.buffer = (BYTE *)Fileio::AllocBuffer(length * sizeof(BYTE));
+			dt.length = length;
+		}
+
+		// 変更マップのメモリを確保
+		if (dt.changemap == NULL) {
+			dt.changemap = (DWORD *)malloc(MapWords(dt.sectors) * sizeof(DWORD));
+			dt.maplen = MapWords(dt.sectors);
+		}
+
+		if (!dt.changemap) {
 			return FALSE;
 		}
+
+		// バッファ長が異なるなら再確保
+		if (dt.maplen != (DWORD)MapWords(dt.sectors)) {
+			free(dt.changemap);
+			dt.changemap = (DWORD *)malloc(MapWords(dt.sectors) * sizeof(DWORD));
+			dt.maplen = MapWords(dt.sectors);
+		}
 	}
-	fio->Close();
 
-	// フラグを立て、正常終了
-	dt.init = TRUE;
-	dt.changed = FALSE;
+	// 変更マップクリア
+	memset(dt.changemap, 0x00, MapWords(dt.sectors) * sizeof(DWORD));
+
 	return TRUE;
 }
 
@@ -248,13 +405,9 @@ BOOL FASTCALL DiskTrack::Load()
 //---------------------------------------------------------------------------
 BOOL FASTCALL DiskTrack::Save()
 {
-	fsize_t offset;
-	int i;
-	int j;
-	int length;
-	int total;
+	int first;
+	int last;
 	Fileio *fio;
-	Filepath path;
 
 	ASSERT(this);
 
@@ -263,83 +416,145 @@ BOOL FASTCALL DiskTrack::Save()
 		return TRUE;
 	}
 
-	// 変更されていなければ不要
-	if (!dt.changed) {
+	// 変更範囲を取得(変更されていなければ不要)
+	if (!GetChangeRange(first, last)) {
 		return TRUE;
 	}
 
 	// 書き込む必要がある
 	ASSERT(dt.buffer);
-	ASSERT(dt.changemap);
 	ASSERT((dt.size >= 8) && (dt.size <= 11));
-	ASSERT((dt.sectors > 0) && (dt.sectors <= NumSectors));
+	ASSERT((dt.sectors > 0) && (dt.sectors <= dt.trksec));
 
 	// RAWモードでは書き込みはありえない
 	ASSERT(!dt.raw);
 
-	// オフセットを計算
-	// これ以前のトラックは固定のセクタ数(NumSectors)を保持とみなす
-	offset = ((fsize_t)dt.track * NumSectors);
-	offset <<= dt.size;
+	// 最初から最後の変更セクタまでを一度に書き込む
+	// (間の未変更セクタもバッファ上は正しい内容を保持している)
+	if (disk->GetOverlay()) {
+		// オーバーレイ時は差分ファイルへ
+		if (!disk->GetOverlay()->WriteAt(&dt.buffer[first << dt.size],
+			(last - first + 1) << dt.size, GetOffset(first))) {
+			return FALSE;
+		}
+	} else {
+		// オープン済みのハンドルを使う
+		fio = disk->GetFio();
+		ASSERT(fio->IsOpen());
+		if (!fio->WriteAt(&dt.buffer[first << dt.size],
+			(last - first + 1) << dt.size, GetOffset(first))) {
+			return FALSE;
+		}
+	}
 
-	// 実イメージまでのオフセットを追加
-	offset += dt.imgoffset;
+	// 変更フラグを落とし、終了
+	ClearChanged();
+	return TRUE;
+}
 
-	// セクタあたりのレングスを計算
-	length = 1 << dt.size;
+//---------------------------------------------------------------------------
+//
+//	変更範囲取得
+//	※変更された最初と最後のセクタを返す。変更がなければFALSE
+//	  ダイレクトI/O中はDirectAlignの境界まで広げる
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskTrack::GetChangeRange(int& first, int& last) const
+{
+	int i;
+	int words;
+	int align;
+	DWORD bits;
 
-	// ファイルオープン
-	fio = disk->GetFio();
-	disk->GetPath(path);
-	if (!fio->Open(path, Fileio::ReadWrite)) {
+	ASSERT(this);
+
+	// 変更されていなければ不要
+	if (!dt.changed) {
 		return FALSE;
 	}
+	ASSERT(dt.changemap);
 
-	// 部分書き込みループ
-	for (i = 0; i < dt.sectors;) {
-		// 変更されていれば
+	// 最初の変更セクタ
+	words = MapWords(dt.sectors);
+	for (i = 0; i < words; i++) {
 		if (dt.changemap[i]) {
-			// 書き込みサイズ初期化
-			total = 0;
+			break;
+		}
+	}
+	ASSERT(i < words);
+	bits = dt.changemap[i];
+	first = i << 5;
+	while (!(bits & 1)) {
+		bits >>= 1;
+		first++;
+	}
 
-			// シーク
-			if (!fio->Seek(offset + ((fsize_t)i << dt.size))) {
-				fio->Close();
-				return FALSE;
+	// 最後の変更セクタ
+	for (i = words - 1; i >= 0; i--) {
+		if (dt.changemap[i]) {
+			break;
+		}
+	}
+	ASSERT(i >= 0);
+	bits = dt.changemap[i];
+	last = (i << 5) + 31;
+	while (!(bits & 0x80000000)) {
+		bits <<= 1;
+		last--;
+	}
+
+	// ダイレクトI/Oの境界に合わせる(バッファはトラック全体が有効)
+	if (!dt.raw && disk->GetFio()->IsDirect()) {
+		align = Fileio::DirectAlign >> dt.size;
+		if (align > 1) {
+			first &= ~(align - 1);
+			last |= (align - 1);
+			if (last >= dt.sectors) {
+				last = dt.sectors - 1;
 			}
+		}
+	}
 
-			// 連続するセクタ長
-			for (j = i; j < dt.sectors; j++) {
-				// 途切れたら終了
-				if (!dt.changemap[j]) {
-					break;
-				}
-
-				// 1セクタ分加算
-				total += length;
-			}
+	ASSERT((first >= 0) && (first <= last) && (last < dt.sectors));
+	return TRUE;
+}
 
-			// 書き込み
-			if (!fio->Write(&dt.buffer[i << dt.size], total)) {
-				fio->Close();
-				return FALSE;
-			}
+//---------------------------------------------------------------------------
+//
+//	変更フラグクリア
+//	※呼び出し元がまとめて書き込んだ後に使う
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskTrack::ClearChanged()
+{
+	ASSERT(this);
 
-			// 未変更のセクタへ
-			i = j;
-		} else {
-			// 次のセクタ
-			i++;
-		}
+	if (dt.changed) {
+		ASSERT(dt.changemap);
+		memset(dt.changemap, 0x00, MapWords(dt.sectors) * sizeof(DWORD));
+		dt.changed = FALSE;
 	}
+}
 
-	// クローズ
-	fio->Close();
+//---------------------------------------------------------------------------
+//
+//	セクタのファイルオフセット取得
+//
+//---------------------------------------------------------------------------
+fsize_t FASTCALL DiskTrack::GetOffset(int sec) const
+{
+	fsize_t offset;
 
-	// 変更フラグを落とし、終了
-	memset(dt.changemap, 0x00, dt.sectors * sizeof(BOOL));
-	dt.changed = FALSE;
-	return TRUE;
+	ASSERT(this);
+	ASSERT((sec >= 0) && (sec <= dt.sectors));
+	ASSERT(!dt.raw);
+
+	// これ以前のトラックは固定のセクタ数(trksec)を保持とみなす
+	offset = ((fsize_t)dt.track * dt.trksec) + sec;
+	offset <<= dt.size;
+
+	// 実イメージまでのオフセットを追加
+	return offset + dt.imgoffset;
 }
 
 //---------------------------------------------------------------------------
@@ -347,11 +562,12 @@ BOOL FASTCALL DiskTrack::Save()
 //	リードセクタ
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskTrack::Read(BYTE *buf, int sec) const
+BOOL FASTCALL DiskTrack::Read(BYTE *buf, int sec, int count) const
 {
 	ASSERT(this);
 	ASSERT(buf);
-	ASSERT((sec >= 0) & (sec < NumSectors));
+	ASSERT((sec >= 0) & (sec < MaxSectors));
+	ASSERT(count > 0);
 
 	// 初期化されていなければエラー
 	if (!dt.init) {
@@ -359,15 +575,15 @@ BOOL FASTCALL DiskTrack::Read(BYTE *buf, int sec) const
 	}
 
 	// セクタが有効数を超えていればエラー
-	if (sec >= dt.sectors) {
+	if (sec + count > dt.sectors) {
 		return FALSE;
 	}
 
 	// コピー
 	ASSERT(dt.buffer);
 	ASSERT((dt.size >= 8) && (dt.size <= 11));
-	ASSERT((dt.sectors > 0) && (dt.sectors <= NumSectors));
-	memcpy(buf, &dt.buffer[sec << dt.size], 1 << dt.size);
+	ASSERT((dt.sectors > 0) && (dt.sectors <= dt.trksec));
+	memcpy(buf, &dt.buffer[sec << dt.size], count << dt.size);
 
 	// 成功
 	return TRUE;
@@ -375,18 +591,17 @@ BOOL FASTCALL DiskTrack::Read(BYTE *buf, int sec) const
 
 //---------------------------------------------------------------------------
 //
-//	ライトセクタ
+//	セクタ比較
+//	※一致したかどうかはsameに返す
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskTrack::Write(const BYTE *buf, int sec)
+BOOL FASTCALL DiskTrack::Compare(
+	const BYTE *buf, int sec, int count, BOOL& same) const
 {
-	int offset;
-	int length;
-
 	ASSERT(this);
 	ASSERT(buf);
-	ASSERT((sec >= 0) & (sec < NumSectors));
-	ASSERT(!dt.raw);
+	ASSERT((sec >= 0) & (sec < MaxSectors));
+	ASSERT(count > 0);
 
 	// 初期化されていなければエラー
 	if (!dt.init) {
@@ -394,60 +609,147 @@ BOOL FASTCALL DiskTrack::Write(const BYTE *buf, int sec)
 	}
 
 	// セクタが有効数を超えていればエラー
-	if (sec >= dt.sectors) {
+	if (sec + count > dt.sectors) {
 		return FALSE;
 	}
 
-	// オフセット、レングスを計算
-	offset = sec << dt.size;
-	length = 1 << dt.size;
-
 	// 比較
 	ASSERT(dt.buffer);
-	ASSERT((dt.size >= 8) && (dt.size <= 11));
-	ASSERT((dt.sectors > 0) && (dt.sectors <= NumSectors));
-	if (memcmp(buf, &dt.buffer[offset], length) == 0) {
-		// 同じものを書き込もうとしているので、正常終了
-		return TRUE;
-	}
-
-	// コピー、変更あり
-	memcpy(&dt.buffer[offset], buf, length);
-	dt.changemap[sec] = TRUE;
-	dt.changed = TRUE;
+	same = (memcmp(buf, &dt.buffer[sec << dt.size], count << dt.size) == 0);
 
 	// 成功
 	return TRUE;
 }
 
-//===========================================================================
-//
-//	ディスクキャッシュ
-//
-//===========================================================================
-
 //---------------------------------------------------------------------------
 //
-//	コンストラクタ
+//	ライトセクタ
 //
 //---------------------------------------------------------------------------
-DiskCache::DiskCache(Disk *p, int size, int blocks, fsize_t imgoff)
+BOOL FASTCALL DiskTrack::Write(const BYTE *buf, int sec, int count)
 {
+	int offset;
+	int length;
 	int i;
 
-	ASSERT(p);
-	ASSERT((size >= 8) && (size <= 11));
-	ASSERT(blocks > 0);
-	ASSERT(imgoff >= 0);
-
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT((sec >= 0) & (sec < MaxSectors));
+	ASSERT(count > 0);
+	ASSERT(!dt.raw);
+
+	// 初期化されていなければエラー
+	if (!dt.init) {
+		return FALSE;
+	}
+
+	// セクタが有効数を超えていればエラー
+	if (sec + count > dt.sectors) {
+		return FALSE;
+	}
+
+	// セクタ毎に比較し、異なるものだけコピー
+	ASSERT(dt.buffer);
+	ASSERT((dt.size >= 8) && (dt.size <= 11));
+	ASSERT((dt.sectors > 0) && (dt.sectors <= dt.trksec));
+	length = 1 << dt.size;
+	for (i = 0; i < count; i++) {
+		offset = (sec + i) << dt.size;
+		if (memcmp(&buf[i << dt.size], &dt.buffer[offset], length) == 0) {
+			// 同じものを書き込もうとしているので、スキップ
+			continue;
+		}
+
+		// コピー、変更あり
+		memcpy(&dt.buffer[offset], &buf[i << dt.size], length);
+		dt.changemap[(sec + i) >> 5] |= ((DWORD)1 << ((sec + i) & 31));
+		dt.changed = TRUE;
+	}
+
+	// 成功
+	return TRUE;
+}
+
+//===========================================================================
+//
+//	ディスクキャッシュ
+//
+//===========================================================================
+
+//---------------------------------------------------------------------------
+//
+//	共有キャッシュリスト
+//
+//---------------------------------------------------------------------------
+DiskCache *DiskCache::share_head = NULL;
+
+//---------------------------------------------------------------------------
+//
+//	コンストラクタ
+//
+//---------------------------------------------------------------------------
+DiskCache::DiskCache(
+	Disk *p, int size, UL64 blocks, fsize_t imgoff, int tracks, int trksec)
+{
+	int i;
+#ifndef BAREMETAL
+	pthread_condattr_t condattr;
+#endif	// BAREMETAL
+
+	ASSERT(p);
+	ASSERT((size >= 8) && (size <= 11));
+	ASSERT(blocks > 0);
+	ASSERT(imgoff >= 0);
+	ASSERT(tracks > 0);
+	ASSERT((trksec >= DiskTrack::MinSectors) &&
+		(trksec <= DiskTrack::MaxSectors));
+	ASSERT((trksec & (trksec - 1)) == 0);
+
 	// ディスク
 	disk = p;
 
+	// トラック毎のセクタ数(2のべき乗)
+	trk_sectors = trksec;
+	trk_shift = 0;
+	while ((1 << trk_shift) < trk_sectors) {
+		trk_shift++;
+	}
+
+	// ディスク全体のトラック数を超える必要はない
+	ASSERT(((blocks + trk_sectors - 1) >> trk_shift) < (UL64)INT_MAX);
+	trk_num = (int)((blocks + trk_sectors - 1) >> trk_shift);
+	if (tracks > trk_num) {
+		tracks = trk_num;
+	}
+	cache_max = tracks;
+
 	// キャッシュワーク
-	for (i = 0; i < CacheMax; i++) {
+	cache = new cache_t[cache_max];
+	for (i = 0; i < cache_max; i++) {
 		cache[i].disktrk = NULL;
 		cache[i].serial = 0;
+		cache[i].hnext = -1;
+		cache[i].prev = -1;
+		cache[i].next = -1;
+		cache[i].dirtytime = 0;
+		cache[i].saving = FALSE;
+		cache[i].pin = 0;
+	}
+
+	// ハッシュテーブル(キャッシュ数の2倍以上の2のべき乗)
+	hash_mask = 1;
+	while (hash_mask < cache_max * 2) {
+		hash_mask <<= 1;
 	}
+	hashtbl = new int[hash_mask];
+	hash_mask--;
+
+	// 連続トラックセーブ用ワーク
+	save_list = new int[cache_max];
+	save_iov = new struct iovec[cache_max];
+	save_num = 0;
+	save_used = 0;
+	save_busy = FALSE;
 
 	// その他
 	serial = 0;
@@ -455,6 +757,68 @@ DiskCache::DiskCache(Disk *p, int size, int blocks, fsize_t imgoff)
 	sec_blocks = blocks;
 	cd_raw = FALSE;
 	imgoffset = imgoff;
+	mapbuf = NULL;
+	map_start = 0;
+	map_end = 0;
+	map_ram = FALSE;
+	ram_len = 0;
+	ram_dirty = NULL;
+	ram_busy = FALSE;
+
+	// 共有(生成したディスクのみ)
+	share_user[0] = p;
+	share_num = 1;
+	share_pub = FALSE;
+	share_next = NULL;
+
+	// トラックプールを確保(先読み分を含む)
+	// ※確保できなければIsValid()がFALSEとなり、呼び出し側でアタッチを失敗させる
+#ifndef BAREMETAL
+	InitPool(cache_max + ReadAheadMax);
+#else
+	InitPool(cache_max);
+#endif	// BAREMETAL
+
+#ifndef BAREMETAL
+	// 先読み
+	ra_depth = 0;
+	ra_next = -1;
+	ra_seq = 0;
+	ra_track = -1;
+	ra_run = FALSE;
+	for (i = 0; i < ReadAheadMax; i++) {
+		ra[i].track = -1;
+		ra[i].state = ReadAheadFree;
+		ra[i].aio = -1;
+		ra[i].disktrk = NULL;
+		if (pool) {
+			ra[i].disktrk = AllocTrack();
+		}
+	}
+	pthread_mutex_init(&ra_lock, NULL);
+	pthread_cond_init(&ra_cond, NULL);
+
+	// ライトバック
+	wb_run = FALSE;
+	pthread_mutex_init(&lock, NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wb_cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+#endif	// BAREMETAL
+	wb_dirty = 0;
+	wb_limit = cache_max / 2;
+	if (wb_limit < 1) {
+		wb_limit = 1;
+	}
+
+	// 統計
+	memset(&cache_stat, 0x00, sizeof(cache_stat));
+	cache_stat.tracks = cache_max;
+	ra_bytes = 0;
+
+	// LRUリストと空きリストを初期化
+	Clear();
 }
 
 //---------------------------------------------------------------------------
@@ -464,298 +828,3394 @@ DiskCache::DiskCache(Disk *p, int size, int blocks, fsize_t imgoff)
 //---------------------------------------------------------------------------
 DiskCache::~DiskCache()
 {
+	int i;
+
+#ifndef BAREMETAL
+	// ライトバックスレッドを停止(残りは呼び出し元がSaveする)
+	SetWriteBack(FALSE);
+
+	// 非同期の先読みを回収
+	ReadAheadCancel();
+
+	// 先読みスレッドを停止
+	if (ra_run) {
+		pthread_mutex_lock(&ra_lock);
+		ra_run = FALSE;
+		pthread_cond_broadcast(&ra_cond);
+		pthread_mutex_unlock(&ra_lock);
+		pthread_join(ra_thread, NULL);
+	}
+
+	// 先読みトラックを返却
+	for (i = 0; i < ReadAheadMax; i++) {
+		if (ra[i].disktrk) {
+			FreeTrack(ra[i].disktrk);
+			ra[i].disktrk = NULL;
+		}
+	}
+#endif	// BAREMETAL
+
+	// RAM常駐イメージを解放
+	FreeRam();
+
 	// トラックをクリア
 	Clear();
+#ifndef BAREMETAL
+	pthread_cond_destroy(&ra_cond);
+	pthread_mutex_destroy(&ra_lock);
+	pthread_cond_destroy(&wb_cond);
+	pthread_mutex_destroy(&lock);
+#endif	// BAREMETAL
+
+	// トラックプールを解放
+	delete[] pool;
+	free(pool_buf);
+	free(pool_map);
+	free(pool_raw);
+	delete[] pool_free;
+
+	// キャッシュワークを解放
+	delete[] save_iov;
+	delete[] save_list;
+	delete[] hashtbl;
+	delete[] cache;
 }
 
 //---------------------------------------------------------------------------
 //
 //	RAWモード設定
+//	※RAW読み込み用バッファはアタッチ時にプールの全トラック分を確保する
 //
 //---------------------------------------------------------------------------
-void FASTCALL DiskCache::SetRawMode(BOOL raw)
+BOOL FASTCALL DiskCache::SetRawMode(BOOL raw)
 {
+	int i;
+	DWORD rawlen;
+
 	ASSERT(this);
 	ASSERT(sec_size == 11);
+	ASSERT(pool);
+
+	// RAW読み込み用バッファ(先頭セクタのユーザデータから最終セクタのユーザデータまで)
+	if (raw && !pool_raw) {
+		rawlen = (trk_sectors - 1) * 0x930 + (1 << sec_size);
+		pool_raw = (BYTE *)malloc((size_t)rawlen * pool_max);
+		if (!pool_raw) {
+			return FALSE;
+		}
+		memset(pool_raw, 0, (size_t)rawlen * pool_max);
+		for (i = 0; i < pool_max; i++) {
+			pool[i].SetRawBuffer(&pool_raw[(size_t)rawlen * i], rawlen);
+		}
+	}
+
+#ifndef BAREMETAL
+	// RAWモードのセクタはDirectBlockの境界に合わないのでダイレクトI/O解除
+	if (raw && disk->GetFio()->IsDirect()) {
+		disk->GetFio()->SetDirect(FALSE);
+	}
+#endif	// BAREMETAL
+
+	// RAM常駐中は配置が変わるので読み込み直す
+	if (map_ram && raw != cd_raw) {
+		FreeRam();
+		cd_raw = raw;
+		SetRamMode(TRUE);
+		return TRUE;
+	}
 
 	// 設定
 	cd_raw = raw;
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	セーブ
+//	メモリマップモード設定
+//	※イメージ全体をマップし、トラックバッファを経由せずに読み書きする
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskCache::Save()
+BOOL FASTCALL DiskCache::SetMapMode(BOOL map)
 {
-	int i;
-
 	ASSERT(this);
+#ifndef BAREMETAL
+	ASSERT(!wb_run);
+#endif	// BAREMETAL
 
-	// トラックを保存
-	for (i = 0; i < CacheMax; i++) {
-		// 有効なトラックか
-		if (cache[i].disktrk) {
-			// 保存
-			if (!cache[i].disktrk->Save()) {
-				return FALSE;
-			}
+	// 現在のキャッシュ内容を書き戻す
+	if (!SaveAll()) {
+		return FALSE;
+	}
+
+	// 解除
+	if (!map) {
+		if (!map_ram) {
+			mapbuf = NULL;
 		}
+		return TRUE;
 	}
 
-	return TRUE;
+	// RAM常駐中はマップしない
+	if (map_ram) {
+		return FALSE;
+	}
+
+	// オーバーレイ時は差分を重ねられないのでマップしない
+	if (disk->GetOverlay()) {
+		return FALSE;
+	}
+
+	// トラックは不要になるので解放
+	Clear();
+
+	// マップ(失敗した場合は従来のトラックキャッシュで動作する)
+	mapbuf = disk->GetFio()->Map(!disk->IsReadOnly());
+	map_start = 0;
+	map_end = 0;
+
+	return (BOOL)(mapbuf != NULL);
 }
 
 //---------------------------------------------------------------------------
 //
-//	ディスクキャッシュ情報取得
+//	RAM常駐モード設定
+//	※イメージ全体を匿名メモリに読み込み、以後の読み書きはメモリ上で行う
+//	  変更はトラック単位で記録し、Saveとライトバックスレッドで書き戻す
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskCache::GetCache(int index, int& track, DWORD& aserial) const
+BOOL FASTCALL DiskCache::SetRamMode(BOOL ram)
 {
+#ifndef BAREMETAL
+	fsize_t size;
+	fsize_t filesize;
+	fsize_t offset;
+	int length;
+	void *p;
+#endif	// BAREMETAL
+
 	ASSERT(this);
-	ASSERT((index >= 0) && (index < CacheMax));
+#ifndef BAREMETAL
+	ASSERT(!wb_run);
+#endif	// BAREMETAL
 
-	// 未使用ならFALSE
-	if (!cache[index].disktrk) {
+	// 現在のキャッシュ内容を書き戻す
+	if (!SaveAll()) {
 		return FALSE;
 	}
 
-	// トラックとシリアルを設定
-	track = cache[index].disktrk->GetTrack();
-	aserial = cache[index].serial;
+	// 解除
+	if (!ram) {
+		FreeRam();
+		return TRUE;
+	}
+
+#ifndef BAREMETAL
+	// 設定済み
+	if (map_ram) {
+		return TRUE;
+	}
+
+	// メモリマップからは切り替えない
+	if (mapbuf) {
+		return FALSE;
+	}
+
+	// 必要なサイズ(先頭のオフセットも含めてファイルと同じ配置にする)
+	size = GetMapOffset(sec_blocks);
+	if ((fsize_t)(size_t)size != size) {
+		return FALSE;
+	}
 
+	// ヒュージページを試し、駄目なら事前にフォルトさせた通常ページを使う
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	ram_len = (size_t)((size + HugePageSize - 1) & ~(fsize_t)(HugePageSize - 1));
+	p = mmap(NULL, ram_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif	// MAP_HUGETLB
+	if (p == MAP_FAILED) {
+		ram_len = (size_t)size;
+		p = mmap(NULL, ram_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (p == MAP_FAILED) {
+			ram_len = 0;
+			return FALSE;
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(p, ram_len, MADV_HUGEPAGE);
+#endif	// MADV_HUGEPAGE
+	}
+	mapbuf = (BYTE *)p;
+	map_ram = TRUE;
+
+	// 変更済みトラックマップ
+	ram_dirty = (DWORD *)calloc(DiskTrack::MapWords(trk_num), sizeof(DWORD));
+	if (!ram_dirty) {
+		FreeRam();
+		return FALSE;
+	}
+
+	// イメージ全体を読み込む(ファイルに無い末尾は0のまま)
+	filesize = disk->GetFio()->GetFileSize();
+	if (filesize < size) {
+		size = filesize;
+	}
+	for (offset = 0; offset < size; offset += length) {
+		length = RamLoadSize;
+		if (size - offset < length) {
+			length = (int)(size - offset);
+		}
+		if (!disk->GetFio()->ReadAt(&mapbuf[offset], length, offset)) {
+			FreeRam();
+			return FALSE;
+		}
+
+		// オーバーレイの差分を重ねる
+		if (disk->GetOverlay() &&
+			!disk->GetOverlay()->Merge(&mapbuf[offset], length, offset)) {
+			FreeRam();
+			return FALSE;
+		}
+	}
+	cache_stat.readbytes += (UL64)size;
+
+	// トラックは不要になるので解放
+	Clear();
 	return TRUE;
+#else
+	return FALSE;
+#endif	// BAREMETAL
 }
 
 //---------------------------------------------------------------------------
 //
-//	クリア
+//	RAM常駐イメージ解放
 //
 //---------------------------------------------------------------------------
-void FASTCALL DiskCache::Clear()
+void FASTCALL DiskCache::FreeRam()
+{
+	ASSERT(this);
+
+	if (!map_ram) {
+		return;
+	}
+
+#ifndef BAREMETAL
+	munmap(mapbuf, ram_len);
+#endif	// BAREMETAL
+	free(ram_dirty);
+	mapbuf = NULL;
+	map_ram = FALSE;
+	ram_len = 0;
+	ram_dirty = NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	共有キャッシュ取得
+//	※同じイメージ(デバイス、iノード、オフセット、セクタサイズ)を
+//	  読み込み専用で開いている登録済みキャッシュがあれば参照を加えて返す
+//
+//---------------------------------------------------------------------------
+DiskCache* FASTCALL DiskCache::Share(
+	Disk *p, int size, UL64 blocks, fsize_t imgoff)
+{
+#ifndef BAREMETAL
+	dev_t dev;
+	ino_t ino;
+	DiskCache *dcache;
+
+	ASSERT(p);
+
+	if (!p->GetFio()->GetFileId(dev, ino)) {
+		return NULL;
+	}
+
+	for (dcache = share_head; dcache; dcache = dcache->share_next) {
+		if (dcache->share_dev != dev || dcache->share_ino != ino) {
+			continue;
+		}
+		if (dcache->imgoffset != imgoff || dcache->sec_size != size ||
+			dcache->sec_blocks != blocks) {
+			continue;
+		}
+		if (dcache->share_num >= ShareMax) {
+			continue;
+		}
+
+		// 参照を加える
+		dcache->share_user[dcache->share_num++] = p;
+		return dcache;
+	}
+#endif	// BAREMETAL
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	共有キャッシュとして登録
+//	※読み込み専用のイメージに対してのみ呼び出すこと
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Publish()
+{
+	ASSERT(this);
+	ASSERT(!share_pub);
+	ASSERT(share_num == 1);
+
+#ifndef BAREMETAL
+	if (!disk->GetFio()->GetFileId(share_dev, share_ino)) {
+		return;
+	}
+
+	share_next = share_head;
+	share_head = this;
+	share_pub = TRUE;
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	参照解放
+//	※最後の参照であればTRUEを返すので、呼び出し元で削除すること
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Release(Disk *p)
 {
 	int i;
+	DiskCache **link;
 
 	ASSERT(this);
+	ASSERT(p);
+	ASSERT(share_num > 0);
 
-	// キャッシュワークを解放
-	for (i = 0; i < CacheMax; i++) {
-		if (cache[i].disktrk) {
-			delete cache[i].disktrk;
-			cache[i].disktrk = NULL;
+	// 参照を外す
+	for (i = 0; i < share_num; i++) {
+		if (share_user[i] == p) {
+			break;
+		}
+	}
+	ASSERT(i < share_num);
+	share_num--;
+	for (; i < share_num; i++) {
+		share_user[i] = share_user[i + 1];
+	}
+
+	// 他のディスクが使用中
+	if (share_num > 0) {
+		// 読み込み元が外れたら残りのディスクから読む
+		if (disk == p) {
+			Rebind(share_user[0]);
+		}
+		return FALSE;
+	}
+
+	// 共有キャッシュリストから外す
+	if (share_pub) {
+		for (link = &share_head; *link; link = &(*link)->share_next) {
+			if (*link == this) {
+				*link = share_next;
+				break;
+			}
 		}
+		share_pub = FALSE;
 	}
+
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	セクタリード
+//	読み込み元ディスク変更
+//	※旧ディスクのファイルはこの後クローズされる
+//	※他のディスクのコントローラが固定中のトラックがあるので解放しない
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskCache::Read(BYTE *buf, int block)
+void FASTCALL DiskCache::Rebind(Disk *p)
 {
-	int track;
-	DiskTrack *disktrk;
+	int i;
 
 	ASSERT(this);
-	ASSERT(sec_size != 0);
+	ASSERT(p);
 
-	// 先に更新
-	Update();
+	Lock();
 
-	// トラックを算出
-	// セクタ/トラックNumSectorsに固定
-	track = block / DiskTrack::NumSectors;
+#ifndef BAREMETAL
+	// 旧ディスクのファイルから読み込み中の先読みを完了させて破棄
+	ReadAheadCancel();
+#endif	// BAREMETAL
 
-	// そのトラックデータを得る
-	disktrk = Assign(track);
-	if (!disktrk) {
-		return FALSE;
+	// ロード済みのトラックは内容が同じなので読み込み元のみ切り替える
+	disk = p;
+	for (i = 0; i < cache_max; i++) {
+		if (cache[i].disktrk) {
+			cache[i].disktrk->SetDisk(p);
+		}
 	}
 
-	// トラックに任せる
-	block &= DiskTrack::NumSectors - 1;
-	return disktrk->Read(buf, block);
+	// メモリマップは新しいファイルでマップし直す
+	// (RAM常駐イメージは自前で持っているのでそのまま使える)
+	if (mapbuf && !map_ram) {
+		mapbuf = disk->GetFio()->Map(FALSE);
+		map_start = 0;
+		map_end = 0;
+	}
+
+	Unlock();
 }
 
 //---------------------------------------------------------------------------
 //
-//	セクタライト
+//	セーブ
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskCache::Write(const BYTE *buf, int block)
+BOOL FASTCALL DiskCache::Save()
 {
-	int track;
-	DiskTrack *disktrk;
+	BOOL result;
+	DWORD start;
 
 	ASSERT(this);
-	ASSERT(sec_size != 0);
 
-	// 先に更新
-	Update();
+	Lock();
+	start = ::GetTimeUs();
+	result = SaveAll();
+	Flushed(start);
+	Unlock();
 
-	// トラックを算出
-	// セクタ/トラックNumSectorsに固定
-	track = block / DiskTrack::NumSectors;
+	return result;
+}
 
-	// そのトラックデータを得る
-	disktrk = Assign(track);
-	if (!disktrk) {
-		return FALSE;
+//---------------------------------------------------------------------------
+//
+//	全セーブ(ロック済み)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveAll()
+{
+	int i;
+	BOOL result;
+
+	ASSERT(this);
+
+	// RAM常駐イメージの変更済みトラックを書き戻す
+	if (map_ram) {
+		return SaveRam(0, trk_num - 1);
+	}
+
+	// メモリマップの変更範囲を書き戻す
+	if (mapbuf) {
+		if (map_start >= map_end) {
+			return TRUE;
+		}
+		result = disk->GetFio()->Sync(map_start, map_end - map_start);
+		if (result) {
+			cache_stat.writebytes += (UL64)(map_end - map_start);
+		}
+		map_start = 0;
+		map_end = 0;
+		return result;
 	}
 
-	// トラックに任せる
-	block &= DiskTrack::NumSectors - 1;
-	return disktrk->Write(buf, block);
+	// トラックを保存(隣接するものはまとめ、非同期で並行して書き込む)
+	result = TRUE;
+	for (i = 0; i < cache_max; i++) {
+		if (!SaveRun(i, 0, trk_num - 1, TRUE)) {
+			result = FALSE;
+			break;
+		}
+	}
+	if (!SaveWait()) {
+		result = FALSE;
+	}
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックセーブ(ロック済み)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveTrack(int index)
+{
+	int first;
+	int last;
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+
+	// 変更されたトラックのみ
+	if (!cache[index].disktrk || !cache[index].disktrk->IsChanged()) {
+		return TRUE;
+	}
+
+	// 保存
+	cache[index].disktrk->GetChangeRange(first, last);
+	if (!cache[index].disktrk->Save()) {
+		return FALSE;
+	}
+	cache_stat.writebytes += (UL64)((last - first + 1) << sec_size);
+
+	ASSERT(wb_dirty > 0);
+	wb_dirty--;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	連続トラックセーブ(ロック済み)
+//	※指定トラックを含み、first～lastの範囲で連続する変更済みトラックを
+//	  一度のベクタ書き込みで保存する
+//	  async指定時は非同期I/Oで要求だけ行い、SaveWaitで完了を待つ
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveRun(int index, int first, int last, BOOL async)
+{
+	int i;
+	int j;
+	int n;
+	int max;
+	int track;
+	int start;
+	int end;
+	int dummy;
+	int *list;
+	struct iovec *iov;
+	fsize_t offset;
+	DWORD length;
+	DiskTrack *disktrk;
+#ifndef BAREMETAL
+	int id;
+#endif	// BAREMETAL
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+	ASSERT(first <= last);
+
+	// ライトバックスレッドの完了待ちが終わるのを待つ(要求ワークは共有)
+	SaveBusyWait();
+
+	// オーバーレイ時は差分ファイルへ同期で書き込む
+	if (disk->GetOverlay()) {
+		async = FALSE;
+	}
+
+	// 範囲内の変更されたトラックのみ(保存中のものは除く)
+	disktrk = cache[index].disktrk;
+	if (!disktrk || !disktrk->IsChanged() || cache[index].saving) {
+		return TRUE;
+	}
+	track = disktrk->GetTrack();
+	if (track < first || track > last) {
+		return TRUE;
+	}
+
+#ifndef BAREMETAL
+	// 要求の空きがなければ先に完了を待つ
+	if (async && save_num >= Fileio::AsyncMax) {
+		if (!SaveWait()) {
+			return FALSE;
+		}
+	}
+#endif	// BAREMETAL
+
+	// 連続の先頭までさかのぼる
+	i = index;
+	while (track > first) {
+		j = Lookup(track - 1);
+		if (j < 0 || !cache[j].disktrk->IsChanged() || cache[j].saving) {
+			break;
+		}
+		i = j;
+		track--;
+	}
+
+	// 保存中の要求と重ならない領域に集める
+	list = &save_list[save_used];
+	iov = &save_iov[save_used];
+	max = cache_max - save_used;
+	if (async && max > Fileio::WriteVMax) {
+		max = Fileio::WriteVMax;
+	}
+
+	// 連続の末尾まで集める
+	n = 0;
+	while (i >= 0 && track <= last && n < max) {
+		disktrk = cache[i].disktrk;
+		if (!disktrk->IsChanged() || cache[i].saving) {
+			break;
+		}
+		list[n] = i;
+		disktrk->GetChangeRange(start, end);
+
+		// 先頭は最初の変更セクタから、末尾は最後の変更セクタまで
+		// (間の未変更セクタもバッファ上は正しい内容を保持している)
+		if (n > 0) {
+			start = 0;
+		}
+		iov[n].iov_base = disktrk->GetBuffer() + (start << sec_size);
+		iov[n].iov_len = (disktrk->GetSectors() - start) << sec_size;
+		n++;
+
+		// 次のトラック
+		track++;
+		i = Lookup(track);
+	}
+	ASSERT(n > 0);
+
+	// 書き込み位置は先頭のトラックの最初の変更セクタ
+	disktrk = cache[list[0]].disktrk;
+	disktrk->GetChangeRange(start, dummy);
+	offset = disktrk->GetOffset(start);
+
+	// 末尾のトラックは最後の変更セクタまで
+	disktrk = cache[list[n - 1]].disktrk;
+	disktrk->GetChangeRange(dummy, end);
+	iov[n - 1].iov_len -= (disktrk->GetSectors() - 1 - end) << sec_size;
+
+	// 書き込み長(統計用)
+	length = 0;
+	for (i = 0; i < n; i++) {
+		length += (DWORD)iov[i].iov_len;
+	}
+
+#ifndef BAREMETAL
+	// 非同期で要求(できなければ同期書き込み)
+	if (async) {
+		id = disk->GetFio()->SubmitWriteVAt(iov, n, offset);
+		if (id >= 0) {
+			for (i = 0; i < n; i++) {
+				cache[list[i]].saving = TRUE;
+			}
+			save_req[save_num].id = id;
+			save_req[save_num].list = save_used;
+			save_req[save_num].num = n;
+			save_req[save_num].length = length;
+			save_num++;
+			save_used += n;
+			return TRUE;
+		}
+	}
+#endif	// BAREMETAL
+
+	// 書き込み
+	if (disk->GetOverlay()) {
+		if (!disk->GetOverlay()->WriteVAt(iov, n, offset)) {
+			return FALSE;
+		}
+	} else {
+		if (!disk->GetFio()->WriteVAt(iov, n, offset)) {
+			return FALSE;
+		}
+	}
+	cache_stat.writebytes += length;
+
+	// 変更フラグを落とす
+	for (i = 0; i < n; i++) {
+		cache[list[i]].disktrk->ClearChanged();
+		ASSERT(wb_dirty > 0);
+		wb_dirty--;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期セーブ完了待ち(ロック済み)
+//	※unlock指定時は完了を待つ間ロックを開放する(保存中のトラックは
+//	  追い出さず、書き込む場合は完了を待つ)。変更フラグはロックを
+//	  取り直してから落とす
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveWait(BOOL unlock)
+{
+	BOOL result;
+#ifndef BAREMETAL
+	int i;
+	int j;
+	int index;
+	BOOL done;
+#endif	// BAREMETAL
+
+	ASSERT(this);
+
+	// ライトバックスレッドの完了待ちが終わるのを待つ(要求ワークは共有)
+	SaveBusyWait();
+
+	result = TRUE;
+#ifndef BAREMETAL
+	// 完了を待つ
+	if (unlock && save_num > 0) {
+		save_busy = TRUE;
+		pthread_mutex_unlock(&lock);
+	}
+	for (i = 0; i < save_num; i++) {
+		save_req[i].done = disk->GetFio()->Complete(save_req[i].id);
+	}
+	if (unlock && save_num > 0) {
+		pthread_mutex_lock(&lock);
+		save_busy = FALSE;
+	}
+
+	for (i = 0; i < save_num; i++) {
+		done = save_req[i].done;
+		if (done) {
+			cache_stat.writebytes += save_req[i].length;
+		} else {
+			result = FALSE;
+		}
+
+		// 書き込めたものだけ変更フラグを落とす
+		for (j = 0; j < save_req[i].num; j++) {
+			index = save_list[save_req[i].list + j];
+			cache[index].saving = FALSE;
+			if (done) {
+				cache[index].disktrk->ClearChanged();
+				ASSERT(wb_dirty > 0);
+				wb_dirty--;
+			}
+		}
+	}
+#endif	// BAREMETAL
+	save_num = 0;
+	save_used = 0;
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ライトバック完了待ち終了待ち(ロック済み)
+//	※ライトバックスレッドがロックを開放して非同期保存の完了を
+//	  待っている間は、保存中のトラックと要求ワークに触れない
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::SaveBusyWait()
+{
+	ASSERT(this);
+
+#ifndef BAREMETAL
+	while (save_busy) {
+		pthread_mutex_unlock(&lock);
+		usleep(1000);
+		pthread_mutex_lock(&lock);
+	}
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	RAM常駐イメージセーブ(ロック済み)
+//	※first～lastの範囲の変更済みトラックを連続する単位で書き戻す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveRam(int first, int last)
+{
+	int track;
+
+	ASSERT(this);
+	ASSERT(map_ram);
+	ASSERT(first <= last);
+
+#ifndef BAREMETAL
+	// ライトバックスレッドの書き込みが終わるのを待つ
+	while (ram_busy) {
+		pthread_mutex_unlock(&lock);
+		usleep(1000);
+		pthread_mutex_lock(&lock);
+	}
+#endif	// BAREMETAL
+
+	track = first;
+	while (track <= last) {
+		if (!SaveRamRun(track, last)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	RAM常駐連続トラックセーブ(ロック済み)
+//	※track以降で最初に見つかった変更済みトラックから連続する分を
+//	  RamSaveMaxトラックまで書き戻し、trackを次の検索位置へ進める
+//	  unlock指定時は書き込みの間ロックを開放する(書き込み中に変更された
+//	  トラックは再び変更済みとなり次回書き戻される)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SaveRamRun(int& track, int last, BOOL unlock)
+{
+	BOOL result;
+	int n;
+	UL64 end;
+	fsize_t offset;
+	fsize_t length;
+
+	ASSERT(this);
+	ASSERT(map_ram);
+	ASSERT(ram_dirty);
+	ASSERT(track >= 0);
+
+	// 最初の変更済みトラックを探す(32トラック単位で読み飛ばす)
+	while (track <= last) {
+		if (ram_dirty[track >> 5] == 0) {
+			track = (track | 31) + 1;
+			continue;
+		}
+		if (ram_dirty[track >> 5] & ((DWORD)1 << (track & 31))) {
+			break;
+		}
+		track++;
+	}
+	if (track > last) {
+		return TRUE;
+	}
+
+	// 連続する変更済みトラックを集め、変更フラグを落とす
+	n = 0;
+	while (track + n <= last && n < RamSaveMax &&
+		(ram_dirty[(track + n) >> 5] & ((DWORD)1 << ((track + n) & 31)))) {
+		ram_dirty[(track + n) >> 5] &= ~((DWORD)1 << ((track + n) & 31));
+		n++;
+	}
+	ASSERT(n > 0);
+
+	// 範囲を算出(最終トラックはディスク終端まで)
+	end = (UL64)(track + n) << trk_shift;
+	if (end > sec_blocks) {
+		end = sec_blocks;
+	}
+	offset = GetMapOffset((UL64)track << trk_shift);
+	length = GetMapOffset(end) - offset;
+
+	// 書き込み
+#ifndef BAREMETAL
+	if (unlock) {
+		ram_busy = TRUE;
+		pthread_mutex_unlock(&lock);
+	}
+#endif	// BAREMETAL
+	if (disk->GetOverlay()) {
+		result = disk->GetOverlay()->WriteAt(
+			&mapbuf[offset], (int)length, offset);
+	} else {
+		result = disk->GetFio()->WriteAt(&mapbuf[offset], (int)length, offset);
+	}
+#ifndef BAREMETAL
+	if (unlock) {
+		pthread_mutex_lock(&lock);
+		ram_busy = FALSE;
+	}
+#endif	// BAREMETAL
+	if (!result) {
+		// 書き込めなかったトラックは変更済みに戻す
+		while (n > 0) {
+			n--;
+			ram_dirty[(track + n) >> 5] |= (DWORD)1 << ((track + n) & 31);
+		}
+		return FALSE;
+	}
+	cache_stat.writebytes += (UL64)length;
+
+	track += n;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	範囲同期
+//	※指定範囲の変更を書き戻し、媒体へ反映されるまで待つ(countが0なら全体)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Sync(UL64 block, int count)
+{
+	int i;
+	UL64 first;
+	UL64 last;
+	BOOL result;
+	DWORD start;
+
+	ASSERT(this);
+	ASSERT(count >= 0);
+
+	// 範囲(ブロック)
+	if (count == 0) {
+		first = 0;
+		last = sec_blocks - 1;
+	} else {
+		first = block;
+		last = block + count - 1;
+		if (last >= sec_blocks) {
+			last = sec_blocks - 1;
+		}
+	}
+
+	Lock();
+	start = ::GetTimeUs();
+	result = TRUE;
+	if (map_ram) {
+		// 範囲に掛かる変更済みトラックを保存
+		result = SaveRam((int)(first >> trk_shift), (int)(last >> trk_shift));
+	} else if (mapbuf) {
+		// メモリマップの該当範囲を同期書き込み
+		if (!disk->GetFio()->Sync(GetMapOffset(first),
+			GetMapOffset(last + 1) - GetMapOffset(first), TRUE)) {
+			result = FALSE;
+		}
+	} else {
+		// 範囲に掛かる変更済みトラックを保存
+		for (i = 0; i < cache_max; i++) {
+			if (!cache[i].disktrk) {
+				continue;
+			}
+			if (!SaveRun(i, (int)(first >> trk_shift),
+				(int)(last >> trk_shift), TRUE)) {
+				result = FALSE;
+			}
+		}
+		if (!SaveWait()) {
+			result = FALSE;
+		}
+	}
+	Unlock();
+
+	// 媒体への反映を待つ(オーバーレイ時は差分ファイル)
+	if (result && (!mapbuf || map_ram)) {
+		if (disk->GetOverlay()) {
+			result = disk->GetOverlay()->Flush();
+		} else {
+			result = disk->GetFio()->Flush();
+		}
+	}
+
+	// 媒体への反映までを同期時間とする
+	Lock();
+	Flushed(start);
+	Unlock();
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ディスクキャッシュ情報取得
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::GetCache(int index, int& track, DWORD& aserial) const
+{
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+
+	// 未使用ならFALSE
+	if (!cache[index].disktrk) {
+		return FALSE;
+	}
+
+	// トラックとシリアルを設定
+	track = cache[index].disktrk->GetTrack();
+	aserial = cache[index].serial;
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	統計取得
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::GetStat(cachestat_t *buffer)
+{
+	int i;
+	int track;
+	int words;
+	DWORD aserial;
+
+	ASSERT(this);
+	ASSERT(buffer);
+
+	Lock();
+	*buffer = cache_stat;
+
+	// 使用中トラック
+	buffer->used = 0;
+	for (i = 0; i < cache_max; i++) {
+		if (GetCache(i, track, aserial)) {
+			buffer->used++;
+		}
+	}
+
+	// 変更済みトラック(RAM常駐は変更済みトラックマップから数える)
+	if (map_ram) {
+		buffer->dirty = 0;
+		words = DiskTrack::MapWords(trk_num);
+		for (i = 0; i < words; i++) {
+			buffer->dirty += __builtin_popcount(ram_dirty[i]);
+		}
+	} else {
+		buffer->dirty = wb_dirty;
+	}
+	Unlock();
+
+#ifndef BAREMETAL
+	// 先読み量
+	pthread_mutex_lock(&ra_lock);
+	buffer->readbytes += ra_bytes;
+	pthread_mutex_unlock(&ra_lock);
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	同期時間の記録(ロック済み)
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Flushed(DWORD start)
+{
+	DWORD time;
+
+	ASSERT(this);
+
+	time = ::GetTimeUs() - start;
+	cache_stat.flushes++;
+	cache_stat.flushtime += time;
+	if (time > cache_stat.flushmax) {
+		cache_stat.flushmax = time;
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	クリア
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Clear()
+{
+	int i;
+
+	ASSERT(this);
+
+	// ライトバックスレッドの書き込みが終わるのを待つ
+	SaveBusyWait();
+
+#ifndef BAREMETAL
+	// 先読み結果を破棄
+	ReadAheadCancel();
+#endif	// BAREMETAL
+
+	// トラックをプールへ返却し、全て空きリストへ
+	for (i = 0; i < cache_max; i++) {
+		if (cache[i].disktrk) {
+			FreeTrack(cache[i].disktrk);
+			cache[i].disktrk = NULL;
+		}
+		cache[i].hnext = -1;
+		cache[i].prev = -1;
+		cache[i].next = (i + 1 < cache_max) ? (i + 1) : -1;
+		cache[i].pin = 0;
+	}
+	free_head = 0;
+	wb_dirty = 0;
+
+	// LRUリストは空
+	lru_head = -1;
+	lru_tail = -1;
+
+	// ハッシュテーブルをクリア
+	for (i = 0; i <= hash_mask; i++) {
+		hashtbl[i] = -1;
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタリード
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Read(BYTE *buf, UL64 block, int count)
+{
+	BOOL result;
+
+	ASSERT(this);
+
+	Lock();
+	result = ReadSector(buf, block, count);
+	Unlock();
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタリード(ロック済み)
+//	※複数セクタはトラック毎にまとめて処理する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::ReadSector(BYTE *buf, UL64 block, int count)
+{
+	int track;
+	int sec;
+	int num;
+	int i;
+	DiskTrack *disktrk;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(count > 0);
+
+	// メモリマップから直接コピー
+	if (mapbuf) {
+		ASSERT(block + count <= sec_blocks);
+		if (cd_raw) {
+			// RAWモードはセクタ毎にヘッダを挟むので個別にコピー
+			for (i = 0; i < count; i++) {
+				memcpy(&buf[i << sec_size],
+					&mapbuf[GetMapOffset(block + i)], 1 << sec_size);
+			}
+		} else {
+			memcpy(buf, &mapbuf[GetMapOffset(block)], count << sec_size);
+		}
+		cache_stat.hits += count;
+		return TRUE;
+	}
+
+	while (count > 0) {
+		// 先に更新
+		Update();
+
+		// トラックを算出
+		// セクタ/トラックはtrk_sectorsに固定
+		track = (int)(block >> trk_shift);
+		sec = (int)(block & (trk_sectors - 1));
+		num = trk_sectors - sec;
+		if (num > count) {
+			num = count;
+		}
+
+		// そのトラックデータを得る
+		disktrk = Assign(track);
+		if (!disktrk) {
+			return FALSE;
+		}
+
+		// 割り当て以外のセクタはヒットとして数える
+		cache_stat.hits += num - 1;
+
+#ifndef BAREMETAL
+		// 連続アクセスの検出
+		ReadAheadCheck(block, num);
+#endif	// BAREMETAL
+
+		// トラックに任せる
+		if (!disktrk->Read(buf, sec, num)) {
+			return FALSE;
+		}
+
+		// 次のトラックへ
+		buf += num << sec_size;
+		block += num;
+		count -= num;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタ比較
+//	※一致したかどうかはsameに返す。不一致のトラックで打ち切る
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Compare(
+	const BYTE *buf, UL64 block, int count, BOOL& same)
+{
+	int track;
+	int sec;
+	int num;
+	int i;
+	DiskTrack *disktrk;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(count > 0);
+
+	Lock();
+	same = TRUE;
+
+	// メモリマップと直接比較
+	if (mapbuf) {
+		ASSERT(block + count <= sec_blocks);
+		for (i = 0; i < count && same; i++) {
+			same = (memcmp(&buf[i << sec_size],
+				&mapbuf[GetMapOffset(block + i)], 1 << sec_size) == 0);
+		}
+		cache_stat.hits += count;
+		Unlock();
+		return TRUE;
+	}
+
+	while (count > 0 && same) {
+		// 先に更新
+		Update();
+
+		// トラックを算出
+		track = (int)(block >> trk_shift);
+		sec = (int)(block & (trk_sectors - 1));
+		num = trk_sectors - sec;
+		if (num > count) {
+			num = count;
+		}
+
+		// そのトラックデータを得る
+		disktrk = Assign(track);
+		if (!disktrk) {
+			Unlock();
+			return FALSE;
+		}
+
+		// 割り当て以外のセクタはヒットとして数える
+		cache_stat.hits += num - 1;
+
+#ifndef BAREMETAL
+		// 連続アクセスの検出
+		ReadAheadCheck(block, num);
+#endif	// BAREMETAL
+
+		// トラックに任せる
+		if (!disktrk->Compare(buf, sec, num, same)) {
+			Unlock();
+			return FALSE;
+		}
+
+		// 次のトラックへ
+		buf += num << sec_size;
+		block += num;
+		count -= num;
+	}
+
+	Unlock();
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタ参照の固定
+//	※トラックバッファ(またはメモリマップ)内を直接指すポインタを返す
+//	※固定したトラックはUnpinまで追い出さない。戻り値は固定したセクタ数
+//
+//---------------------------------------------------------------------------
+int FASTCALL DiskCache::Pin(UL64 block, int count, BYTE **ptr)
+{
+	int track;
+	int sec;
+	int num;
+	int index;
+	DiskTrack *disktrk;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(count > 0);
+	ASSERT(ptr);
+
+	Lock();
+
+	// メモリマップは開いている間は動かないので固定は不要
+	if (mapbuf) {
+		ASSERT(block + count <= sec_blocks);
+		if (cd_raw) {
+			// RAWモードはセクタが連続しない
+			Unlock();
+			return 0;
+		}
+		*ptr = &mapbuf[GetMapOffset(block)];
+		cache_stat.hits += count;
+		Unlock();
+		return count;
+	}
+
+	// 先に更新
+	Update();
+
+	// トラックを算出し、トラック内に収まる分だけ対象とする
+	track = (int)(block >> trk_shift);
+	sec = (int)(block & (trk_sectors - 1));
+	num = trk_sectors - sec;
+	if (num > count) {
+		num = count;
+	}
+
+	// そのトラックデータを得る
+	disktrk = Assign(track);
+	if (!disktrk || sec + num > disktrk->GetSectors()) {
+		Unlock();
+		return 0;
+	}
+	cache_stat.hits += num - 1;
+
+#ifndef BAREMETAL
+	// 連続アクセスの検出
+	ReadAheadCheck(block, num);
+#endif	// BAREMETAL
+
+	// 固定
+	index = Lookup(track);
+	ASSERT(index >= 0);
+	cache[index].pin++;
+	*ptr = &disktrk->GetBuffer()[sec << sec_size];
+
+	Unlock();
+	return num;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタ参照の固定解除
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Unpin(UL64 block)
+{
+	int index;
+
+	ASSERT(this);
+
+	Lock();
+
+	// メモリマップは固定していない
+	if (!mapbuf) {
+		index = Lookup((int)(block >> trk_shift));
+		ASSERT(index >= 0);
+		if (index >= 0) {
+			ASSERT(cache[index].pin > 0);
+			cache[index].pin--;
+		}
+	}
+
+	Unlock();
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタの取り寄せ
+//	※キャッシュに無いトラックを先読みで読み込み始める
+//	※取り寄せ中(読み込みの完了を待つ必要がある)ならTRUE
+//	  揃っている、または取り寄せられなければFALSE
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Prefetch(UL64 block, int count)
+{
+#ifndef BAREMETAL
+	int first;
+	int last;
+	int t;
+	int i;
+	int c;
+	BOOL wait;
+	BOOL wake;
+
+	ASSERT(this);
+	ASSERT(count > 0);
+
+	// メモリマップとRAM常駐は常に揃っている
+	if (mapbuf) {
+		return FALSE;
+	}
+
+	// 先読みが無効なら取り寄せない
+	if (ra_depth <= 0) {
+		return FALSE;
+	}
+
+	// 先頭から先読みできるトラック数までを対象とする
+	first = (int)(block >> trk_shift);
+	last = (int)((block + count - 1) >> trk_shift);
+	if (last >= first + ReadAheadMax) {
+		last = first + ReadAheadMax - 1;
+	}
+
+	wait = FALSE;
+	wake = FALSE;
+	Lock();
+	pthread_mutex_lock(&ra_lock);
+
+	// 完了した非同期読み込みを回収
+	for (i = 0; i < ReadAheadMax; i++) {
+		if (ra[i].aio >= 0 && ra[i].disktrk->IsComplete(ra[i].aio)) {
+			ReadAheadFinish(i);
+		}
+	}
+
+	for (t = first; t <= last; t++) {
+		// キャッシュ済み
+		if (Lookup(t) >= 0) {
+			continue;
+		}
+
+		// 要求済みか調べつつ、空きを探す(空きが無ければ範囲外の読み込み済み
+		// を譲ってもらう)
+		c = -1;
+		for (i = 0; i < ReadAheadMax; i++) {
+			if (ra[i].state != ReadAheadFree && ra[i].track == t) {
+				break;
+			}
+			if (ra[i].state == ReadAheadFree) {
+				if (c < 0 || ra[c].state != ReadAheadFree) {
+					c = i;
+				}
+			} else if (c < 0 && ra[i].state == ReadAheadDone &&
+				(ra[i].track < first || ra[i].track > last)) {
+				c = i;
+			}
+		}
+
+		// 要求済みなら読み込み完了まで待つ
+		if (i < ReadAheadMax) {
+			if (ra[i].state != ReadAheadDone) {
+				wait = TRUE;
+			}
+			continue;
+		}
+
+		// 空きがなければ先読みの完了を待つ
+		if (c < 0) {
+			wait = TRUE;
+			break;
+		}
+
+		// 読み込み開始
+		if (ReadAheadStart(c, t)) {
+			wake = TRUE;
+		}
+		wait = TRUE;
+	}
+
+	// スレッドを起動(起動できなければ待たない)
+	if (wake && !ReadAheadWake()) {
+		wait = FALSE;
+	}
+	pthread_cond_broadcast(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+	Unlock();
+
+	return wait;
+#else
+	// 先読みスレッドが無いので取り寄せない
+	return FALSE;
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタライト
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Write(const BYTE *buf, UL64 block, int count)
+{
+	BOOL result;
+
+	ASSERT(this);
+
+	Lock();
+	result = WriteSector(buf, block, count);
+	Unlock();
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタライト(ロック済み)
+//	※複数セクタはトラック毎にまとめて処理する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::WriteSector(const BYTE *buf, UL64 block, int count)
+{
+	int track;
+	int sec;
+	int num;
+	DiskTrack *disktrk;
+	fsize_t offset;
+	int length;
+	BOOL changed;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(count > 0);
+
+	// メモリマップ(RAM常駐)へ直接コピーし、変更範囲を記録
+	if (mapbuf) {
+		ASSERT(block + count <= sec_blocks);
+		ASSERT(!cd_raw);
+		cache_stat.hits += count;
+		offset = GetMapOffset(block);
+		length = count << sec_size;
+		if (memcmp(&mapbuf[offset], buf, length) == 0) {
+			// 同じものを書き込もうとしているので、正常終了
+			return TRUE;
+		}
+		memcpy(&mapbuf[offset], buf, length);
+		if (map_ram) {
+			// RAM常駐はトラック単位で記録
+			for (track = (int)(block >> trk_shift);
+				track <= (int)((block + count - 1) >> trk_shift); track++) {
+				ram_dirty[track >> 5] |= (DWORD)1 << (track & 31);
+			}
+		} else if (map_start >= map_end) {
+			map_start = offset;
+			map_end = offset + length;
+		} else {
+			if (offset < map_start) {
+				map_start = offset;
+			}
+			if (offset + length > map_end) {
+				map_end = offset + length;
+			}
+		}
+		return TRUE;
+	}
+
+	while (count > 0) {
+		// 先に更新
+		Update();
+
+		// トラックを算出
+		// セクタ/トラックはtrk_sectorsに固定
+		track = (int)(block >> trk_shift);
+		sec = (int)(block & (trk_sectors - 1));
+		num = trk_sectors - sec;
+		if (num > count) {
+			num = count;
+		}
+
+		// そのトラックデータを得る
+		disktrk = Assign(track);
+		if (!disktrk) {
+			return FALSE;
+		}
+
+		// 書き戻し中のトラックはバッファを変更できないので完了を待つ
+		if (cache[Lookup(track)].saving) {
+			SaveBusyWait();
+			continue;
+		}
+
+		// 割り当て以外のセクタはヒットとして数える
+		cache_stat.hits += num - 1;
+
+		// トラックに任せる
+		changed = disktrk->IsChanged();
+		if (!disktrk->Write(buf, sec, num)) {
+			return FALSE;
+		}
+
+		// 新たに変更されたトラックを記録
+		if (!changed && disktrk->IsChanged()) {
+			wb_dirty++;
+#ifndef BAREMETAL
+			cache[Lookup(track)].dirtytime = GetTimeMs();
+
+			// 変更量が閾値を超えたらライトバックを促す
+			if (wb_run && wb_dirty >= wb_limit) {
+				pthread_cond_signal(&wb_cond);
+			}
+#endif	// BAREMETAL
+		}
+
+		// 次のトラックへ
+		buf += num << sec_size;
+		block += num;
+		count -= num;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セクタゼロ化
+//	※イメージはファイルシステムの操作でゼロにし、キャッシュは範囲に収まる
+//	  トラックを保存せずに捨てる。範囲に掛かるだけのトラックはゼロを書き込む
+//	  unmap指定時はイメージの領域の割り当ても解放する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Zero(UL64 block, int count, BOOL unmap)
+{
+	int i;
+	int track;
+	int first;
+	int last;
+	int full;
+	int tail;
+	UL64 start;
+	UL64 end;
+	fsize_t offset;
+	fsize_t length;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(!cd_raw);
+	ASSERT(count > 0);
+	ASSERT(block + count <= sec_blocks);
+
+	Lock();
+
+#ifndef BAREMETAL
+	// 先読み結果は古い内容なので破棄
+	ReadAheadCancel();
+#endif	// BAREMETAL
+
+	offset = GetMapOffset(block);
+	length = GetMapOffset(block + count) - offset;
+	first = (int)(block >> trk_shift);
+	last = (int)((block + count - 1) >> trk_shift);
+
+	// RAM常駐
+	if (map_ram) {
+#ifndef BAREMETAL
+		// ライトバックスレッドの書き込みが終わるのを待つ
+		while (ram_busy) {
+			pthread_mutex_unlock(&lock);
+			usleep(1000);
+			pthread_mutex_lock(&lock);
+		}
+#endif	// BAREMETAL
+
+		// RAMをゼロにする
+		memset(&mapbuf[offset], 0, (size_t)length);
+
+		// 範囲に収まるトラック(最終トラックはディスク終端まで)
+		full = (int)((block + trk_sectors - 1) >> trk_shift);
+		tail = (int)((block + count) >> trk_shift) - 1;
+		if (block + count == sec_blocks) {
+			tail = last;
+		}
+
+		// 収まるトラックはイメージ側でゼロにし、掛かるだけのものは書き戻す
+		result = TRUE;
+		if (full <= tail) {
+			end = (UL64)(tail + 1) << trk_shift;
+			if (end > sec_blocks) {
+				end = sec_blocks;
+			}
+			start = (UL64)full << trk_shift;
+			result = ZeroFile(GetMapOffset(start),
+				GetMapOffset(end) - GetMapOffset(start), unmap);
+		}
+		for (track = first; track <= last; track++) {
+			if (result && track >= full && track <= tail) {
+				ram_dirty[track >> 5] &= ~((DWORD)1 << (track & 31));
+			} else {
+				ram_dirty[track >> 5] |= (DWORD)1 << (track & 31);
+			}
+		}
+
+		Unlock();
+		return result;
+	}
+
+	// メモリマップはイメージをゼロにすればマップにも反映される
+	if (mapbuf) {
+		result = ZeroFile(offset, length, unmap);
+		Unlock();
+		return result;
+	}
+
+	// 非同期保存を完了させておく
+	result = SaveWait();
+
+	// 範囲に掛かるキャッシュ済みトラック
+	for (i = 0; i < cache_max; i++) {
+		if (!cache[i].disktrk) {
+			continue;
+		}
+		track = cache[i].disktrk->GetTrack();
+		if (track < first || track > last) {
+			continue;
+		}
+		start = (UL64)track << trk_shift;
+		end = start + cache[i].disktrk->GetSectors();
+
+		// 範囲に収まるトラックは保存せずに捨てる(固定中は除く)
+		if (start >= block && end <= block + count && cache[i].pin == 0) {
+			if (cache[i].disktrk->IsChanged()) {
+				cache[i].disktrk->ClearChanged();
+				ASSERT(wb_dirty > 0);
+				wb_dirty--;
+			}
+			Unlink(i);
+			Unhash(i);
+			FreeTrack(cache[i].disktrk);
+			cache[i].disktrk = NULL;
+			cache[i].next = free_head;
+			free_head = i;
+			continue;
+		}
+
+		// 掛かるだけのトラックは該当するセクタにゼロを書き込む
+		if (start < block) {
+			start = block;
+		}
+		if (end > block + count) {
+			end = block + count;
+		}
+		ASSERT(end - start <= (UL64)trk_sectors);
+		if (!WriteSector(pool_zero, start, (int)(end - start))) {
+			result = FALSE;
+		}
+	}
+
+	// イメージをゼロにする
+	if (result) {
+		result = ZeroFile(offset, length, unmap);
+	}
+
+	Unlock();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	イメージ上の範囲のゼロ化(ロック済み)
+//	※ファイルシステムが対応していなければゼロを書き込む
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::ZeroFile(fsize_t offset, fsize_t length, BOOL unmap)
+{
+	Fileio *fio;
+	BYTE *zero;
+	int n;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(length > 0);
+
+	// オーバーレイ時は差分ファイルをゼロにする
+	if (disk->GetOverlay()) {
+		return disk->GetOverlay()->ZeroAt(offset, length);
+	}
+
+	// ファイルシステムに依頼
+	fio = disk->GetFio();
+	if (fio->ZeroAt(offset, length, unmap)) {
+		return TRUE;
+	}
+
+	// 対応していなければゼロを書き込む
+	zero = (BYTE *)Fileio::AllocBuffer(ZeroMax);
+	if (!zero) {
+		return FALSE;
+	}
+	memset(zero, 0, ZeroMax);
+	result = TRUE;
+	while (result && length > 0) {
+		n = ZeroMax;
+		if ((fsize_t)n > length) {
+			n = (int)length;
+		}
+		result = fio->WriteAt(zero, n, offset);
+		if (result) {
+			cache_stat.writebytes += (UL64)n;
+		}
+		offset += n;
+		length -= n;
+	}
+	free(zero);
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックの割り当て
+//
+//---------------------------------------------------------------------------
+DiskTrack* FASTCALL DiskCache::Assign(int track)
+{
+	int i;
+	DWORD start;
+	DiskTrack *disktrk;
+
+	ASSERT(this);
+	ASSERT(sec_size != 0);
+	ASSERT(track >= 0);
+
+	// まず、既に割り当てされていないかハッシュで調べる
+	i = Lookup(track);
+	if (i >= 0) {
+		// トラックが一致、LRUの先頭へ
+		Unlink(i);
+		LinkHead(i);
+		cache[i].serial = serial;
+		cache_stat.hits++;
+		return cache[i].disktrk;
+	}
+
+	// ここからはロード(先読み済みの取り込みを含む)を待つ時間
+	start = ::GetTimeUs();
+
+	// 次に、空いているものがあればそれを使う
+	if (free_head >= 0) {
+		i = free_head;
+		free_head = cache[i].next;
+		disktrk = AllocTrack();
+	} else {
+		// 最後に、LRUの末尾(最も古いもの)を追い出す(固定中と保存中は除く)
+		for (;;) {
+			i = lru_tail;
+			while (i >= 0 && (cache[i].pin > 0 || cache[i].saving)) {
+				i = cache[i].prev;
+			}
+			if (i >= 0 || !save_busy) {
+				break;
+			}
+
+			// 保存中のものしか無ければ完了を待つ
+			SaveBusyWait();
+		}
+		if (i < 0) {
+			return NULL;
+		}
+		ASSERT(cache[i].disktrk);
+
+		// このトラックを保存
+		if (!SaveTrack(i)) {
+			return NULL;
+		}
+
+		// このトラックを削除(オブジェクトは再利用する)
+		Unlink(i);
+		Unhash(i);
+		disktrk = cache[i].disktrk;
+		cache[i].disktrk = NULL;
+		cache_stat.evictions++;
+	}
+
+#ifndef BAREMETAL
+	// 先読み済みであれば取り込む(追い出したオブジェクトは先読みへ回す)
+	if (ReadAheadTake(track, &disktrk)) {
+		ASSERT(disktrk);
+		cache[i].disktrk = disktrk;
+		Hash(i);
+		LinkHead(i);
+		cache[i].serial = serial;
+		cache_stat.prefetch++;
+		cache_stat.loadtime += ::GetTimeUs() - start;
+		return cache[i].disktrk;
+	}
+#endif	// BAREMETAL
+
+	// ロード
+	cache_stat.misses++;
+	if (!Load(i, track, disktrk)) {
+		// ロード失敗、空きリストへ戻す(トラックはLoadが返却済み)
+		cache[i].next = free_head;
+		free_head = i;
+		return NULL;
+	}
+
+	// ロード成功、ハッシュとLRUの先頭へ登録
+	Hash(i);
+	LinkHead(i);
+	cache[i].serial = serial;
+	cache_stat.readbytes += (UL64)(cache[i].disktrk->GetSectors() << sec_size);
+	cache_stat.loadtime += ::GetTimeUs() - start;
+	return cache[i].disktrk;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックの検索
+//
+//---------------------------------------------------------------------------
+int FASTCALL DiskCache::Lookup(int track) const
+{
+	int i;
+
+	ASSERT(this);
+	ASSERT(track >= 0);
+
+	// ハッシュチェインをたどる
+	for (i = hashtbl[track & hash_mask]; i >= 0; i = cache[i].hnext) {
+		ASSERT(cache[i].disktrk);
+		if (cache[i].disktrk->GetTrack() == track) {
+			return i;
+		}
+	}
+
+	// 見つからない
+	return -1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ハッシュ登録
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Hash(int index)
+{
+	int h;
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+	ASSERT(cache[index].disktrk);
+
+	h = cache[index].disktrk->GetTrack() & hash_mask;
+	cache[index].hnext = hashtbl[h];
+	hashtbl[h] = index;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ハッシュ削除
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Unhash(int index)
+{
+	int *link;
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+	ASSERT(cache[index].disktrk);
+
+	// チェインから外す
+	link = &hashtbl[cache[index].disktrk->GetTrack() & hash_mask];
+	while (*link >= 0) {
+		if (*link == index) {
+			*link = cache[index].hnext;
+			break;
+		}
+		link = &cache[*link].hnext;
+	}
+	cache[index].hnext = -1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	LRUリスト先頭へ追加
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::LinkHead(int index)
+{
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+
+	cache[index].prev = -1;
+	cache[index].next = lru_head;
+	if (lru_head >= 0) {
+		cache[lru_head].prev = index;
+	} else {
+		lru_tail = index;
+	}
+	lru_head = index;
+}
+
+//---------------------------------------------------------------------------
+//
+//	LRUリストから削除
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Unlink(int index)
+{
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+
+	if (cache[index].prev >= 0) {
+		cache[cache[index].prev].next = cache[index].next;
+	} else {
+		lru_head = cache[index].next;
+	}
+	if (cache[index].next >= 0) {
+		cache[cache[index].next].prev = cache[index].prev;
+	} else {
+		lru_tail = cache[index].prev;
+	}
+	cache[index].prev = -1;
+	cache[index].next = -1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックのロード
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::Load(int index, int track, DiskTrack *disktrk)
+{
+	int sectors;
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < cache_max));
+	ASSERT(track >= 0);
+	ASSERT(!cache[index].disktrk);
+
+	// このトラックのセクタ数を取得
+	sectors = GetSectors(track);
+
+	// ディスクトラックを初期化
+	ASSERT(disktrk);
+	disktrk->Init(
+		disk, track, sec_size, sectors, trk_sectors, cd_raw, imgoffset);
+
+	// ロードを試みる
+	if (!disktrk->Load()) {
+		// 失敗、プールへ返却
+		FreeTrack(disktrk);
+		return FALSE;
+	}
+
+	// 割り当て成功、ワークを設定
+	cache[index].disktrk = disktrk;
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックのセクタ数取得
+//
+//---------------------------------------------------------------------------
+int FASTCALL DiskCache::GetSectors(int track) const
+{
+	int sectors;
+
+	ASSERT(this);
+	ASSERT(track >= 0);
+
+	ASSERT(track < trk_num);
+
+	// 最終トラックのみディスク終端まで
+	sectors = trk_sectors;
+	if (track == trk_num - 1) {
+		sectors = (int)(sec_blocks - ((UL64)track << trk_shift));
+	}
+
+	return sectors;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラックプール初期化
+//	※アタッチ時に全トラック分を確保し、コマンド処理中はmallocしない
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::InitPool(int tracks)
+{
+	int i;
+	int words;
+	DWORD length;
+
+	ASSERT(this);
+	ASSERT(tracks > 0);
+
+	pool = NULL;
+	pool_raw = NULL;
+	pool_free = new DiskTrack*[tracks];
+	pool_max = tracks;
+	pool_num = 0;
+
+	// スラブを確保(1トラックあたり最大セクタ数分、ダイレクトI/O用に境界合わせ)
+	// ※末尾にゼロ化で書き込むためのゼロのトラックを1つ加える
+	length = trk_sectors << sec_size;
+	words = DiskTrack::MapWords(trk_sectors);
+	pool_zero = NULL;
+	pool_buf = (BYTE *)Fileio::AllocBuffer((size_t)length * (tracks + 1));
+	pool_map = (DWORD *)malloc(sizeof(DWORD) * words * tracks);
+	if (!pool_buf || !pool_map) {
+		free(pool_buf);
+		free(pool_map);
+		pool_buf = NULL;
+		pool_map = NULL;
+		return FALSE;
+	}
+
+	// ページを確定させておく(バスの処理中にページフォールトさせない)
+	memset(pool_buf, 0, (size_t)length * (tracks + 1));
+	memset(pool_map, 0, sizeof(DWORD) * words * tracks);
+	pool_zero = &pool_buf[(size_t)length * tracks];
+
+	// トラックにバッファを割り当てて空きスタックへ
+	pool = new DiskTrack[tracks];
+	for (i = 0; i < tracks; i++) {
+		pool[i].SetBuffer(&pool_buf[(size_t)length * i], length,
+			&pool_map[words * i], words);
+		pool_free[pool_num] = &pool[i];
+		pool_num++;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラック確保
+//	※プールはキャッシュ数と先読み数の合計分あるので不足しない
+//
+//---------------------------------------------------------------------------
+DiskTrack* FASTCALL DiskCache::AllocTrack()
+{
+	ASSERT(this);
+
+	// プールから取り出す
+	if (pool_num == 0) {
+		ASSERT(FALSE);
+		return NULL;
+	}
+	pool_num--;
+	return pool_free[pool_num];
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラック返却
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::FreeTrack(DiskTrack *disktrk)
+{
+	ASSERT(this);
+	ASSERT(disktrk);
+	ASSERT(disktrk->IsPool());
+	ASSERT(pool_num < pool_max);
+
+	// プールへ戻す
+	pool_free[pool_num] = disktrk;
+	pool_num++;
+}
+
+#ifndef BAREMETAL
+//---------------------------------------------------------------------------
+//
+//	ライトバック設定
+//	※有効にすると変更済みトラックを別スレッドで書き戻す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::SetWriteBack(BOOL enable)
+{
+	pthread_attr_t attr;
+	struct sched_param schedparam;
+
+	ASSERT(this);
+
+	// 停止
+	if (!enable) {
+		if (wb_run) {
+			pthread_mutex_lock(&lock);
+			wb_run = FALSE;
+			pthread_cond_broadcast(&wb_cond);
+			pthread_mutex_unlock(&lock);
+			pthread_join(wb_thread, NULL);
+		}
+		return TRUE;
+	}
+
+	// 起動済み
+	if (wb_run) {
+		return TRUE;
+	}
+
+	// バススレッドの優先度を継承しないよう通常スケジューリングで生成
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	schedparam.sched_priority = 0;
+	pthread_attr_setschedparam(&attr, &schedparam);
+
+	wb_run = TRUE;
+	if (pthread_create(&wb_thread, &attr, WriteBackThread, this) != 0) {
+		wb_run = FALSE;
+	}
+	pthread_attr_destroy(&attr);
+
+	return wb_run;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ライトバックスレッド
+//
+//---------------------------------------------------------------------------
+void* DiskCache::WriteBackThread(void *param)
+{
+	DiskCache *self;
+
+	self = (DiskCache *)param;
+	ASSERT(self);
+
+	self->WriteBackMain();
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ライトバックスレッド主処理
+//	※一定時間経過したトラックと、閾値を超えた時は全ての変更を書き戻す
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::WriteBackMain()
+{
+	int i;
+	BOOL force;
+	DWORD now;
+	struct timespec ts;
+
+	ASSERT(this);
+
+	pthread_mutex_lock(&lock);
+	while (wb_run) {
+		// 一定間隔または閾値超過の通知で起床
+		if (wb_dirty < wb_limit) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += WriteBackInterval * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&wb_cond, &lock, &ts);
+			if (!wb_run) {
+				break;
+			}
+		}
+
+		// RAM常駐は変更済みトラックを書き戻す
+		if (map_ram) {
+			i = 0;
+			while (wb_run && i <= trk_num - 1) {
+				// バススレッドを待たせないよう書き込み中はロックを開放
+				if (!SaveRamRun(i, trk_num - 1, TRUE)) {
+					// 失敗したものは次回に回す
+					break;
+				}
+			}
+			continue;
+		}
+
+		// メモリマップは変更範囲をまとめて書き戻す
+		if (mapbuf) {
+			SaveAll();
+			continue;
+		}
+
+		// 変更済みトラックを探して非同期で書き戻す(保存中の印を付ける)
+		force = (wb_dirty >= wb_limit);
+		now = GetTimeMs();
+		for (i = 0; i < cache_max && wb_dirty > 0; i++) {
+			if (!cache[i].disktrk || !cache[i].disktrk->IsChanged()) {
+				continue;
+			}
+			if (!force && (now - cache[i].dirtytime) < WriteBackAge) {
+				continue;
+			}
+
+			// 要求の空きがなければ先に完了を待つ
+			if (save_num >= Fileio::AsyncMax) {
+				SaveWait(TRUE);
+				if (!wb_run) {
+					break;
+				}
+			}
+
+			// 失敗したものは次回に回す
+			SaveRun(i, 0, trk_num - 1, TRUE);
+		}
+
+		// バススレッドを待たせないよう完了待ちの間はロックを開放
+		// (失敗したものは変更済みのまま次回に回す)
+		SaveWait(TRUE);
+
+		// 書き戻せないまま閾値を超え続けるなら間隔を空ける
+		if (force && wb_dirty >= wb_limit) {
+			pthread_mutex_unlock(&lock);
+			usleep(WriteBackInterval * 1000);
+			pthread_mutex_lock(&lock);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みトラック数設定
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::SetReadAhead(int tracks)
+{
+	ASSERT(this);
+	ASSERT((tracks >= 0) && (tracks <= ReadAheadMax));
+
+	ra_depth = tracks;
+}
+
+//---------------------------------------------------------------------------
+//
+//	連続アクセスの検出(ロック済み)
+//	※連続アクセスを検出したらトラックが変わる毎に後続を先読み
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::ReadAheadCheck(UL64 block, int count)
+{
+	int track;
+
+	ASSERT(this);
+	ASSERT(count > 0);
+
+	if (ra_depth <= 0) {
+		return;
+	}
+
+	// 前回の続きなら連続回数を加算
+	if (block == ra_next) {
+		ra_seq += count;
+	} else {
+		ra_seq = count - 1;
+	}
+	if (ra_seq > ReadAheadSeq) {
+		ra_seq = ReadAheadSeq;
+	}
+	ra_next = block + count;
+
+	// トラックが変わったら先読み要求
+	track = (int)(block >> trk_shift);
+	if (ra_seq >= ReadAheadSeq && track != ra_track) {
+		ra_track = track;
+		ReadAhead(track);
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読み要求
+//	※指定トラックの後続で、キャッシュに無いものを先読みスレッドへ渡す
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::ReadAhead(int track)
+{
+	int i;
+	int n;
+	int t;
+	int c;
+	BOOL wake;
+
+	ASSERT(this);
+	ASSERT(track >= 0);
+	ASSERT(ra_depth > 0);
+
+	pthread_mutex_lock(&ra_lock);
+
+	// 完了した非同期読み込みを回収
+	for (i = 0; i < ReadAheadMax; i++) {
+		if (ra[i].aio >= 0 && ra[i].disktrk->IsComplete(ra[i].aio)) {
+			ReadAheadFinish(i);
+		}
+	}
+
+	wake = FALSE;
+	for (n = 1; n <= ra_depth; n++) {
+		// ディスクの終端
+		t = track + n;
+		if (t >= trk_num) {
+			break;
+		}
+
+		// キャッシュ済み
+		if (Lookup(t) >= 0) {
+			continue;
+		}
+
+		// 要求済みか調べつつ、空きを探す
+		c = -1;
+		for (i = 0; i < ReadAheadMax; i++) {
+			if (ra[i].state != ReadAheadFree && ra[i].track == t) {
+				break;
+			}
+			if (ra[i].state == ReadAheadFree) {
+				if (c < 0) {
+					c = i;
+				}
+			} else if (ra[i].state == ReadAheadDone) {
+				// 今回の範囲外の先読み済みは使われなかったもの
+				if (c < 0 && (ra[i].track <= track ||
+					ra[i].track > track + ra_depth)) {
+					c = i;
+				}
+			}
+		}
+		if (i < ReadAheadMax || c < 0) {
+			continue;
+		}
+
+		// 読み込み開始
+		if (ReadAheadStart(c, t)) {
+			wake = TRUE;
+		}
+	}
+
+	// スレッドを起動
+	if (wake) {
+		ReadAheadWake();
+	}
+	pthread_cond_broadcast(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読み開始(先読みロック済み)
+//	※スレッドでの読み込みが必要ならTRUEを返す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::ReadAheadStart(int index, int track)
+{
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < ReadAheadMax));
+	ASSERT(track >= 0);
+
+	// 非同期I/Oで読み込めればスレッドは不要
+	ra[index].track = track;
+	ra[index].disktrk->Init(disk, track, sec_size,
+		GetSectors(track), trk_sectors, cd_raw, imgoffset);
+	ra[index].aio = ra[index].disktrk->LoadAsync();
+	if (ra[index].aio >= 0) {
+		ra[index].state = ReadAheadLoading;
+		return FALSE;
+	}
+
+	// 先読みスレッドへ要求
+	ra[index].state = ReadAheadRequest;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みスレッドの起床(先読みロック済み)
+//	※起動できなければ要求を取り消してFALSEを返す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::ReadAheadWake()
+{
+	int i;
+
+	ASSERT(this);
+
+	// 起動済み
+	if (ra_run) {
+		return TRUE;
+	}
+
+	// 起動できなければ要求を取り消す
+	if (!StartReadAhead()) {
+		for (i = 0; i < ReadAheadMax; i++) {
+			if (ra[i].state == ReadAheadRequest) {
+				ra[i].state = ReadAheadFree;
+			}
+		}
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期先読みの回収(先読みロック済み)
+//	※完了を待って結果を反映する
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::ReadAheadFinish(int index)
+{
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT((index >= 0) && (index < ReadAheadMax));
+	ASSERT(ra[index].state == ReadAheadLoading);
+	ASSERT(ra[index].aio >= 0);
+
+	result = ra[index].disktrk->LoadComplete(ra[index].aio);
+	ra[index].aio = -1;
+	ra[index].state = result ? ReadAheadDone : ReadAheadFree;
+	if (result) {
+		ra_bytes += (UL64)(ra[index].disktrk->GetSectors() << sec_size);
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みトラックの取り込み
+//	※読み込み中なら完了を待つ。成功時は*disktrkと交換する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::ReadAheadTake(int track, DiskTrack **disktrk)
+{
+	int i;
+	DiskTrack *p;
+
+	ASSERT(this);
+	ASSERT(track >= 0);
+	ASSERT(disktrk);
+
+	pthread_mutex_lock(&ra_lock);
+	for (i = 0; i < ReadAheadMax; i++) {
+		if (ra[i].state != ReadAheadFree && ra[i].track == track) {
+			break;
+		}
+	}
+
+	// 該当なし
+	if (i >= ReadAheadMax) {
+		pthread_mutex_unlock(&ra_lock);
+		return FALSE;
+	}
+
+	// 未着手なら取り消して自分で読む
+	if (ra[i].state == ReadAheadRequest) {
+		ra[i].state = ReadAheadFree;
+		pthread_mutex_unlock(&ra_lock);
+		return FALSE;
+	}
+
+	// 読み込み中なら完了を待つ
+	if (ra[i].aio >= 0) {
+		ReadAheadFinish(i);
+	}
+	while (ra[i].state == ReadAheadLoading) {
+		pthread_cond_wait(&ra_cond, &ra_lock);
+	}
+
+	// 読み込み失敗
+	if (ra[i].state != ReadAheadDone || ra[i].track != track) {
+		pthread_mutex_unlock(&ra_lock);
+		return FALSE;
+	}
+
+	// 交換
+	p = ra[i].disktrk;
+	ra[i].disktrk = *disktrk;
+	ra[i].state = ReadAheadFree;
+	*disktrk = p;
+	pthread_mutex_unlock(&ra_lock);
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読み取り消し
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::ReadAheadCancel()
+{
+	int i;
+
+	ASSERT(this);
+
+	pthread_mutex_lock(&ra_lock);
+	for (i = 0; i < ReadAheadMax; i++) {
+		// 読み込み中なら完了を待つ
+		if (ra[i].aio >= 0) {
+			ReadAheadFinish(i);
+		}
+		while (ra[i].state == ReadAheadLoading) {
+			pthread_cond_wait(&ra_cond, &ra_lock);
+		}
+		ra[i].state = ReadAheadFree;
+	}
+	pthread_mutex_unlock(&ra_lock);
+
+	// 検出もやり直し
+	ra_seq = 0;
+	ra_track = -1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みスレッド起動
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskCache::StartReadAhead()
+{
+	pthread_attr_t attr;
+	struct sched_param schedparam;
+	cpu_set_t cpuset;
+	int cpu;
+	int i;
+
+	ASSERT(this);
+	ASSERT(!ra_run);
+
+	// バススレッドの優先度を継承しないよう通常スケジューリングで生成
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	schedparam.sched_priority = 0;
+	pthread_attr_setschedparam(&attr, &schedparam);
+
+	ra_run = TRUE;
+	if (pthread_create(&ra_thread, &attr, ReadAheadThread, this) != 0) {
+		ra_run = FALSE;
+		pthread_attr_destroy(&attr);
+		return FALSE;
+	}
+	pthread_attr_destroy(&attr);
+
+	// 呼び出し元(バススレッド)が単一CPUに固定されていれば、そのCPUを避ける
+	cpu = sched_getcpu();
+	CPU_ZERO(&cpuset);
+	sched_getaffinity(0, sizeof(cpu_set_t), &cpuset);
+	if (CPU_COUNT(&cpuset) <= 1) {
+		CPU_ZERO(&cpuset);
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (i != cpu) {
+				CPU_SET(i, &cpuset);
+			}
+		}
+		pthread_setaffinity_np(ra_thread, sizeof(cpu_set_t), &cpuset);
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みスレッド
+//
+//---------------------------------------------------------------------------
+void* DiskCache::ReadAheadThread(void *param)
+{
+	DiskCache *self;
+
+	self = (DiskCache *)param;
+	ASSERT(self);
+
+	self->ReadAheadMain();
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	先読みスレッド主処理
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::ReadAheadMain()
+{
+	int i;
+	int c;
+	int track;
+	BOOL result;
+	DiskTrack *disktrk;
+
+	ASSERT(this);
+
+	pthread_mutex_lock(&ra_lock);
+	while (ra_run) {
+		// 最も若いトラックの要求を探す
+		c = -1;
+		for (i = 0; i < ReadAheadMax; i++) {
+			if (ra[i].state == ReadAheadRequest) {
+				if (c < 0 || ra[i].track < ra[c].track) {
+					c = i;
+				}
+			}
+		}
+
+		// 要求がなければ待つ
+		if (c < 0) {
+			pthread_cond_wait(&ra_cond, &ra_lock);
+			continue;
+		}
+
+		// 読み込み中
+		ra[c].state = ReadAheadLoading;
+		track = ra[c].track;
+		disktrk = ra[c].disktrk;
+		ra[c].disktrk = NULL;
+		pthread_mutex_unlock(&ra_lock);
+
+		// ロック外でファイルから読み込む
+		ASSERT(disktrk);
+		disktrk->Init(disk, track, sec_size,
+			GetSectors(track), trk_sectors, cd_raw, imgoffset);
+		result = disktrk->Load();
+
+		// 結果を通知
+		pthread_mutex_lock(&ra_lock);
+		ra[c].disktrk = disktrk;
+		ra[c].state = result ? ReadAheadDone : ReadAheadFree;
+		if (result) {
+			ra_bytes += (UL64)(disktrk->GetSectors() << sec_size);
+		}
+		pthread_cond_broadcast(&ra_cond);
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+#endif	// BAREMETAL
+
+//---------------------------------------------------------------------------
+//
+//	マップ上のオフセット取得
+//
+//---------------------------------------------------------------------------
+fsize_t FASTCALL DiskCache::GetMapOffset(UL64 block) const
+{
+	fsize_t offset;
+
+	ASSERT(this);
+	ASSERT(block <= sec_blocks);
+
+	offset = (fsize_t)block;
+	if (cd_raw) {
+		ASSERT(sec_size == 11);
+		offset *= 0x930;
+		offset += 0x10;
+	} else {
+		offset <<= sec_size;
+	}
+
+	// 実イメージまでのオフセットを追加
+	return offset + imgoffset;
+}
+
+//---------------------------------------------------------------------------
+//
+//	シリアル番号の更新
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskCache::Update()
+{
+	int i;
+
+	ASSERT(this);
+
+	// 更新して、0以外は何もしない
+	serial++;
+	if (serial != 0) {
+		return;
+	}
+
+	// 全キャッシュのシリアルをクリア(32bitループしている)
+	for (i = 0; i < cache_max; i++) {
+		cache[i].serial = 0;
+	}
+}
+
+//===========================================================================
+//
+//	ディスクオーバーレイ
+//
+//===========================================================================
+
+//---------------------------------------------------------------------------
+//
+//	差分ファイルの識別子
+//
+//---------------------------------------------------------------------------
+static const char OverlayMagic[16] = "RaSCSI OVERLAY";
+
+//---------------------------------------------------------------------------
+//
+//	コンストラクタ
+//
+//---------------------------------------------------------------------------
+DiskOverlay::DiskOverlay()
+{
+	// 内部情報の初期化
+	map = NULL;
+	maplen = 0;
+	size = 0;
+	blocks = 0;
+	count = 0;
+	imgoffset = 0;
+	data_offset = 0;
+
+#ifndef BAREMETAL
+	pthread_mutex_init(&lock, NULL);
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	デストラクタ
+//
+//---------------------------------------------------------------------------
+DiskOverlay::~DiskOverlay()
+{
+	Close();
+
+#ifndef BAREMETAL
+	pthread_mutex_destroy(&lock);
+#endif	// BAREMETAL
+}
+
+//---------------------------------------------------------------------------
+//
+//	オープン
+//	※差分ファイルはベースイメージのパスに.cowを付加したもの
+//	  無ければ作成し、あればセクタサイズと総セクタ数が一致する場合のみ使う
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Open(
+	const Filepath& path, int secsize, UL64 secblocks, fsize_t imgoff)
+{
+	char name[_MAX_PATH];
+	int n;
+	header_t header;
+	size_t i;
+	DWORD bits;
+
+	ASSERT(this);
+	ASSERT(!map);
+	ASSERT((secsize >= 8) && (secsize <= 11));
+	ASSERT(secblocks > 0);
+	ASSERT(imgoff >= 0);
+
+	// パラメータを設定
+	size = secsize;
+	blocks = secblocks;
+	imgoffset = imgoff;
+	count = 0;
+
+	// 変更マップの後ろ、境界に合わせた位置からデータ領域
+	// (マップはメモリ上に置くので、そのアドレス空間に収まること)
+	if (((blocks + 31) >> 5) > (UL64)(SIZE_MAX / sizeof(DWORD))) {
+		return FALSE;
+	}
+	maplen = (size_t)((blocks + 31) >> 5);
+	data_offset = HeaderSize + (fsize_t)maplen * sizeof(DWORD);
+	data_offset = (data_offset + DataAlign - 1) & ~(fsize_t)(DataAlign - 1);
+
+	// 変更マップのメモリを確保
+	map = (DWORD *)calloc(maplen, sizeof(DWORD));
+	if (!map) {
+		return FALSE;
+	}
+
+	// 差分ファイルのパス(収まらなければ開かない)
+	n = snprintf(name, sizeof(name), "%s.cow", path.GetPath());
+	if (n < 0 || n >= (int)sizeof(name)) {
+		Close();
+		return FALSE;
+	}
+
+	if (fio.Open(name, Fileio::ReadWrite)) {
+		// 既存の差分ファイルのヘッダを確認
+		if (!fio.ReadAt(&header, sizeof(header), 0) ||
+			memcmp(header.magic, OverlayMagic, sizeof(header.magic)) != 0 ||
+			header.version != Version ||
+			header.size != (DWORD)size ||
+			(((UL64)header.blocks_hi << 32) | header.blocks) != blocks) {
+			Close();
+			return FALSE;
+		}
+
+		// 変更マップを読み込む(作成直後はファイル上は穴なので0が読める)
+		for (i = 0; i < maplen; i += n) {
+			n = CopyMax / sizeof(DWORD);
+			if ((size_t)n > maplen - i) {
+				n = (int)(maplen - i);
+			}
+			if (!fio.ReadAt(&map[i], n * (int)sizeof(DWORD),
+				HeaderSize + (fsize_t)i * sizeof(DWORD))) {
+				Close();
+				return FALSE;
+			}
+		}
+
+		// 終端を超えるビットは無視し、差分のあるセクタ数を数える
+		if (blocks & 31) {
+			map[maplen - 1] &= ((DWORD)1 << (blocks & 31)) - 1;
+		}
+		for (i = 0; i < maplen; i++) {
+			for (bits = map[i]; bits; bits &= bits - 1) {
+				count++;
+			}
+		}
+	} else {
+		// 新規作成
+		if (!fio.Open(name, Fileio::WriteOnly)) {
+			Close();
+			return FALSE;
+		}
+
+		// ヘッダを書き込み、データ領域の手前まで伸ばす
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, OverlayMagic, sizeof(header.magic));
+		header.version = Version;
+		header.size = (DWORD)size;
+		header.blocks = (DWORD)blocks;
+		header.blocks_hi = (DWORD)(blocks >> 32);
+		if (!fio.WriteAt(&header, sizeof(header), 0) ||
+			!fio.Truncate(data_offset)) {
+			Close();
+			return FALSE;
+		}
+		fio.Close();
+
+		// 読み書き両方で開き直す
+		if (!fio.Open(name, Fileio::ReadWrite)) {
+			Close();
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	クローズ
+//
+//---------------------------------------------------------------------------
+void FASTCALL DiskOverlay::Close()
+{
+	ASSERT(this);
+
+	// 差分ファイルを媒体へ反映してクローズ
+	if (fio.IsOpen()) {
+		fio.Flush();
+		fio.Close();
+	}
+
+	// 変更マップを解放
+	if (map) {
+		free(map);
+		map = NULL;
+	}
+	maplen = 0;
+	count = 0;
+}
+
+//---------------------------------------------------------------------------
+//
+//	差分の重ね合わせ
+//	※ベースイメージから読んだバッファに、差分のあるセクタを上書きする
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Merge(BYTE *buf, int length, fsize_t offset)
+{
+	fsize_t start;
+	fsize_t end;
+	fsize_t pos;
+	fsize_t last_pos;
+	UL64 block;
+	UL64 last;
+	DWORD num;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(length > 0);
+	ASSERT(offset >= 0);
+	ASSERT(map);
+
+	// セクタの範囲に切り詰める(ヘッダ部分や終端以降は対象外)
+	start = offset;
+	if (start < imgoffset) {
+		start = imgoffset;
+	}
+	end = offset + length;
+	if (end > imgoffset + ((fsize_t)blocks << size)) {
+		end = imgoffset + ((fsize_t)blocks << size);
+	}
+	if (start >= end) {
+		return TRUE;
+	}
+	block = (UL64)((start - imgoffset) >> size);
+	last = (UL64)((end - 1 - imgoffset) >> size);
+
+	Lock();
+
+	// 差分のある連続セクタ毎に読み込む(一部だけ重なるセクタも考慮)
+	result = TRUE;
+	while (count > 0 && block <= last) {
+		block = NextRun(block, last, num);
+		if (block > last) {
+			break;
+		}
+
+		pos = imgoffset + ((fsize_t)block << size);
+		if (pos < start) {
+			pos = start;
+		}
+		last_pos = imgoffset + ((fsize_t)(block + num) << size);
+		if (last_pos > end) {
+			last_pos = end;
+		}
+		if (!fio.ReadAt(&buf[pos - offset],
+			(int)(last_pos - pos), GetDataOffset(pos))) {
+			result = FALSE;
+			break;
+		}
+
+		block += num;
+	}
+
+	Unlock();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定書き込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::WriteAt(const BYTE *buf, int length, fsize_t offset)
+{
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(length > 0);
+	ASSERT(offset >= imgoffset);
+	ASSERT(((offset - imgoffset) & ((1 << size) - 1)) == 0);
+	ASSERT((length & ((1 << size) - 1)) == 0);
+	ASSERT(map);
+
+	Lock();
+
+	// データの後に変更マップを書き込む
+	result = fio.WriteAt(buf, length, GetDataOffset(offset));
+	if (result) {
+		result = Mark((UL64)((offset - imgoffset) >> size),
+			(DWORD)(length >> size));
+	}
+
+	Unlock();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定ベクタ書き込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::WriteVAt(
+	const struct iovec *iov, int iovcnt, fsize_t offset)
+{
+	int i;
+	fsize_t length;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(iov);
+	ASSERT(iovcnt > 0);
+	ASSERT(offset >= imgoffset);
+	ASSERT(((offset - imgoffset) & ((1 << size) - 1)) == 0);
+	ASSERT(map);
+
+	// 合計長
+	length = 0;
+	for (i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	ASSERT((length & ((1 << size) - 1)) == 0);
+
+	Lock();
+
+	// データの後に変更マップを書き込む
+	result = fio.WriteVAt(iov, iovcnt, GetDataOffset(offset));
+	if (result) {
+		result = Mark((UL64)((offset - imgoffset) >> size),
+			(DWORD)(length >> size));
+	}
+
+	Unlock();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定ゼロ化
+//	※差分ファイル側は穴を開けて差分ありとする(ベースイメージは変えない)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::ZeroAt(fsize_t offset, fsize_t length)
+{
+	BYTE *buf;
+	fsize_t pos;
+	fsize_t end;
+	int n;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(length > 0);
+	ASSERT(offset >= imgoffset);
+	ASSERT(((offset - imgoffset) & ((1 << size) - 1)) == 0);
+	ASSERT((length & ((1 << size) - 1)) == 0);
+	ASSERT(map);
+
+	Lock();
+
+	// 穴を開け、ファイル終端を越える分は伸ばしておく(読み込みが短くならないよう)
+	pos = GetDataOffset(offset);
+	end = pos + length;
+	result = fio.ZeroAt(pos, length, TRUE);
+	if (result && fio.GetFileSize() < end) {
+		result = fio.Truncate(end);
+	}
+
+	// 穴を開けられなければゼロを書き込む
+	if (!result) {
+		buf = (BYTE *)calloc(1, CopyMax);
+		result = (buf != NULL);
+		while (result && pos < end) {
+			n = CopyMax;
+			if ((fsize_t)n > end - pos) {
+				n = (int)(end - pos);
+			}
+			result = fio.WriteAt(buf, n, pos);
+			pos += n;
+		}
+		if (buf) {
+			free(buf);
+		}
+	}
+
+	// データの後に変更マップを書き込む
+	if (result) {
+		result = Mark((UL64)((offset - imgoffset) >> size),
+			(DWORD)(length >> size));
+	}
+
+	Unlock();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	書き込み内容を媒体へ反映
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Flush()
+{
+	ASSERT(this);
+	ASSERT(map);
+
+	return fio.Flush();
+}
+
+//---------------------------------------------------------------------------
+//
+//	ベースイメージへ反映
+//	※差分のあるセクタをベースイメージへ書き込み、媒体へ反映してから破棄する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Commit(const Filepath& path)
+{
+	Fileio base;
+	BYTE *buf;
+	UL64 block;
+	DWORD num;
+	DWORD n;
+	fsize_t offset;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(map);
+
+	// ベースイメージを書き込みで開く(書き込めなければ反映できない)
+	if (!base.Open(path, Fileio::ReadWrite)) {
+		return FALSE;
+	}
+
+	// 複写用のバッファ
+	buf = (BYTE *)malloc(CopyMax);
+	if (!buf) {
+		base.Close();
+		return FALSE;
+	}
+
+	Lock();
+
+	// 差分のある連続セクタ毎に複写
+	result = TRUE;
+	block = 0;
+	while (result && count > 0 && block < blocks) {
+		block = NextRun(block, blocks - 1, num);
+		while (result && block < blocks && num > 0) {
+			n = num;
+			if (n > (DWORD)(CopyMax >> size)) {
+				n = CopyMax >> size;
+			}
+			offset = imgoffset + ((fsize_t)block << size);
+			if (!fio.ReadAt(buf, n << size, GetDataOffset(offset)) ||
+				!base.WriteAt(buf, n << size, offset)) {
+				result = FALSE;
+			}
+			block += n;
+			num -= n;
+		}
+	}
+
+	// ベースイメージを媒体へ反映してから差分を消す
+	if (result) {
+		result = base.Flush();
+	}
+	if (result) {
+		result = Clear();
+	}
+
+	Unlock();
+
+	free(buf);
+	base.Close();
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	破棄
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Discard()
+{
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(map);
+
+	Lock();
+	result = Clear();
+	Unlock();
+
+	return result;
 }
 
 //---------------------------------------------------------------------------
 //
-//	トラックの割り当て
+//	変更マップ設定と保存(ロック済み)
+//	※新たに差分を持ったセクタがある場合のみ、該当するマップを書き込む
 //
 //---------------------------------------------------------------------------
-DiskTrack* FASTCALL DiskCache::Assign(int track)
+BOOL FASTCALL DiskOverlay::Mark(UL64 block, DWORD num)
 {
-	int i;
-	int c;
-	DWORD s;
-	DiskTrack *disktrk;
+	UL64 i;
+	size_t first;
+	size_t last;
+	DWORD bit;
+	BOOL changed;
 
 	ASSERT(this);
-	ASSERT(sec_size != 0);
-	ASSERT(track >= 0);
+	ASSERT(num > 0);
+	ASSERT(block + num <= blocks);
 
-	// まず、既に割り当てされていないか調べる
-	for (i = 0; i < CacheMax; i++) {
-		if (cache[i].disktrk) {
-			if (cache[i].disktrk->GetTrack() == track) {
-				// トラックが一致
-				cache[i].serial = serial;
-				return cache[i].disktrk;
-			}
+	// ビットを立てる
+	changed = FALSE;
+	for (i = block; i < block + num; i++) {
+		bit = (DWORD)1 << (i & 31);
+		if (!(map[(size_t)(i >> 5)] & bit)) {
+			map[(size_t)(i >> 5)] |= bit;
+			count++;
+			changed = TRUE;
 		}
 	}
 
-	// 次に、空いているものがないか調べる
-	for (i = 0; i < CacheMax; i++) {
-		if (!cache[i].disktrk) {
-			// ロードを試みる
-			if (Load(i, track)) {
-				// ロード成功
-				cache[i].serial = serial;
-				return cache[i].disktrk;
-			}
-
-			// ロード失敗
-			return NULL;
-		}
+	// 既に差分があったセクタのみなら書き込み不要
+	if (!changed) {
+		return TRUE;
 	}
 
-	// 最後に、シリアル番号の一番若いものを探し、削除する
-
-	// インデックス0を候補cとする
-	s = cache[0].serial;
-	c = 0;
-
-	// 候補とシリアルを比較し、より小さいものへ更新する
-	for (i = 0; i < CacheMax; i++) {
-		ASSERT(cache[i].disktrk);
+	// 該当するマップを書き込む
+	first = (size_t)(block >> 5);
+	last = (size_t)((block + num - 1) >> 5);
+	return WriteMap(first, last - first + 1);
+}
 
-		// 既に存在するシリアルと比較、更新
-		if (cache[i].serial < s) {
-			s = cache[i].serial;
-			c = i;
-		}
-	}
+//---------------------------------------------------------------------------
+//
+//	変更マップ初期化と保存(ロック済み)
+//	※データ領域は切り詰めて領域を解放する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL DiskOverlay::Clear()
+{
+	ASSERT(this);
 
-	// このトラックを保存
-	if (!cache[c].disktrk->Save()) {
-		return NULL;
+	// マップをクリアして書き込む
+	memset(map, 0, maplen * sizeof(DWORD));
+	count = 0;
+	if (!WriteMap(0, maplen)) {
+		return FALSE;
 	}
 
-	// このトラックを削除
-	disktrk = cache[c].disktrk;
-	cache[c].disktrk = NULL;
-
-	// ロード
-	if (Load(c, track, disktrk)) {
-		// ロード成功
-		cache[c].serial = serial;
-		return cache[c].disktrk;
+	// データ領域を解放
+	if (!fio.Truncate(data_offset)) {
+		return FALSE;
 	}
 
-	// ロード失敗
-	return NULL;
+	return fio.Flush();
 }
 
 //---------------------------------------------------------------------------
 //
-//	トラックのロード
+//	変更マップ書き込み
+//	※大きなマップは複写単位に分けて書き込む
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL DiskCache::Load(int index, int track, DiskTrack *disktrk)
+BOOL FASTCALL DiskOverlay::WriteMap(size_t first, size_t num)
 {
-	int sectors;
+	size_t n;
 
 	ASSERT(this);
-	ASSERT((index >= 0) && (index < CacheMax));
-	ASSERT(track >= 0);
-	ASSERT(!cache[index].disktrk);
-
-	// このトラックのセクタ数を取得
-	sectors = sec_blocks - (track * DiskTrack::NumSectors);
-	ASSERT(sectors > 0);
-	if (sectors > DiskTrack::NumSectors) {
-		sectors = DiskTrack::NumSectors;
-	}
-
-	// ディスクトラックを作成
-	if (disktrk == NULL) {
-		disktrk = new DiskTrack();
-	}
-
-	// ディスクトラックを初期化
-	disktrk->Init(disk, track, sec_size, sectors, cd_raw, imgoffset);
+	ASSERT(first + num <= maplen);
 
-	// ロードを試みる
-	if (!disktrk->Load()) {
-		// 失敗
-		delete disktrk;
-		return FALSE;
+	while (num > 0) {
+		n = CopyMax / sizeof(DWORD);
+		if (n > num) {
+			n = num;
+		}
+		if (!fio.WriteAt(&map[first], (int)(n * sizeof(DWORD)),
+			HeaderSize + (fsize_t)first * sizeof(DWORD))) {
+			return FALSE;
+		}
+		first += n;
+		num -= n;
 	}
 
-	// 割り当て成功、ワークを設定
-	cache[index].disktrk = disktrk;
-
 	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	シリアル番号の更新
+//	差分のある連続セクタ検索
+//	※block～lastの範囲で最初に差分のあるセクタと連続数を返す
+//	  見つからなければlastより大きな値を返す
 //
 //---------------------------------------------------------------------------
-void FASTCALL DiskCache::Update()
+UL64 FASTCALL DiskOverlay::NextRun(UL64 block, UL64 last, DWORD& num) const
 {
-	int i;
+	UL64 start;
 
 	ASSERT(this);
+	ASSERT(last < blocks);
 
-	// 更新して、0以外は何もしない
-	serial++;
-	if (serial != 0) {
-		return;
+	// 最初の差分のあるセクタ(32セクタ単位で読み飛ばす)
+	num = 0;
+	while (block <= last) {
+		if (map[(size_t)(block >> 5)] == 0) {
+			block = (block | 31) + 1;
+			continue;
+		}
+		if (map[(size_t)(block >> 5)] & ((DWORD)1 << (block & 31))) {
+			break;
+		}
+		block++;
+	}
+	if (block > last) {
+		return block;
 	}
 
-	// 全キャッシュのシリアルをクリア(32bitループしている)
-	for (i = 0; i < CacheMax; i++) {
-		cache[i].serial = 0;
+	// 連続数(DWORDに収まる範囲で区切る)
+	start = block;
+	while (block <= last && block - start < 0xffffffff &&
+		(map[(size_t)(block >> 5)] & ((DWORD)1 << (block & 31)))) {
+		block++;
 	}
+	num = (DWORD)(block - start);
+
+	return start;
 }
 
 
+
 //===========================================================================
 //
 //	ディスク
@@ -784,9 +4244,23 @@ Disk::Disk()
 	disk.code = 0;
 	disk.dcache = NULL;
 	disk.imgoffset = 0;
+	disk.punch = FALSE;
 
 	// その他
 	cache_wb = TRUE;
+	cache_map = FALSE;
+	cache_ram = FALSE;
+	cache_direct = FALSE;
+	cache_mb = 0;
+	cache_trk = 0;
+	xfer_size = 0;
+	overlay_mode = FALSE;
+	overlay = NULL;
+#ifndef BAREMETAL
+	cache_ra = DiskCache::ReadAheadDef;
+#else
+	cache_ra = 0;
+#endif	// BAREMETAL
 }
 
 //---------------------------------------------------------------------------
@@ -798,16 +4272,25 @@ Disk::~Disk()
 {
 	// ディスクキャッシュの保存
 	if (disk.ready) {
-		// レディの場合のみ
+		// レディの場合のみ(ライトバック時は媒体への反映まで待つ)
 		if (disk.dcache) {
-			disk.dcache->Save();
+			if (cache_wb && !disk.readonly) {
+				disk.dcache->Sync(0, 0);
+			} else {
+				disk.dcache->Save();
+			}
 		}
 	}
 
 	// ディスクキャッシュの削除
 	if (disk.dcache) {
-		delete disk.dcache;
-		disk.dcache = NULL;
+		DeleteCache();
+	}
+
+	// オーバーレイの削除
+	if (overlay) {
+		delete overlay;
+		overlay = NULL;
 	}
 }
 
@@ -868,26 +4351,64 @@ BOOL FASTCALL Disk::Open(const Filepath& path, BOOL /*attn*/)
 	ASSERT((disk.size >= 8) && (disk.size <= 11));
 	ASSERT(disk.blocks > 0);
 
-	// レディ
-	disk.ready = TRUE;
-
-	// キャッシュ初期化
-	ASSERT(!disk.dcache);
-	disk.dcache =
-		new DiskCache(this, disk.size, disk.blocks, disk.imgoffset);
-
 	// 読み書きオープン可能か
-	if (fio.Open(path, Fileio::ReadWrite)) {
+	// ※ハンドルはイジェクトまで開いたままにし、トラック毎に開閉しない
+	if (overlay_mode && disk.id != MAKEID('S', 'C', 'C', 'D')) {
+		// オーバーレイはベースイメージを読み込み専用で開き、差分ファイルに書く
+		if (!fio.Open(path, Fileio::ReadOnly)) {
+			return FALSE;
+		}
+		ASSERT(!overlay);
+		overlay = new DiskOverlay;
+		if (!overlay->Open(path, disk.size, disk.blocks, disk.imgoffset)) {
+			delete overlay;
+			overlay = NULL;
+			fio.Close();
+			return FALSE;
+		}
+
+		// 書き込み許可、リードオンリーでない
+		disk.writep = FALSE;
+		disk.readonly = FALSE;
+	} else if (fio.Open(path, Fileio::ReadWrite)) {
 		// 書き込み許可、リードオンリーでない
 		disk.writep = FALSE;
 		disk.readonly = FALSE;
-		fio.Close();
 	} else {
+		// 読み込みのみでオープン
+		if (!fio.Open(path, Fileio::ReadOnly)) {
+			return FALSE;
+		}
+
 		// 書き込み禁止、リードオンリー
 		disk.writep = TRUE;
 		disk.readonly = TRUE;
 	}
 
+	// 書き込み先が領域の解放(穴開け)に対応しているか
+	if (overlay) {
+		disk.punch = overlay->CanPunchHole();
+	} else {
+		disk.punch = !disk.readonly && fio.CanPunchHole();
+	}
+
+	// ダイレクトI/O(ページキャッシュとトラックキャッシュの二重保持を避ける)
+	// ※セクタとイメージの先頭がDirectBlockの境界に合う場合のみ
+	if (cache_direct && disk.size >= 9 &&
+		(disk.imgoffset & (Fileio::DirectBlock - 1)) == 0) {
+		fio.SetDirect(TRUE);
+	}
+
+	// レディ
+	disk.ready = TRUE;
+
+	// キャッシュ初期化(トラックプールを確保できなければ失敗)
+	ASSERT(!disk.dcache);
+	if (!CreateCache()) {
+		CloseImage();
+		return FALSE;
+	}
+
 	// ロックされていない
 	disk.lock = FALSE;
 
@@ -924,16 +4445,46 @@ void FASTCALL Disk::Eject(BOOL force)
 		}
 	}
 
-	// ディスクキャッシュを削除
-	disk.dcache->Save();
-	delete disk.dcache;
-	disk.dcache = NULL;
+	// ディスクキャッシュを削除(ライトバック時は媒体への反映まで待つ)
+	if (cache_wb && !disk.readonly) {
+		disk.dcache->Sync(0, 0);
+	} else {
+		disk.dcache->Save();
+	}
+	DeleteCache();
+
+	// イメージをクローズ
+	CloseImage();
+}
+
+//---------------------------------------------------------------------------
+//
+//	イメージクローズ
+//	※キャッシュは削除済みであること
+//
+//---------------------------------------------------------------------------
+void FASTCALL Disk::CloseImage()
+{
+	ASSERT(this);
+	ASSERT(!disk.dcache);
+
+	// オーバーレイをクローズ
+	if (overlay) {
+		delete overlay;
+		overlay = NULL;
+	}
+
+	// イメージファイルをクローズ
+	if (fio.IsOpen()) {
+		fio.Close();
+	}
 
 	// ノットレディ、アテンションなし
 	disk.ready = FALSE;
 	disk.writep = FALSE;
 	disk.readonly = FALSE;
 	disk.attn = FALSE;
+	disk.punch = FALSE;
 }
 
 //---------------------------------------------------------------------------
@@ -956,58 +4507,293 @@ void FASTCALL Disk::WriteP(BOOL writep)
 		return;
 	}
 
-	// フラグ設定
-	disk.writep = writep;
+	// フラグ設定
+	disk.writep = writep;
+}
+
+//---------------------------------------------------------------------------
+//
+//	内部ワーク取得
+//
+//---------------------------------------------------------------------------
+void FASTCALL Disk::GetDisk(disk_t *buffer) const
+{
+	ASSERT(this);
+	ASSERT(buffer);
+
+	// 内部ワークをコピー
+	*buffer = disk;
+}
+
+//---------------------------------------------------------------------------
+//
+//	パス取得
+//
+//---------------------------------------------------------------------------
+void FASTCALL Disk::GetPath(Filepath& path) const
+{
+	path = diskpath;
+}
+
+//---------------------------------------------------------------------------
+//
+//	フラッシュ
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::Flush()
+{
+	ASSERT(this);
+
+	// キャッシュがなければ何もしない
+	if (!disk.dcache) {
+		return TRUE;
+	}
+
+	// キャッシュを保存
+	if (!disk.dcache->Save()) {
+		disk.code = DISK_WRITEFAULT;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	オーバーレイをベースイメージへ反映
+//	※キャッシュの変更を差分ファイルへ書き出してから反映する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::CommitOverlay()
+{
+	ASSERT(this);
+
+	// オーバーレイでなければ何もできない
+	if (!overlay) {
+		return FALSE;
+	}
+	ASSERT(disk.dcache);
+
+	// キャッシュを保存
+	if (!Flush()) {
+		return FALSE;
+	}
+
+	// 反映(キャッシュの内容は反映後も正しいのでそのまま使う)
+	return overlay->Commit(diskpath);
+}
+
+//---------------------------------------------------------------------------
+//
+//	オーバーレイを破棄
+//	※キャッシュの内容も差分を含むので作り直す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::DiscardOverlay()
+{
+	BOOL result;
+
+	ASSERT(this);
+
+	// オーバーレイでなければ何もできない
+	if (!overlay) {
+		return FALSE;
+	}
+	ASSERT(disk.dcache);
+
+	// キャッシュを削除(ライトバック中の書き込みを止めるため一度保存する)
+	disk.dcache->Save();
+	DeleteCache();
+
+	// 破棄して、ベースイメージからキャッシュを作り直す
+	result = overlay->Discard();
+	if (!CreateCache()) {
+		// キャッシュを作れなければノットレディとする
+		CloseImage();
+		return FALSE;
+	}
+
+	// 内容が変わったのでアテンション
+	disk.attn = TRUE;
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	キャッシュトラック数取得
+//	※キャッシュサイズ(MB)をトラック数に換算する
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::GetCacheTracks() const
+{
+	int tracks;
+
+	ASSERT(this);
+	ASSERT((disk.size >= 8) && (disk.size <= 11));
+
+	// 指定なしは既定値
+	if (cache_mb <= 0) {
+		return DiskCache::CacheMax;
+	}
+
+	// 1トラックのバイト数で割る
+	tracks = (int)(((fsize_t)cache_mb << 20) /
+		(GetTrackSectors() << disk.size));
+
+	// 最低でも既定値
+	if (tracks < DiskCache::CacheMax) {
+		tracks = DiskCache::CacheMax;
+	}
+
+	return tracks;
+}
+
+//---------------------------------------------------------------------------
+//
+//	キャッシュ統計取得
+//	※キャッシュが無ければFALSE(共有時は共有キャッシュ全体の値)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::GetCacheStat(DiskCache::cachestat_t *buffer) const
+{
+	ASSERT(this);
+	ASSERT(buffer);
+
+	if (!disk.dcache) {
+		return FALSE;
+	}
+
+	disk.dcache->GetStat(buffer);
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	トラック毎のセクタ数取得
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::GetTrackSectors() const
+{
+	ASSERT(this);
+
+	// 指定なしは既定値
+	if (cache_trk <= 0) {
+		return DiskTrack::NumSectors;
+	}
+
+	ASSERT((cache_trk >= DiskTrack::MinSectors) &&
+		(cache_trk <= DiskTrack::MaxSectors));
+	return cache_trk;
 }
 
 //---------------------------------------------------------------------------
 //
-//	内部ワーク取得
+//	キャッシュ生成
+//	※読み込み専用のイメージは同じイメージを開いている他のディスクと共有する
 //
 //---------------------------------------------------------------------------
-void FASTCALL Disk::GetDisk(disk_t *buffer) const
+BOOL FASTCALL Disk::CreateCache()
 {
+	BOOL share;
+
 	ASSERT(this);
-	ASSERT(buffer);
+	ASSERT(!disk.dcache);
 
-	// 内部ワークをコピー
-	*buffer = disk;
+	// 読み込み専用(CD-ROMは書き込みがないので常に対象)
+	share = disk.readonly || (disk.id == MAKEID('S', 'C', 'C', 'D'));
+
+	// 共有キャッシュがあれば使う(設定は最初に開いたディスクのもの)
+	if (share) {
+		disk.dcache = DiskCache::Share(
+			this, disk.size, disk.blocks, disk.imgoffset);
+		if (disk.dcache) {
+			return TRUE;
+		}
+	}
+
+	// トラック番号はintで扱うので、トラック数が収まらないイメージは扱えない
+	if ((disk.blocks + GetTrackSectors() - 1) / GetTrackSectors() >=
+		(UL64)INT_MAX) {
+		return FALSE;
+	}
+
+	// 新規に生成(トラックプールを確保できなければ失敗)
+	disk.dcache = new DiskCache(this, disk.size, disk.blocks,
+		disk.imgoffset, GetCacheTracks(), GetTrackSectors());
+	if (!disk.dcache->IsValid()) {
+		delete disk.dcache;
+		disk.dcache = NULL;
+		return FALSE;
+	}
+	SetupCache();
+
+	// 共有キャッシュとして登録
+	if (share) {
+		disk.dcache->Publish();
+	}
+
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	パス取得
+//	キャッシュ削除
+//	※共有している場合は参照を外すのみ
 //
 //---------------------------------------------------------------------------
-void FASTCALL Disk::GetPath(Filepath& path) const
+void FASTCALL Disk::DeleteCache()
 {
-	path = diskpath;
+	ASSERT(this);
+	ASSERT(disk.dcache);
+
+	if (disk.dcache->Release(this)) {
+		delete disk.dcache;
+	}
+	disk.dcache = NULL;
 }
 
 //---------------------------------------------------------------------------
 //
-//	フラッシュ
+//	キャッシュ設定反映
+//	※キャッシュを生成した直後に呼び出すこと
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Disk::Flush()
+void FASTCALL Disk::SetupCache()
 {
 	ASSERT(this);
+	ASSERT(disk.dcache);
 
-	// キャッシュがなければ何もしない
-	if (!disk.dcache) {
-		return TRUE;
+#ifndef BAREMETAL
+	// 先読み
+	disk.dcache->SetReadAhead(cache_ra);
+#endif	// BAREMETAL
+
+	// RAM常駐モード(確保できなければメモリマップかトラックキャッシュ)
+	if (cache_ram) {
+		disk.dcache->SetRamMode(TRUE);
 	}
 
-	// キャッシュを保存
-	return disk.dcache->Save();
+	// メモリマップモード
+	if (cache_map && !disk.dcache->IsRamMode()) {
+		disk.dcache->SetMapMode(TRUE);
+	}
+
+#ifndef BAREMETAL
+	// ライトバック(書き込み可能なメディアのみ)
+	if (cache_wb && !disk.readonly) {
+		disk.dcache->SetWriteBack(TRUE);
+	}
+#endif	// BAREMETAL
 }
 
 //---------------------------------------------------------------------------
 //
-//	レディチェック
+//	アテンションチェック
+//	※リセットと媒体交換は一度だけ報告する
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Disk::CheckReady()
+BOOL FASTCALL Disk::CheckAttn()
 {
 	ASSERT(this);
 
@@ -1025,6 +4811,23 @@ BOOL FASTCALL Disk::CheckReady()
 		return FALSE;
 	}
 
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	レディチェック
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::CheckReady()
+{
+	ASSERT(this);
+
+	// リセット、アテンションなら、ステータスを返す
+	if (!CheckAttn()) {
+		return FALSE;
+	}
+
 	// ノットレディなら、ステータスを返す
 	if (!disk.ready) {
 		disk.code = DISK_NOTREADY;
@@ -1036,6 +4839,56 @@ BOOL FASTCALL Disk::CheckReady()
 	return TRUE;
 }
 
+//---------------------------------------------------------------------------
+//
+//	ブロックのゼロ化
+//	※キャッシュへは2^30ブロック(トラック境界)単位に分けて渡す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::ZeroBlocks(UL64 block, UL64 count, BOOL unmap)
+{
+	UL64 num;
+
+	ASSERT(this);
+	ASSERT(count > 0);
+
+	// レディでなければエラー
+	if (!disk.ready) {
+		disk.code = DISK_NOTREADY;
+		return FALSE;
+	}
+
+	// トータルブロック数を超えていればエラー
+	if (block >= disk.blocks || count > disk.blocks - block) {
+		disk.code = DISK_INVALIDLBA;
+		return FALSE;
+	}
+
+	// 書き込み禁止ならエラー
+	if (disk.writep) {
+		disk.code = DISK_WRITEPROTECT;
+		return FALSE;
+	}
+
+	// キャッシュに任せる
+	while (count > 0) {
+		num = ((block | 0x3fffffff) + 1) - block;
+		if (num > count) {
+			num = count;
+		}
+		if (!disk.dcache->Zero(block, (int)num, unmap)) {
+			disk.code = DISK_WRITEFAULT;
+			return FALSE;
+		}
+		block += num;
+		count -= num;
+	}
+
+	// 成功
+	disk.code = DISK_NOERROR;
+	return TRUE;
+}
+
 //---------------------------------------------------------------------------
 //
 //	INQUIRY
@@ -1556,9 +5409,7 @@ int FASTCALL Disk::AddDrive(BOOL change, BYTE *buf)
 
 	if (disk.ready) {
 		// シリンダ数を設定(総ブロック数を25セクタ/トラックと8ヘッドで除算)
-		cylinder = disk.blocks;
-		cylinder >>= 3;
-		cylinder /= 25;
+		cylinder = (DWORD)((disk.blocks >> 3) / 25);
 		buf[0x2] = (BYTE)(cylinder >> 16);
 		buf[0x3] = (BYTE)(cylinder >> 8);
 		buf[0x4] = (BYTE)cylinder;
@@ -1612,7 +5463,12 @@ int FASTCALL Disk::AddCache(BOOL change, BYTE *buf)
 		return 12;
 	}
 
-	// 読み込みキャッシュのみ有効、プリフェッチは行わない
+	// ライトバック時は書き込みキャッシュ有効(WCE)
+	if (cache_wb) {
+		buf[2] = 0x04;
+	}
+
+	// プリフェッチは行わない
 	return 12;
 }
 
@@ -1788,37 +5644,245 @@ BOOL FASTCALL Disk::Format(const DWORD *cdb)
 		return FALSE;
 	}
 
+	// FORMAT UNITは媒体全体をゼロにする(SASIのトラック単位のものは除く)
+	if (cdb[0] == 0x04 && disk.dcache) {
+		if (disk.writep) {
+			disk.code = DISK_WRITEPROTECT;
+			return FALSE;
+		}
+		if (!ZeroBlocks(0, disk.blocks, TRUE)) {
+			return FALSE;
+		}
+	}
+
 	// FORMAT成功
 	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	REASSIGN BLOCKS
+//	REASSIGN BLOCKS
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::Reassign(const DWORD* /*cdb*/)
+{
+	ASSERT(this);
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return FALSE;
+	}
+
+	// REASSIGN BLOCKS成功
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::Read(BYTE *buf, UL64 block)
+{
+	ASSERT(this);
+	ASSERT(buf);
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// トータルブロック数を超えていればエラー
+	if (block >= disk.blocks) {
+		disk.code = DISK_INVALIDLBA;
+		return 0;
+	}
+
+	// キャッシュに任せる
+	if (!disk.dcache->Read(buf, block)) {
+		disk.code = DISK_READFAULT;
+		return 0;
+	}
+
+	// 成功
+	return (1 << disk.size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(複数ブロック)
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::ReadBlocks(BYTE *buf, UL64 block, int count)
+{
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(count > 0);
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// トータルブロック数を超えていればエラー
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
+		disk.code = DISK_INVALIDLBA;
+		return 0;
+	}
+
+	// キャッシュに任せる
+	if (!disk.dcache->Read(buf, block, count)) {
+		disk.code = DISK_READFAULT;
+		return 0;
+	}
+
+	// 成功
+	return (count << disk.size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(キャッシュ参照の固定)
+//	※キャッシュ内を直接指すポインタを返す。戻り値は固定したバイト数
+//	※固定できなければ0を返すので、呼び出し側はReadBlocksで読み直すこと
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::PinBlocks(BYTE **ptr, UL64 block, int count)
+{
+	int num;
+
+	ASSERT(this);
+	ASSERT(ptr);
+	ASSERT(count > 0);
+
+	// 状態チェック(エラーはReadBlocksで報告する)
+	if (!disk.ready || disk.reset || disk.attn) {
+		return 0;
+	}
+
+	// トータルブロック数を超えていれば固定しない
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
+		return 0;
+	}
+
+	// キャッシュに任せる
+	num = disk.dcache->Pin(block, count, ptr);
+	if (num <= 0) {
+		return 0;
+	}
+
+	// 成功
+	disk.code = DISK_NOERROR;
+	return (num << disk.size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(キャッシュ参照の固定解除)
+//
+//---------------------------------------------------------------------------
+void FASTCALL Disk::UnpinBlocks(UL64 block)
+{
+	ASSERT(this);
+
+	if (disk.dcache) {
+		disk.dcache->Unpin(block);
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(取り寄せ)
+//	※取り寄せ中で待つ必要があればTRUE。エラーはその後のREADで報告する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::Prefetch(UL64 block, int count)
+{
+	ASSERT(this);
+	ASSERT(count > 0);
+
+	// 状態を変えずに読めるときだけ対象とする
+	if (disk.reset || disk.attn || !disk.ready || !disk.dcache) {
+		return FALSE;
+	}
+
+	// トータルブロック数を超えていれば対象外
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
+		return FALSE;
+	}
+
+	return disk.dcache->Prefetch(block, count);
+}
+
+//---------------------------------------------------------------------------
+//
+//	WRITEチェック
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::WriteCheck(UL64 block, int count)
+{
+	ASSERT(this);
+	ASSERT(count > 0);
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// トータルブロック数を超えていればエラー
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
+		return 0;
+	}
+
+	// 書き込み禁止ならエラー
+	if (disk.writep) {
+		disk.code = DISK_WRITEPROTECT;
+		return 0;
+	}
+
+	// 成功
+	return (count << disk.size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	VERIFYチェック
+//	※BytChk=1で比較するデータを受け取る前に呼ぶ
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Disk::Reassign(const DWORD* /*cdb*/)
+int FASTCALL Disk::VerifyCheck(UL64 block, int count)
 {
 	ASSERT(this);
+	ASSERT(count > 0);
 
 	// 状態チェック
 	if (!CheckReady()) {
-		return FALSE;
+		return 0;
 	}
 
-	// REASSIGN BLOCKS成功
-	return TRUE;
+	// トータルブロック数を超えていればエラー
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
+		disk.code = DISK_INVALIDLBA;
+		return 0;
+	}
+
+	// 成功
+	return (count << disk.size);
 }
 
 //---------------------------------------------------------------------------
 //
-//	READ
+//	VERIFY(バイト比較)
+//	※受け取ったデータと媒体の内容を比較する
 //
 //---------------------------------------------------------------------------
-int FASTCALL Disk::Read(BYTE *buf, DWORD block)
+int FASTCALL Disk::VerifyBlocks(const BYTE *buf, UL64 block, int count)
 {
+	BOOL same;
+
 	ASSERT(this);
 	ASSERT(buf);
+	ASSERT(count > 0);
 
 	// 状態チェック
 	if (!CheckReady()) {
@@ -1826,59 +5890,76 @@ int FASTCALL Disk::Read(BYTE *buf, DWORD block)
 	}
 
 	// トータルブロック数を超えていればエラー
-	if (block >= disk.blocks) {
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
 		disk.code = DISK_INVALIDLBA;
 		return 0;
 	}
 
 	// キャッシュに任せる
-	if (!disk.dcache->Read(buf, block)) {
+	if (!disk.dcache->Compare(buf, block, count, same)) {
 		disk.code = DISK_READFAULT;
 		return 0;
 	}
 
+	// 一致しなければエラー
+	if (!same) {
+		disk.code = DISK_MISCOMPARE;
+		return 0;
+	}
+
 	// 成功
-	return (1 << disk.size);
+	return (count << disk.size);
 }
 
 //---------------------------------------------------------------------------
 //
-//	WRITEチェック
+//	WRITE
 //
 //---------------------------------------------------------------------------
-int FASTCALL Disk::WriteCheck(DWORD block)
+BOOL FASTCALL Disk::Write(const BYTE *buf, UL64 block)
 {
 	ASSERT(this);
+	ASSERT(buf);
 
-	// 状態チェック
-	if (!CheckReady()) {
-		return 0;
+	// レディでなければエラー
+	if (!disk.ready) {
+		disk.code = DISK_NOTREADY;
+		return FALSE;
 	}
 
 	// トータルブロック数を超えていればエラー
 	if (block >= disk.blocks) {
-		return 0;
+		disk.code = DISK_INVALIDLBA;
+		return FALSE;
 	}
 
 	// 書き込み禁止ならエラー
 	if (disk.writep) {
 		disk.code = DISK_WRITEPROTECT;
-		return 0;
+		return FALSE;
+	}
+
+	// キャッシュに任せる
+	if (!disk.dcache->Write(buf, block)) {
+		disk.code = DISK_WRITEFAULT;
+		return FALSE;
 	}
 
 	// 成功
-	return (1 << disk.size);
+	disk.code = DISK_NOERROR;
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	WRITE
+//	WRITE(複数ブロック)
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Disk::Write(const BYTE *buf, DWORD block)
+BOOL FASTCALL Disk::WriteBlocks(const BYTE *buf, UL64 block, int count)
 {
 	ASSERT(this);
 	ASSERT(buf);
+	ASSERT(count > 0);
 
 	// レディでなければエラー
 	if (!disk.ready) {
@@ -1887,7 +5968,7 @@ BOOL FASTCALL Disk::Write(const BYTE *buf, DWORD block)
 	}
 
 	// トータルブロック数を超えていればエラー
-	if (block >= disk.blocks) {
+	if (block >= disk.blocks || (UL64)count > disk.blocks - block) {
 		disk.code = DISK_INVALIDLBA;
 		return FALSE;
 	}
@@ -1899,7 +5980,7 @@ BOOL FASTCALL Disk::Write(const BYTE *buf, DWORD block)
 	}
 
 	// キャッシュに任せる
-	if (!disk.dcache->Write(buf, block)) {
+	if (!disk.dcache->Write(buf, block, count)) {
 		disk.code = DISK_WRITEFAULT;
 		return FALSE;
 	}
@@ -2050,81 +6131,418 @@ BOOL FASTCALL Disk::Removal(const DWORD *cdb)
 //---------------------------------------------------------------------------
 //
 //	READ CAPACITY
+//	※READ CAPACITY(16)は64bitのLBAで32バイトを返す
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::ReadCapacity(const DWORD *cdb, BYTE *buf)
+{
+	UL64 blocks;
+	DWORD length;
+	int size;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(buf);
+
+	// バッファクリア
+	memset(buf, 0, 32);
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// 論理ブロックアドレスの終端(disk.blocks - 1)を作成
+	ASSERT(disk.blocks > 0);
+	blocks = disk.blocks - 1;
+
+	// ブロックレングス(1 << disk.size)を作成
+	length = 1 << disk.size;
+
+	// READ CAPACITY(10)(32bitに収まらなければFFFFFFFFhでREAD CAPACITY(16)を促す)
+	if (cdb[0] != 0x9e) {
+		if (blocks > 0xffffffff) {
+			blocks = 0xffffffff;
+		}
+		buf[0] = (BYTE)(blocks >> 24);
+		buf[1] = (BYTE)(blocks >> 16);
+		buf[2] = (BYTE)(blocks >> 8);
+		buf[3] = (BYTE)blocks;
+		buf[4] = (BYTE)(length >> 24);
+		buf[5] = (BYTE)(length >> 16);
+		buf[6] = (BYTE)(length >> 8);
+		buf[7] = (BYTE)length;
+
+		// 返送サイズを返す
+		return 8;
+	}
+
+	// READ CAPACITY(16)
+	buf[0] = (BYTE)(blocks >> 56);
+	buf[1] = (BYTE)(blocks >> 48);
+	buf[2] = (BYTE)(blocks >> 40);
+	buf[3] = (BYTE)(blocks >> 32);
+	buf[4] = (BYTE)(blocks >> 24);
+	buf[5] = (BYTE)(blocks >> 16);
+	buf[6] = (BYTE)(blocks >> 8);
+	buf[7] = (BYTE)blocks;
+	buf[8] = (BYTE)(length >> 24);
+	buf[9] = (BYTE)(length >> 16);
+	buf[10] = (BYTE)(length >> 8);
+	buf[11] = (BYTE)length;
+
+	// 返送サイズはアロケーションレングスまで
+	size = (int)((cdb[10] << 24) | (cdb[11] << 16) | (cdb[12] << 8) | cdb[13]);
+	if (size > 32 || size < 0) {
+		size = 32;
+	}
+	return size;
+}
+
+//---------------------------------------------------------------------------
+//
+//	VERIFY
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::Verify(const DWORD *cdb)
+{
+	UL64 record;
+	DWORD blocks;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(cdb[0] == 0x2f);
+
+	// パラメータ取得
+	record = cdb[2];
+	record <<= 8;
+	record |= cdb[3];
+	record <<= 8;
+	record |= cdb[4];
+	record <<= 8;
+	record |= cdb[5];
+	blocks = cdb[7];
+	blocks <<= 8;
+	blocks |= cdb[8];
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// パラメータチェック
+	if (disk.blocks < (record + blocks)) {
+		disk.code = DISK_INVALIDLBA;
+		return FALSE;
+	}
+
+	// 成功
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	SYNCHRONIZE CACHE
+//	※指定範囲の変更が媒体へ反映されるまで戻らない
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::SynchronizeCache(const DWORD *cdb)
+{
+	UL64 record;
+	DWORD blocks;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(cdb[0] == 0x35);
+
+	// パラメータ取得
+	record = cdb[2];
+	record <<= 8;
+	record |= cdb[3];
+	record <<= 8;
+	record |= cdb[4];
+	record <<= 8;
+	record |= cdb[5];
+	blocks = cdb[7];
+	blocks <<= 8;
+	blocks |= cdb[8];
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return FALSE;
+	}
+
+	// パラメータチェック(ブロック数0は終端まで)
+	if (disk.blocks < (record + blocks) || record >= disk.blocks) {
+		disk.code = DISK_INVALIDLBA;
+		return FALSE;
+	}
+
+	// キャッシュがなければ何もしない
+	if (!disk.dcache) {
+		return TRUE;
+	}
+
+	// 書き込み禁止なら変更はない
+	if (disk.readonly) {
+		return TRUE;
+	}
+
+	// 範囲を同期
+	if (!disk.dcache->Sync(record, (int)blocks)) {
+		disk.code = DISK_WRITEFAULT;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	WRITE SAMEチェック
+//	※転送されるのは1ブロック分
+//
+//---------------------------------------------------------------------------
+int FASTCALL Disk::WriteSameCheck(const DWORD *cdb)
+{
+	UL64 record;
+	DWORD blocks;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(cdb[0] == 0x41);
+
+	// パラメータ取得
+	record = cdb[2];
+	record <<= 8;
+	record |= cdb[3];
+	record <<= 8;
+	record |= cdb[4];
+	record <<= 8;
+	record |= cdb[5];
+	blocks = cdb[7];
+	blocks <<= 8;
+	blocks |= cdb[8];
+
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
+
+	// キャッシュがなければ対応しない
+	if (!disk.dcache) {
+		disk.code = DISK_INVALIDCMD;
+		return 0;
+	}
+
+	// PBDATA/LBDATAはサポートしない
+	if (cdb[1] & 0x06) {
+		disk.code = DISK_INVALIDCDB;
+		return 0;
+	}
+
+	// パラメータチェック(ブロック数0は終端まで)
+	if (disk.blocks < (record + blocks) || record >= disk.blocks) {
+		disk.code = DISK_INVALIDLBA;
+		return 0;
+	}
+
+	// 書き込み禁止ならエラー
+	if (disk.writep) {
+		disk.code = DISK_WRITEPROTECT;
+		return 0;
+	}
+
+	// 1ブロック
+	return (1 << disk.size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	WRITE SAME(10)
+//	※全て0のデータならゼロ化で済ませる(UNMAP=1なら割り当ても解放する)
+//	※bufは先頭に1ブロックを受信した転送バッファで、書き込みに再利用する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Disk::WriteSame(const DWORD *cdb, BYTE *buf, int bufsize)
+{
+	UL64 record;
+	UL64 blocks;
+	DWORD num;
+	DWORD i;
+	int length;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(cdb[0] == 0x41);
+	ASSERT(buf);
+	ASSERT(bufsize >= (1 << disk.size));
+
+	// パラメータ取得
+	record = cdb[2];
+	record <<= 8;
+	record |= cdb[3];
+	record <<= 8;
+	record |= cdb[4];
+	record <<= 8;
+	record |= cdb[5];
+	blocks = cdb[7];
+	blocks <<= 8;
+	blocks |= cdb[8];
+	if (blocks == 0) {
+		blocks = disk.blocks - record;
+	}
+
+	// 全て0か
+	length = 1 << disk.size;
+	for (i = 0; i < (DWORD)length; i++) {
+		if (buf[i] != 0) {
+			break;
+		}
+	}
+	if (i == (DWORD)length) {
+		return ZeroBlocks(record, blocks, (BOOL)((cdb[1] & 0x08) != 0));
+	}
+
+	// 転送バッファに同じブロックを並べてまとめて書き込む
+	num = bufsize >> disk.size;
+	if (num > blocks) {
+		num = (DWORD)blocks;
+	}
+	for (i = 1; i < num; i++) {
+		memcpy(&buf[i << disk.size], buf, length);
+	}
+	result = TRUE;
+	while (result && blocks > 0) {
+		if (num > blocks) {
+			num = (DWORD)blocks;
+		}
+		result = WriteBlocks(buf, record, (int)num);
+		record += num;
+		blocks -= num;
+	}
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	UNMAPチェック
+//	※パラメータリスト長を返す
 //
 //---------------------------------------------------------------------------
-int FASTCALL Disk::ReadCapacity(const DWORD* /*cdb*/, BYTE *buf)
+int FASTCALL Disk::UnmapCheck(const DWORD *cdb)
 {
-	DWORD blocks;
-	DWORD length;
+	int length;
 
 	ASSERT(this);
-	ASSERT(buf);
+	ASSERT(cdb);
+	ASSERT(cdb[0] == 0x42);
 
-	// バッファクリア
-	memset(buf, 0, 8);
+	// パラメータリスト長
+	length = (int)cdb[7];
+	length <<= 8;
+	length |= (int)cdb[8];
 
 	// 状態チェック
 	if (!CheckReady()) {
 		return 0;
 	}
 
-	// 論理ブロックアドレスの終端(disk.blocks - 1)を作成
-	ASSERT(disk.blocks > 0);
-	blocks = disk.blocks - 1;
-	buf[0] = (BYTE)(blocks >> 24);
-	buf[1] = (BYTE)(blocks >> 16);
-	buf[2] = (BYTE)(blocks >> 8);
-	buf[3] = (BYTE)blocks;
+	// キャッシュがなければ対応しない
+	if (!disk.dcache) {
+		disk.code = DISK_INVALIDCMD;
+		return 0;
+	}
 
-	// ブロックレングス(1 << disk.size)を作成
-	length = 1 << disk.size;
-	buf[4] = (BYTE)(length >> 24);
-	buf[5] = (BYTE)(length >> 16);
-	buf[6] = (BYTE)(length >> 8);
-	buf[7] = (BYTE)length;
+	// ANCHORはサポートしない
+	if (cdb[1] & 0x01) {
+		disk.code = DISK_INVALIDCDB;
+		return 0;
+	}
 
-	// 返送サイズを返す
-	return 8;
+	// ブロック記述子の数を制限
+	if (length > 8 + UnmapDescMax * 16) {
+		disk.code = DISK_INVALIDCDB;
+		return 0;
+	}
+
+	// 書き込み禁止ならエラー
+	if (disk.writep) {
+		disk.code = DISK_WRITEPROTECT;
+		return 0;
+	}
+
+	return length;
 }
 
 //---------------------------------------------------------------------------
 //
-//	VERIFY
+//	UNMAP
+//	※全ての記述子を確認してから解放する
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Disk::Verify(const DWORD *cdb)
+BOOL FASTCALL Disk::Unmap(const DWORD *cdb, const BYTE *buf)
 {
-	DWORD record;
+	int length;
+	int num;
+	int i;
+	int j;
+	const BYTE *desc;
+	UL64 record;
 	DWORD blocks;
 
 	ASSERT(this);
 	ASSERT(cdb);
-	ASSERT(cdb[0] == 0x2f);
+	ASSERT(cdb[0] == 0x42);
+	ASSERT(buf);
 
-	// パラメータ取得
-	record = cdb[2];
-	record <<= 8;
-	record |= cdb[3];
-	record <<= 8;
-	record |= cdb[4];
-	record <<= 8;
-	record |= cdb[5];
-	blocks = cdb[7];
-	blocks <<= 8;
-	blocks |= cdb[8];
+	// パラメータリスト長(ヘッダに満たなければ何もしない)
+	length = (int)cdb[7];
+	length <<= 8;
+	length |= (int)cdb[8];
+	if (length < 8) {
+		return TRUE;
+	}
 
-	// 状態チェック
-	if (!CheckReady()) {
-		return 0;
+	// ブロック記述子の数
+	num = (buf[2] << 8) | buf[3];
+	if (num > length - 8) {
+		num = length - 8;
 	}
+	num /= 16;
 
-	// パラメータチェック
-	if (disk.blocks < (record + blocks)) {
-		disk.code = DISK_INVALIDLBA;
-		return FALSE;
+	// 範囲チェック
+	for (i = 0; i < num; i++) {
+		desc = &buf[8 + i * 16];
+		record = 0;
+		for (j = 0; j < 8; j++) {
+			record = (record << 8) | desc[j];
+		}
+		blocks = (desc[8] << 24) | (desc[9] << 16) | (desc[10] << 8) | desc[11];
+		if (record > disk.blocks || blocks > disk.blocks - record) {
+			disk.code = DISK_INVALIDLBA;
+			return FALSE;
+		}
+	}
+
+	// 解放
+	for (i = 0; i < num; i++) {
+		desc = &buf[8 + i * 16];
+		record = 0;
+		for (j = 0; j < 8; j++) {
+			record = (record << 8) | desc[j];
+		}
+		blocks = (desc[8] << 24) | (desc[9] << 16) | (desc[10] << 8) | desc[11];
+		if (blocks == 0) {
+			continue;
+		}
+		if (!ZeroBlocks(record, blocks, TRUE)) {
+			return FALSE;
+		}
 	}
 
-	// 成功
 	return TRUE;
 }
 
@@ -2400,13 +6818,10 @@ BOOL FASTCALL SCSIHD::Open(const Filepath& path, BOOL /*attn*/)
 	if (size < 0x9f5400) {
 		return FALSE;
 	}
-	if (size > 2LL * 1024 * 1024 * 1024 * 1024) {
-		return FALSE;
-	}
 
 	// セクタサイズとブロック数
 	disk.size = 9;
-	disk.blocks = (DWORD)(size >> 9);
+	disk.blocks = (UL64)(size >> 9);
 
 	// 基本クラス
 	return Disk::Open(path);
@@ -2430,18 +6845,17 @@ int FASTCALL SCSIHD::Inquiry(
 	ASSERT(buf);
 	ASSERT(cdb[0] == 0x12);
 
-	// EVPDチェック
-	if (cdb[1] & 0x01) {
-		disk.code = DISK_INVALIDCDB;
-		return 0;
-	}
-
 	// レディチェック(イメージファイルがない場合、エラーとする)
 	if (!disk.ready) {
 		disk.code = DISK_NOTREADY;
 		return 0;
 	}
 
+	// EVPDならVPDページ
+	if (cdb[1] & 0x01) {
+		return InquiryVPD(cdb, buf);
+	}
+
 	// 基本データ
 	// buf[0] ... Direct Access Device
 	// buf[2] ... SCSI-2準拠のコマンド体系
@@ -2457,13 +6871,16 @@ int FASTCALL SCSIHD::Inquiry(
 	buf[2] = 0x02;
 	buf[3] = 0x02;
 	buf[4] = 122 + 3;	// 実HDDに近い値
+#if USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+	buf[7] = 0x02;		// タグ付きキューイング(CmdQue)
+#endif	// USE_BURST_BUS == 1 && USE_DISCONNECT == 1
 
 	// 空白で埋める
 	memset(&buf[8], 0x20, buf[4] - 3);
 
 	// ベンダ名/製品名を決定
 	sprintf(vendor, DEFAULT_VENDER);
-	size = disk.blocks >> 11;
+	size = (int)(disk.blocks >> 11);
 	if (size < 300)
 		sprintf(product, "PRODRIVE LPS%dS", size);
 	else if (size < 600)
@@ -2501,6 +6918,85 @@ int FASTCALL SCSIHD::Inquiry(
 	return size;
 }
 
+//---------------------------------------------------------------------------
+//
+//	VPDページ作成
+//	※シンプロビジョニング(UNMAP/WRITE SAMEで領域を解放)は、書き込めて
+//	  イメージの穴開けができる場合のみ報告する
+//
+//---------------------------------------------------------------------------
+int FASTCALL SCSIHD::InquiryVPD(const DWORD *cdb, BYTE *buf)
+{
+	int size;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(buf);
+	ASSERT(cdb[1] & 0x01);
+
+	// ヘッダ(Direct Access Device、ページコード)
+	memset(buf, 0, 0x40);
+	buf[1] = (BYTE)cdb[2];
+
+	// ページ別
+	switch (cdb[2]) {
+		// サポートするページ
+		case 0x00:
+			buf[3] = 3;
+			buf[4] = 0x00;
+			buf[5] = 0xb0;
+			buf[6] = 0xb2;
+			break;
+
+		// ブロック制限
+		case 0xb0:
+			buf[3] = 0x3c;
+
+			// 最大UNMAPブロック数(無制限)と最大UNMAPブロック記述子数
+			if (IsThin()) {
+				buf[20] = 0xff;
+				buf[21] = 0xff;
+				buf[22] = 0xff;
+				buf[23] = 0xff;
+				buf[26] = (BYTE)(UnmapDescMax >> 8);
+				buf[27] = (BYTE)UnmapDescMax;
+			}
+
+			// 最大WRITE SAMEブロック数(WRITE SAME(10)の上限)
+			buf[42] = 0xff;
+			buf[43] = 0xff;
+			break;
+
+		// 論理ブロックプロビジョニング
+		// LBPU=1、LBPWS10=1、LBPRZ=1(解放した領域は0が読める)、シン
+		// 解放できなければ全て0(フル)
+		case 0xb2:
+			buf[3] = 4;
+			if (IsThin()) {
+				buf[5] = 0x80 | 0x20 | 0x04;
+				buf[6] = 0x02;
+			}
+			break;
+
+		// それ以外はサポートしない
+		default:
+			disk.code = DISK_INVALIDCDB;
+			return 0;
+	}
+
+	// 返却できるデータのサイズ
+	size = buf[3] + 4;
+
+	// 相手のバッファが少なければ制限する
+	if (size > (int)cdb[4]) {
+		size = (int)cdb[4];
+	}
+
+	// 成功
+	disk.code = DISK_NOERROR;
+	return size;
+}
+
 //---------------------------------------------------------------------------
 //
 //	MODE SELECT
@@ -2569,6 +7065,31 @@ BOOL FASTCALL SCSIHD::ModeSelect(const DWORD *cdb, const BYTE *buf, int length)
 	return TRUE;
 }
 
+//---------------------------------------------------------------------------
+//
+//	READ CAPACITY
+//	※READ CAPACITY(16)では領域を解放できる場合にUNMAPできることを報告する
+//
+//---------------------------------------------------------------------------
+int FASTCALL SCSIHD::ReadCapacity(const DWORD *cdb, BYTE *buf)
+{
+	int size;
+
+	ASSERT(this);
+	ASSERT(cdb);
+	ASSERT(buf);
+
+	// 基本クラス
+	size = Disk::ReadCapacity(cdb, buf);
+
+	// LBPME=1、LBPRZ=1(解放した領域は0が読める)
+	if (size > 0 && cdb[0] == 0x9e && IsThin()) {
+		buf[14] = 0x80 | 0x40;
+	}
+
+	return size;
+}
+
 //===========================================================================
 //
 //	SCSI ハードディスク(PC-9801-55 NEC純正/Anex86/T98Next)
@@ -2705,7 +7226,7 @@ BOOL FASTCALL SCSIHD_NEC::Open(const Filepath& path, BOOL /*attn*/)
 	}
 
 	// ブロック数
-	disk.blocks = (DWORD)(imgsize >> disk.size);
+	disk.blocks = (UL64)(imgsize >> disk.size);
 	disk.imgoffset = imgoffset;
 
 	// 基本クラス
@@ -2725,9 +7246,9 @@ int FASTCALL SCSIHD_NEC::Inquiry(
 	// 基底クラス
 	size = SCSIHD::Inquiry(cdb, buf, major, minor);
 
-	// 基底クラスでエラーなら終了
-	if (size == 0) {
-		return 0;
+	// 基底クラスでエラーか、VPDページなら終了
+	if (size == 0 || (cdb[1] & 0x01)) {
+		return size;
 	}
 
 	// SCSI1相当に変更
@@ -2873,9 +7394,9 @@ int FASTCALL SCSIHD_APPLE::Inquiry(
 	// 基底クラス
 	size = SCSIHD::Inquiry(cdb, buf, major, minor);
 
-	// 基底クラスでエラーなら終了
-	if (size == 0) {
-		return 0;
+	// 基底クラスでエラーか、VPDページなら終了
+	if (size == 0 || (cdb[1] & 0x01)) {
+		return size;
 	}
 
 	// ベンダ名
@@ -2991,7 +7512,9 @@ BOOL FASTCALL SCSIMO::Open(const Filepath& path, BOOL attn)
 	}
 
 	// 基本クラス
-	Disk::Open(path);
+	if (!Disk::Open(path)) {
+		return FALSE;
+	}
 
 	// レディならアテンション
 	if (disk.ready && attn) {
@@ -3583,11 +8106,17 @@ BOOL FASTCALL SCSICD::Open(const Filepath& path, BOOL attn)
 	disk.size = 11;
 
 	// 基本クラス
-	Disk::Open(path);
+	if (!Disk::Open(path)) {
+		return FALSE;
+	}
 
-	// RAWフラグを設定
+	// RAWフラグを設定(読み込み用バッファを確保できなければ失敗)
 	ASSERT(disk.dcache);
-	disk.dcache->SetRawMode(rawfile);
+	if (!disk.dcache->SetRawMode(rawfile)) {
+		DeleteCache();
+		CloseImage();
+		return FALSE;
+	}
 
 	// ROMメディアなので、書き込みはできない
 	disk.writep = TRUE;
@@ -3695,7 +8224,7 @@ BOOL FASTCALL SCSICD::OpenIso(const Filepath& path)
 	// データトラック1つのみ作成
 	ASSERT(!track[0]);
 	track[0] = new CDTrack(this);
-	track[0]->Init(1, 0, disk.blocks - 1);
+	track[0]->Init(1, 0, (DWORD)(disk.blocks - 1));
 	track[0]->SetPath(FALSE, path);
 	tracks = 1;
 	dataindex = 0;
@@ -3744,7 +8273,7 @@ BOOL FASTCALL SCSICD::OpenPhysical(const Filepath& path)
 	// データトラック1つのみ作成
 	ASSERT(!track[0]);
 	track[0] = new CDTrack(this);
-	track[0]->Init(1, 0, disk.blocks - 1);
+	track[0]->Init(1, 0, (DWORD)(disk.blocks - 1));
 	track[0]->SetPath(FALSE, path);
 	tracks = 1;
 	dataindex = 0;
@@ -3826,10 +8355,9 @@ int FASTCALL SCSICD::Inquiry(
 //	READ
 //
 //---------------------------------------------------------------------------
-int FASTCALL SCSICD::Read(BYTE *buf, DWORD block)
+int FASTCALL SCSICD::Read(BYTE *buf, UL64 block)
 {
 	int index;
-	Filepath path;
 
 	ASSERT(this);
 	ASSERT(buf);
@@ -3849,28 +8377,75 @@ int FASTCALL SCSICD::Read(BYTE *buf, DWORD block)
 	}
 	ASSERT(track[index]);
 
-	// 現在のデータトラックと異なっていれば
-	if (dataindex != index) {
-		// 現在のディスクキャッシュを削除(Saveの必要はない)
-		delete disk.dcache;
-		disk.dcache = NULL;
+	// データトラックを切り替える
+	// ※キャッシュはディスク全体のLBAで管理するので作り直さない
+	dataindex = index;
+
+	// 基本クラス
+	return Disk::Read(buf, block);
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(複数ブロック)
+//
+//---------------------------------------------------------------------------
+int FASTCALL SCSICD::ReadBlocks(BYTE *buf, UL64 block, int count)
+{
+	int index;
 
-		// ブロック数を再設定
-		disk.blocks = track[index]->GetBlocks();
-		ASSERT(disk.blocks > 0);
+	ASSERT(this);
+	ASSERT(buf);
+	ASSERT(count > 0);
 
-		// ディスクキャッシュを作り直す
-		track[index]->GetPath(path);
-		disk.dcache = new DiskCache(this, disk.size, disk.blocks);
-		disk.dcache->SetRawMode(rawfile);
+	// 状態チェック
+	if (!CheckReady()) {
+		return 0;
+	}
 
-		// データインデックスを再設定
-		dataindex = index;
+	// 先頭と終端がいずれかのトラックに含まれること
+	index = SearchTrack(block + count - 1);
+	if (SearchTrack(block) < 0 || index < 0) {
+		disk.code = DISK_INVALIDLBA;
+		return 0;
 	}
 
+	// データトラックを切り替える
+	dataindex = index;
+
 	// 基本クラス
-	ASSERT(dataindex >= 0);
-	return Disk::Read(buf, block);
+	return Disk::ReadBlocks(buf, block, count);
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(キャッシュ参照の固定)
+//
+//---------------------------------------------------------------------------
+int FASTCALL SCSICD::PinBlocks(BYTE **ptr, UL64 block, int count)
+{
+	int index;
+	int length;
+
+	ASSERT(this);
+	ASSERT(ptr);
+	ASSERT(count > 0);
+
+	// トラックに含まれなければReadBlocksに任せる
+	index = SearchTrack(block + count - 1);
+	if (SearchTrack(block) < 0 || index < 0) {
+		return 0;
+	}
+
+	// 基本クラス
+	length = Disk::PinBlocks(ptr, block, count);
+	if (length <= 0) {
+		return 0;
+	}
+
+	// データトラックを切り替える
+	dataindex = index;
+	return length;
 }
 
 //---------------------------------------------------------------------------
@@ -4136,17 +8711,22 @@ void FASTCALL SCSICD::ClearTrack()
 //	※見つからなければ-1を返す
 //
 //---------------------------------------------------------------------------
-int FASTCALL SCSICD::SearchTrack(DWORD lba) const
+int FASTCALL SCSICD::SearchTrack(UL64 lba) const
 {
 	int i;
 
 	ASSERT(this);
 
+	// トラックのLBAは32bit
+	if (lba > 0xffffffff) {
+		return -1;
+	}
+
 	// トラックループ
 	for (i = 0; i < tracks; i++) {
 		// トラックに聞く
 		ASSERT(track[i]);
-		if (track[i]->IsValid(lba)) {
+		if (track[i]->IsValid((DWORD)lba)) {
 			return i;
 		}
 	}
@@ -4435,18 +9015,28 @@ SASIDEV::SASIDEV()
 #if USE_WAIT_CTRL == 1
 	ctrl.execstart = 0;
 #endif	// USE_WAIT_CTRL
-	ctrl.bufsize = 0x800;
+	ctrl.bufsize = Disk::XferDef;
 	ctrl.buffer = (BYTE *)malloc(ctrl.bufsize);
 	memset(ctrl.buffer, 0x00, ctrl.bufsize);
 	ctrl.blocks = 0;
 	ctrl.next = 0;
+	ctrl.remain = 0;
+	ctrl.bufblocks = 0;
+	ctrl.curblocks = 0;
+	ctrl.pinbuf = NULL;
+	ctrl.pinunit = NULL;
+	ctrl.pinblock = 0;
 	ctrl.offset = 0;
 	ctrl.length = 0;
 
 	// 論理ユニット初期化
 	for (i = 0; i < UnitMax; i++) {
 		ctrl.unit[i] = NULL;
+		ctrl.devclass[i] = ClassHD;
 	}
+
+	// コマンドテーブル構築
+	InitCommand();
 }
 
 //---------------------------------------------------------------------------
@@ -4489,6 +9079,10 @@ void FASTCALL SASIDEV::Reset()
 	memset(ctrl.buffer, 0x00, ctrl.bufsize);
 	ctrl.blocks = 0;
 	ctrl.next = 0;
+	ctrl.remain = 0;
+	ctrl.bufblocks = 0;
+	ctrl.curblocks = 0;
+	XferRelease();
 	ctrl.offset = 0;
 	ctrl.length = 0;
 
@@ -4537,6 +9131,26 @@ void FASTCALL SASIDEV::SetUnit(int no, Disk *dev)
 	ASSERT(no < UnitMax);
 
 	ctrl.unit[no] = dev;
+
+	// デバイス種別(コマンド毎に判別しないよう、ここで決めておく)
+	ctrl.devclass[no] = ClassHD;
+	if (!dev) {
+		return;
+	}
+	switch (dev->GetID()) {
+		case MAKEID('S', 'A', 'H', 'D'):
+			ctrl.devclass[no] = ClassSASI;
+			break;
+		case MAKEID('S', 'C', 'M', 'O'):
+			ctrl.devclass[no] = ClassMO;
+			break;
+		case MAKEID('S', 'C', 'C', 'D'):
+			ctrl.devclass[no] = ClassCD;
+			break;
+		case MAKEID('S', 'C', 'B', 'R'):
+			ctrl.devclass[no] = ClassBridge;
+			break;
+	}
 }
 
 //---------------------------------------------------------------------------
@@ -4685,6 +9299,9 @@ void FASTCALL SASIDEV::BusFree()
 		// フェーズ設定
 		ctrl.phase = BUS::busfree;
 
+		// キャッシュ参照を解放
+		XferRelease();
+
 		// 信号線
 		ctrl.bus->SetREQ(FALSE);
 		ctrl.bus->SetMSG(FALSE);
@@ -4783,7 +9400,7 @@ void FASTCALL SASIDEV::Command()
 		ctrl.blocks = 1;
 
 #if USE_BURST_BUS == 1
-		// コマンド受信ハンドシェイク(最初のコマンドで自動で10バイト受信する)
+		// コマンド受信ハンドシェイク(最初のコマンドでCDB長を判別して受信する)
 		count = ctrl.bus->CommandHandShake(ctrl.buffer);
 	
 		// 1バイトも受信できなければステータスフェーズへ移行
@@ -4792,10 +9409,8 @@ void FASTCALL SASIDEV::Command()
 			return;
 		}
 	
-		// 10バイトCDBのチェック
-		if (ctrl.buffer[0] >= 0x20 && ctrl.buffer[0] <= 0x7D) {
-			ctrl.length = 10;
-		}
+		// 10/12/16バイトCDBのチェック
+		ctrl.length = BUS::GetCommandByteCount(ctrl.buffer[0]);
 	
 		// 全て受信できなければステータスフェーズへ移行
 		if (count != (int)ctrl.length) {
@@ -4837,6 +9452,61 @@ void FASTCALL SASIDEV::Command()
 #endif	// USE_BURST_BUS
 }
 
+//---------------------------------------------------------------------------
+//
+//	SASIのコマンド
+//
+//---------------------------------------------------------------------------
+const SASIDEV::command_t SASIDEV::SASITable[] = {
+	// TEST UNIT READY
+	{ 0x00, &SASIDEV::CmdTestUnitReady,	6,	DirNone,	FALSE },
+	// REZERO UNIT
+	{ 0x01, &SASIDEV::CmdRezero,		6,	DirNone,	FALSE },
+	// REQUEST SENSE
+	{ 0x03, &SASIDEV::CmdRequestSense,	6,	DirIn,		TRUE },
+	// FORMAT UNIT
+	{ 0x04, &SASIDEV::CmdFormat,		6,	DirNone,	FALSE },
+	// FORMAT UNIT
+	{ 0x06, &SASIDEV::CmdFormat,		6,	DirNone,	FALSE },
+	// REASSIGN BLOCKS
+	{ 0x07, &SASIDEV::CmdReassign,		6,	DirNone,	FALSE },
+	// READ(6)
+	{ 0x08, &SASIDEV::CmdRead6,			6,	DirIn,		FALSE },
+	// WRITE(6)
+	{ 0x0a, &SASIDEV::CmdWrite6,		6,	DirOut,		FALSE },
+	// SEEK(6)
+	{ 0x0b, &SASIDEV::CmdSeek6,			6,	DirNone,	FALSE },
+	// ASSIGN(SASIのみ)
+	{ 0x0e, &SASIDEV::CmdAssign,		6,	DirNone,	FALSE },
+	// SPECIFY(SASIのみ)
+	{ 0xc2, &SASIDEV::CmdSpecify,		6,	DirOut,		FALSE },
+	// 終端
+	{ 0x00, NULL,						0,	DirNone,	FALSE }
+};
+
+//---------------------------------------------------------------------------
+//
+//	コマンドテーブル(オペコードで直接引く)
+//
+//---------------------------------------------------------------------------
+SASIDEV::command_t SASIDEV::CommandTable[0x100];
+
+//---------------------------------------------------------------------------
+//
+//	コマンドテーブル構築
+//
+//---------------------------------------------------------------------------
+void FASTCALL SASIDEV::InitCommand()
+{
+	const command_t *list;
+
+	for (list = SASITable; list->func; list++) {
+		ASSERT(list->opcode < 0x100);
+		ASSERT(list->length == BUS::GetCommandByteCount(list->opcode));
+		CommandTable[list->opcode] = *list;
+	}
+}
+
 //---------------------------------------------------------------------------
 //
 //	実行フェーズ
@@ -4844,6 +9514,9 @@ void FASTCALL SASIDEV::Command()
 //---------------------------------------------------------------------------
 void FASTCALL SASIDEV::Execute()
 {
+	const command_t *cmd;
+	DWORD lun;
+
 	ASSERT(this);
 
 #if defined(DISK_LOG)
@@ -4858,69 +9531,26 @@ void FASTCALL SASIDEV::Execute()
 	ctrl.blocks = 1;
 #if USE_WAIT_CTRL == 1
 	ctrl.execstart = ::GetTimeUs();
-#endif	// USE_WAIT_CTRL
-
-	// コマンド別処理
-	switch (ctrl.cmd[0]) {
-		// TEST UNIT READY
-		case 0x00:
-			CmdTestUnitReady();
-			return;
-
-		// REZERO UNIT
-		case 0x01:
-			CmdRezero();
-			return;
-
-		// REQUEST SENSE
-		case 0x03:
-			CmdRequestSense();
-			return;
-
-		// FORMAT UNIT
-		case 0x04:
-			CmdFormat();
-			return;
-
-		// FORMAT UNIT
-		case 0x06:
-			CmdFormat();
-			return;
-
-		// REASSIGN BLOCKS
-		case 0x07:
-			CmdReassign();
-			return;
-
-		// READ(6)
-		case 0x08:
-			CmdRead6();
-			return;
-
-		// WRITE(6)
-		case 0x0a:
-			CmdWrite6();
-			return;
-
-		// SEEK(6)
-		case 0x0b:
-			CmdSeek6();
-			return;
+#endif	// USE_WAIT_CTRL
 
-		// ASSIGN(SASIのみ)
-		case 0x0e:
-			CmdAssign();
-			return;
+	// コマンドテーブルを引く
+	cmd = &CommandTable[ctrl.cmd[0] & 0xff];
+	if (!cmd->func) {
+		// それ以外は対応していない
+		Log(Log::Warning, "未対応コマンド $%02X", ctrl.cmd[0]);
+		CmdInvalid();
+		return;
+	}
 
-		// SPECIFY(SASIのみ)
-		case 0xc2:
-			CmdSpecify();
-			return;
+	// ユニットアテンションの報告(許可されたコマンドを除く)
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!cmd->attn && ctrl.unit[lun] && !ctrl.unit[lun]->CheckAttn()) {
+		Error();
+		return;
 	}
 
-	// それ以外は対応していない
-	Log(Log::Warning, "未対応コマンド $%02X", ctrl.cmd[0]);
-	CmdInvalid();
+	// コマンド別処理
+	(this->*cmd->func)();
 }
 
 //---------------------------------------------------------------------------
@@ -4959,6 +9589,9 @@ void FASTCALL SASIDEV::Status()
 		// フェーズ設定
 		ctrl.phase = BUS::status;
 
+		// キャッシュ参照を解放
+		XferRelease();
+
 		// ターゲットが操作する信号線
 		ctrl.bus->SetMSG(FALSE);
 		ctrl.bus->SetCD(TRUE);
@@ -5472,15 +10105,24 @@ void FASTCALL SASIDEV::CmdRead6()
 #endif	// DISK_LOG
 
 	// ドライブでコマンド処理
-	ctrl.length = ctrl.unit[lun]->Read(ctrl.buffer, record);
-	if (ctrl.length <= 0) {
+	if (!XferSetup(ctrl.unit[lun])) {
 		// 失敗(エラー)
 		Error();
 		return;
 	}
+	ctrl.next = record;
 
-	// 次のブロックを設定
-	ctrl.next = record + 1;
+	// 読み込みを待つなら一旦切断
+	if (XferDisconnect()) {
+		return;
+	}
+
+	ctrl.length = XferRead(ctrl.unit[lun], ctrl.buffer);
+	if (ctrl.length <= 0) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
 
 	// リードフェーズ
 	DataIn();
@@ -5522,7 +10164,12 @@ void FASTCALL SASIDEV::CmdWrite6()
 #endif	// DISK_LOG
 
 	// ドライブでコマンド処理
-	ctrl.length = ctrl.unit[lun]->WriteCheck(record);
+	if (!XferSetup(ctrl.unit[lun])) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+	ctrl.length = ctrl.unit[lun]->WriteCheck(record, XferNext());
 	if (ctrl.length <= 0) {
 		// 失敗(エラー)
 		Error();
@@ -5530,7 +10177,10 @@ void FASTCALL SASIDEV::CmdWrite6()
 	}
 
 	// 次のブロックを設定
-	ctrl.next = record + 1;
+	ctrl.next = record + ctrl.curblocks;
+
+	// 受信中に書き込み先のトラックを揃える
+	XferAhead(record);
 
 	// ライトフェーズ
 	DataOut();
@@ -5816,10 +10466,8 @@ void FASTCALL SASIDEV::Receive()
 
 			// 最初のデータ(オフセット0)によりレングスを再設定
 			if (ctrl.offset == 0) {
-				if (ctrl.cmd[0] >= 0x20 && ctrl.cmd[0] <= 0x7D) {
-					// 10バイトCDB
-					ctrl.length = 10;
-				}
+				// 10/12/16バイトCDB
+				ctrl.length = BUS::GetCommandByteCount(ctrl.cmd[0]);
 			}
 			break;
 
@@ -5933,7 +10581,13 @@ void FASTCALL SASIDEV::SendBurst()
 
 	// レングス!=0なら送信
 	if (ctrl.length != 0) {
-		len = ctrl.bus->SendHandShake(ctrl.buffer, ctrl.length);
+		// 送信中に次のバッファを取り寄せる
+		if (ctrl.phase == BUS::datain && ctrl.blocks > 1) {
+			XferAhead(ctrl.next);
+		}
+
+		len = ctrl.bus->SendHandShake(
+			ctrl.pinbuf ? ctrl.pinbuf : ctrl.buffer, ctrl.length);
 
 		// 全て送信できなければステータスフェーズへ移行
 		if (len != (int)ctrl.length) {
@@ -6082,6 +10736,178 @@ void FASTCALL SASIDEV::ReceiveBurst()
 }
 #endif	// USE_BURST_BUS
 
+//---------------------------------------------------------------------------
+//
+//	ブロック転送準備
+//	※ctrl.blocksをレコード数からバッファ数に置き換える
+//	※バッファを確保できなければ元のバッファを残してFALSEを返す
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL SASIDEV::XferSetup(Disk *unit)
+{
+	int size;
+	int per;
+	BYTE *buffer;
+
+	ASSERT(this);
+	ASSERT(unit);
+	ASSERT(ctrl.blocks > 0);
+
+	// バッファあたりのレコード数
+	size = unit->GetSectorSize();
+	per = unit->GetXferSize() / size;
+	if (per <= 0) {
+		per = 1;
+	}
+
+	// 転送サイズに足りなければバッファを再確保
+	if (per * size > ctrl.bufsize) {
+		buffer = (BYTE *)malloc(per * size);
+		if (!buffer) {
+			unit->NoResource();
+			return FALSE;
+		}
+		free(ctrl.buffer);
+		ctrl.buffer = buffer;
+		ctrl.bufsize = per * size;
+	}
+
+	// レコード数をバッファ数に換算
+	ctrl.remain = ctrl.blocks;
+	ctrl.bufblocks = per;
+	ctrl.curblocks = 0;
+	ctrl.blocks = (ctrl.remain + per - 1) / per;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	次のバッファのレコード数
+//	※ctrl.blocksは現在のバッファを含む残りバッファ数になる
+//
+//---------------------------------------------------------------------------
+DWORD FASTCALL SASIDEV::XferNext()
+{
+	ASSERT(this);
+	ASSERT(ctrl.remain > 0);
+
+	ctrl.curblocks = ctrl.bufblocks;
+	if (ctrl.curblocks > ctrl.remain) {
+		ctrl.curblocks = ctrl.remain;
+	}
+	ctrl.remain -= ctrl.curblocks;
+	ctrl.blocks = 1 + (ctrl.remain + ctrl.bufblocks - 1) / ctrl.bufblocks;
+
+	return ctrl.curblocks;
+}
+
+//---------------------------------------------------------------------------
+//
+//	現在のバッファのレコード数を短縮
+//	※キャッシュ参照がトラック境界で切れた場合、残りは次のバッファへ回す
+//
+//---------------------------------------------------------------------------
+void FASTCALL SASIDEV::XferShrink(DWORD count)
+{
+	ASSERT(this);
+	ASSERT((count > 0) && (count <= ctrl.curblocks));
+
+	ctrl.remain += ctrl.curblocks - count;
+	ctrl.curblocks = count;
+	ctrl.blocks = 1 + (ctrl.remain + ctrl.bufblocks - 1) / ctrl.bufblocks;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ブロック読み込み
+//	※可能ならキャッシュを直接参照して、バッファへのコピーを省く
+//
+//---------------------------------------------------------------------------
+int FASTCALL SASIDEV::XferRead(Disk *unit, BYTE *buf)
+{
+	int length;
+	DWORD count;
+
+	ASSERT(this);
+	ASSERT(unit);
+	ASSERT(buf);
+
+	// 前のバッファの参照を解放
+	XferRelease();
+
+	// 次のバッファのレコード数
+	count = XferNext();
+
+#if USE_BURST_BUS == 1
+	// キャッシュを直接送信できるならそのまま参照する
+	length = unit->PinBlocks(&ctrl.pinbuf, ctrl.next, count);
+	if (length > 0) {
+		ctrl.pinunit = unit;
+		ctrl.pinblock = ctrl.next;
+		XferShrink(length / unit->GetSectorSize());
+		ctrl.next += ctrl.curblocks;
+		return length;
+	}
+	ctrl.pinbuf = NULL;
+#endif	// USE_BURST_BUS
+
+	// バッファへ読み込む
+	length = unit->ReadBlocks(buf, ctrl.next, count);
+	ctrl.next += ctrl.curblocks;
+	return length;
+}
+
+//---------------------------------------------------------------------------
+//
+//	キャッシュ参照の解放
+//
+//---------------------------------------------------------------------------
+void FASTCALL SASIDEV::XferRelease()
+{
+	ASSERT(this);
+
+	if (ctrl.pinunit) {
+		ctrl.pinunit->UnpinBlocks(ctrl.pinblock);
+		ctrl.pinunit = NULL;
+	}
+	ctrl.pinbuf = NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	転送先の取り寄せ
+//	※blockから次のバッファの終わりまでを先読みスレッドに読み込ませ、
+//	  バスの転送とディスクの読み込みを重ねる
+//
+//---------------------------------------------------------------------------
+void FASTCALL SASIDEV::XferAhead(UL64 block)
+{
+	DWORD lun;
+	DWORD count;
+
+	ASSERT(this);
+	ASSERT(block <= ctrl.next);
+
+	// 論理ユニット(先読みが無効なら取り寄せない)
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun] || ctrl.unit[lun]->GetReadAhead() <= 0) {
+		return;
+	}
+
+	// 次のバッファのレコード数
+	count = ctrl.remain;
+	if (count > ctrl.bufblocks) {
+		count = ctrl.bufblocks;
+	}
+	count += (DWORD)(ctrl.next - block);
+	if (count == 0) {
+		return;
+	}
+
+	// 読み込みを始めるだけで完了は待たない
+	ctrl.unit[lun]->Prefetch(block, (int)count);
+}
+
 //---------------------------------------------------------------------------
 //
 //	データ転送IN
@@ -6107,9 +10933,12 @@ BOOL FASTCALL SASIDEV::XferIn(BYTE *buf)
 		case 0x08:
 		// READ(10)
 		case 0x28:
+		// READ(16)
+		case 0x88:
+		// READ(12)
+		case 0xa8:
 			// ディスクから読み取りを行う
-			ctrl.length = ctrl.unit[lun]->Read(buf, ctrl.next);
-			ctrl.next++;
+			ctrl.length = XferRead(ctrl.unit[lun], buf);
 
 			// エラーなら、ステータスフェーズへ
 			if (ctrl.length <= 0) {
@@ -6169,7 +10998,7 @@ BOOL FASTCALL SASIDEV::XferOut(BOOL cont)
 		// WRITE(10)
 		case 0x2a:
 			// ホストブリッジはSEND MESSAGE10に差し替える
-			if (ctrl.unit[lun]->GetID() == MAKEID('S', 'C', 'B', 'R')) {
+			if (ctrl.devclass[lun] == ClassBridge) {
 				bridge = (SCSIBR*)ctrl.unit[lun];
 				if (bridge->SendMessage10(ctrl.cmd, ctrl.buffer) <= 0) {
 					// メッセージ送信失敗
@@ -6183,29 +11012,90 @@ BOOL FASTCALL SASIDEV::XferOut(BOOL cont)
 
 		// WRITE AND VERIFY
 		case 0x2e:
+		// WRITE(16)
+		case 0x8a:
+		// WRITE AND VERIFY(16)
+		case 0x8e:
+		// WRITE(12)
+		case 0xaa:
+		// WRITE AND VERIFY(12)
+		case 0xae:
 			// 書き込みを行う
-			if (!ctrl.unit[lun]->Write(ctrl.buffer, ctrl.next - 1)) {
+			if (!ctrl.unit[lun]->WriteBlocks(ctrl.buffer,
+				ctrl.next - ctrl.curblocks, ctrl.curblocks)) {
 				// 書き込み失敗
 				return FALSE;
 			}
 
 			// 次のブロックが必要ないならここまで
-			ctrl.next++;
 			if (!cont) {
 				break;
 			}
 
 			// 次のブロックをチェック
-			ctrl.length = ctrl.unit[lun]->WriteCheck(ctrl.next - 1);
+			ctrl.length = ctrl.unit[lun]->WriteCheck(ctrl.next, XferNext());
 			if (ctrl.length <= 0) {
 				// 書き込みできない
 				return FALSE;
 			}
+			ctrl.next += ctrl.curblocks;
+
+			// 受信中に書き込み先のトラックを揃える
+			XferAhead(ctrl.next - ctrl.curblocks);
+
+			// 正常なら、ワーク設定
+			ctrl.offset = 0;
+			break;
+
+		// VERIFY(10)
+		case 0x2f:
+		// VERIFY(16)
+		case 0x8f:
+		// VERIFY(12)
+		case 0xaf:
+			// 比較を行う
+			if (ctrl.unit[lun]->VerifyBlocks(ctrl.buffer,
+				ctrl.next - ctrl.curblocks, ctrl.curblocks) <= 0) {
+				// 比較失敗または不一致
+				return FALSE;
+			}
+
+			// 次のブロックが必要ないならここまで
+			if (!cont) {
+				break;
+			}
+
+			// 次のブロックをチェック
+			ctrl.length = ctrl.unit[lun]->VerifyCheck(ctrl.next, XferNext());
+			if (ctrl.length <= 0) {
+				return FALSE;
+			}
+			ctrl.next += ctrl.curblocks;
+
+			// 受信中に比較するトラックを揃える
+			XferAhead(ctrl.next - ctrl.curblocks);
 
 			// 正常なら、ワーク設定
 			ctrl.offset = 0;
 			break;
 
+		// WRITE SAME(10)
+		case 0x41:
+			if (!ctrl.unit[lun]->WriteSame(
+				ctrl.cmd, ctrl.buffer, ctrl.bufsize)) {
+				// 書き込み失敗
+				return FALSE;
+			}
+			break;
+
+		// UNMAP
+		case 0x42:
+			if (!ctrl.unit[lun]->Unmap(ctrl.cmd, ctrl.buffer)) {
+				// 解放失敗
+				return FALSE;
+			}
+			break;
+
 		// SPECIFY(SASIのみ)
 		case 0xc2:
 			break;
@@ -6245,11 +11135,30 @@ void FASTCALL SASIDEV::FlushUnit()
 		case 0x2a:
 		// WRITE AND VERIFY
 		case 0x2e:
+		// WRITE SAME(10)
+		case 0x41:
+		// UNMAP
+		case 0x42:
+		// WRITE(16)
+		case 0x8a:
+		// WRITE AND VERIFY(16)
+		case 0x8e:
+		// WRITE(12)
+		case 0xaa:
+		// WRITE AND VERIFY(12)
+		case 0xae:
 			// フラッシュ
 			if (!ctrl.unit[lun]->IsCacheWB()) {
 				ctrl.unit[lun]->Flush();
 			}
 			break;
+
+		// VERIFY(10/16/12)は書き込まない
+		case 0x2f:
+		case 0x8f:
+		case 0xaf:
+			break;
+
 		default:
 			ASSERT(FALSE);
 			break;
@@ -6309,6 +11218,23 @@ SCSIDEV::SCSIDEV() : SASIDEV()
 	scsi.atnmsg = FALSE;
 	scsi.msc = 0;
 	memset(scsi.msb, 0x00, sizeof(scsi.msb));
+	scsi.initiator = -1;
+	scsi.discpriv = FALSE;
+	scsi.reconnect = FALSE;
+	scsi.resume = FALSE;
+	scsi.dequeued = FALSE;
+	scsi.reseltime = 0;
+	scsi.reselwait = 0;
+	scsi.tagmsg = 0;
+	scsi.tag = 0;
+	memset(scsi.queue, 0x00, sizeof(scsi.queue));
+	scsi.queued = 0;
+	scsi.seq = 0;
+	scsi.curseq = 0;
+	scsi.head = 0;
+
+	// コマンドテーブル構築
+	InitCommand();
 }
 
 //---------------------------------------------------------------------------
@@ -6331,6 +11257,20 @@ void FASTCALL SCSIDEV::Reset()
 	scsi.atnmsg = FALSE;
 	scsi.msc = 0;
 	memset(scsi.msb, 0x00, sizeof(scsi.msb));
+	scsi.initiator = -1;
+	scsi.discpriv = FALSE;
+	scsi.reconnect = FALSE;
+	scsi.resume = FALSE;
+	scsi.dequeued = FALSE;
+	scsi.reseltime = 0;
+	scsi.reselwait = 0;
+	scsi.tagmsg = 0;
+	scsi.tag = 0;
+	memset(scsi.queue, 0x00, sizeof(scsi.queue));
+	scsi.queued = 0;
+	scsi.seq = 0;
+	scsi.curseq = 0;
+	scsi.head = 0;
 
 	// 基底クラス
 	SASIDEV::Reset();
@@ -6418,6 +11358,107 @@ BUS::phase_t FASTCALL SCSIDEV::Process()
 	return ctrl.phase;
 }
 
+//---------------------------------------------------------------------------
+//
+//	再接続
+//	※バスフリー中に呼ぶ。リセレクションに成功したらメッセージインへ進む
+//
+//---------------------------------------------------------------------------
+BUS::phase_t FASTCALL SCSIDEV::Reconnect()
+{
+#if USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+	int index;
+	queue_t *q;
+	DWORD lun;
+
+	ASSERT(this);
+
+	// 切断中のコマンドが無ければ何もしない
+	if (scsi.queued == 0 || ctrl.id < 0 || ctrl.bus == NULL) {
+		return ctrl.phase;
+	}
+
+	// 失敗した直後は間隔を空ける
+	if (scsi.reselwait > 0 &&
+		(::GetTimeUs() - scsi.reseltime) < scsi.reselwait) {
+		return ctrl.phase;
+	}
+
+	// 次に再接続するコマンド
+	index = QueueSelect();
+	if (index < 0) {
+		return ctrl.phase;
+	}
+	q = &scsi.queue[index];
+
+	// リセレクション
+	if (!ctrl.bus->ReselectHandShake(ctrl.id, q->initiator)) {
+		// イニシエータが応答しなければあきらめる
+		if ((::GetTimeUs() - q->start) >= ReconnectLimit) {
+			Log(Log::Warning, "再接続タイムアウト ID=%d", ctrl.id);
+			QueueAbort(q->initiator, q->tagmsg, q->tag);
+		}
+
+		// 次の試行まで待つ時間を倍にしていく
+		scsi.reseltime = ::GetTimeUs();
+		if (scsi.reselwait == 0) {
+			scsi.reselwait = ReselectBackoff;
+		} else if (scsi.reselwait < ReselectBackoffMax) {
+			scsi.reselwait *= 2;
+			if (scsi.reselwait > ReselectBackoffMax) {
+				scsi.reselwait = ReselectBackoffMax;
+			}
+		}
+		return ctrl.phase;
+	}
+	scsi.reselwait = 0;
+
+#if defined(DISK_LOG)
+	Log(Log::Normal, "リセレクションフェーズ ID=%d", ctrl.id);
+#endif	// DISK_LOG
+
+	// コマンドを戻す
+	memcpy(ctrl.cmd, q->cmd, sizeof(ctrl.cmd));
+	scsi.initiator = q->initiator;
+	scsi.discpriv = TRUE;
+	scsi.tagmsg = q->tagmsg;
+	scsi.tag = q->tag;
+	scsi.curseq = q->seq;
+	scsi.resume = q->started;
+	if (q->started) {
+		ctrl.next = q->record;
+		ctrl.remain = q->blocks;
+		ctrl.bufblocks = q->bufblocks;
+		ctrl.curblocks = 0;
+	}
+
+	// エレベータの位置を進める
+	if (q->blocks > 0) {
+		scsi.head = q->record + q->blocks;
+	}
+
+	// キューから外す
+	q->used = FALSE;
+	scsi.queued--;
+	scsi.reconnect = TRUE;
+	ctrl.phase = BUS::reselection;
+
+	// IDENTIFYメッセージ(タグ付きならSIMPLE QUEUE TAGを続ける)
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	ctrl.length = 1;
+	ctrl.blocks = 1;
+	ctrl.buffer[0] = (BYTE)(0x80 | lun);
+	if (scsi.tagmsg != 0) {
+		ctrl.length = 3;
+		ctrl.buffer[1] = 0x20;
+		ctrl.buffer[2] = (BYTE)scsi.tag;
+	}
+	MsgIn();
+#endif	// USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+
+	return ctrl.phase;
+}
+
 //---------------------------------------------------------------------------
 //
 //	フェーズ
@@ -6443,6 +11484,9 @@ void FASTCALL SCSIDEV::BusFree()
 		// フェーズ設定
 		ctrl.phase = BUS::busfree;
 
+		// キャッシュ参照を解放
+		XferRelease();
+
 		// 信号線
 		ctrl.bus->SetREQ(FALSE);
 		ctrl.bus->SetMSG(FALSE);
@@ -6473,6 +11517,8 @@ void FASTCALL SCSIDEV::BusFree()
 void FASTCALL SCSIDEV::Selection()
 {
 	DWORD id;
+	DWORD data;
+	int i;
 
 	ASSERT(this);
 
@@ -6495,6 +11541,19 @@ void FASTCALL SCSIDEV::Selection()
 			"セレクションフェーズ ID=%d (デバイスあり)", ctrl.id);
 #endif	// DISK_LOG
 
+		// イニシエータIDを記録
+		data = ctrl.bus->GetDAT() & ~id;
+		scsi.initiator = -1;
+		for (i = 0; i < 8; i++) {
+			if (data == (DWORD)(1 << i)) {
+				scsi.initiator = i;
+				break;
+			}
+		}
+		scsi.discpriv = FALSE;
+		scsi.tagmsg = 0;
+		scsi.tag = 0;
+
 		// フェーズ設定
 		ctrl.phase = BUS::selection;
 
@@ -6516,178 +11575,226 @@ void FASTCALL SCSIDEV::Selection()
 
 //---------------------------------------------------------------------------
 //
-//	実行フェーズ
+//	共通のコマンド
+//
+//---------------------------------------------------------------------------
+const SCSIDEV::command_t SCSIDEV::CommonTable[] = {
+	// TEST UNIT READY
+	{ 0x00, &SCSIDEV::CmdTestUnitReady,		6,	DirNone,	FALSE },
+	// REZERO
+	{ 0x01, &SCSIDEV::CmdRezero,			6,	DirNone,	FALSE },
+	// REQUEST SENSE
+	{ 0x03, &SCSIDEV::CmdRequestSense,		6,	DirIn,		TRUE },
+	// INQUIRY
+	{ 0x12, &SCSIDEV::CmdInquiry,			6,	DirIn,		TRUE },
+	// MODE SELECT
+	{ 0x15, &SCSIDEV::CmdModeSelect,		6,	DirOut,		TRUE },
+	// MDOE SENSE
+	{ 0x1a, &SCSIDEV::CmdModeSense,			6,	DirIn,		TRUE },
+	// START STOP UNIT
+	{ 0x1b, &SCSIDEV::CmdStartStop,			6,	DirNone,	TRUE },
+	// SEND DIAGNOSTIC
+	{ 0x1d, &SCSIDEV::CmdSendDiag,			6,	DirOut,		TRUE },
+	// PREVENT/ALLOW MEDIUM REMOVAL
+	{ 0x1e, &SCSIDEV::CmdRemoval,			6,	DirNone,	FALSE },
+	// MODE SELECT(10)
+	{ 0x55, &SCSIDEV::CmdModeSelect10,		10,	DirOut,		TRUE },
+	// MDOE SENSE(10)
+	{ 0x5a, &SCSIDEV::CmdModeSense10,		10,	DirIn,		TRUE },
+	// SPECIFY(SASIのみ/SxSI利用時の警告抑制)
+	{ 0xc2, &SCSIDEV::CmdInvalid,			6,	DirNone,	TRUE },
+	// 終端
+	{ 0x00, NULL,							0,	DirNone,	FALSE }
+};
+
+//---------------------------------------------------------------------------
+//
+//	ブロックデバイス(HD/MO/CD)のコマンド
+//
+//---------------------------------------------------------------------------
+const SCSIDEV::command_t SCSIDEV::BlockTable[] = {
+	// FORMAT UNIT
+	{ 0x04, &SCSIDEV::CmdFormat,			6,	DirNone,	FALSE },
+	// REASSIGN BLOCKS
+	{ 0x07, &SCSIDEV::CmdReassign,			6,	DirNone,	FALSE },
+	// READ(6)
+	{ 0x08, &SCSIDEV::CmdRead6,				6,	DirIn,		FALSE },
+	// WRITE(6)
+	{ 0x0a, &SCSIDEV::CmdWrite6,			6,	DirOut,		FALSE },
+	// SEEK(6)
+	{ 0x0b, &SCSIDEV::CmdSeek6,				6,	DirNone,	FALSE },
+	// READ CAPACITY
+	{ 0x25, &SCSIDEV::CmdReadCapacity,		10,	DirIn,		FALSE },
+	// READ(10)
+	{ 0x28, &SCSIDEV::CmdRead10,			10,	DirIn,		FALSE },
+	// WRITE(10)
+	{ 0x2a, &SCSIDEV::CmdWrite10,			10,	DirOut,		FALSE },
+	// SEEK(10)
+	{ 0x2b, &SCSIDEV::CmdSeek10,			10,	DirNone,	FALSE },
+	// WRITE and VERIFY
+	{ 0x2e, &SCSIDEV::CmdWrite10,			10,	DirOut,		FALSE },
+	// VERIFY
+	{ 0x2f, &SCSIDEV::CmdVerify,			10,	DirNone,	FALSE },
+	// SYNCHRONIZE CACHE
+	{ 0x35, &SCSIDEV::CmdSynchronizeCache,	10,	DirNone,	FALSE },
+	// READ DEFECT DATA(10)
+	{ 0x37, &SCSIDEV::CmdReadDefectData10,	10,	DirIn,		TRUE },
+	// WRITE SAME(10)
+	{ 0x41, &SCSIDEV::CmdWriteSame10,		10,	DirOut,		FALSE },
+	// UNMAP
+	{ 0x42, &SCSIDEV::CmdUnmap,				10,	DirOut,		FALSE },
+	// READ(16)
+	{ 0x88, &SCSIDEV::CmdRead10,			16,	DirIn,		FALSE },
+	// WRITE(16)
+	{ 0x8a, &SCSIDEV::CmdWrite10,			16,	DirOut,		FALSE },
+	// WRITE AND VERIFY(16)
+	{ 0x8e, &SCSIDEV::CmdWrite10,			16,	DirOut,		FALSE },
+	// VERIFY(16)
+	{ 0x8f, &SCSIDEV::CmdVerify,			16,	DirNone,	FALSE },
+	// SERVICE ACTION IN(16)
+	{ 0x9e, &SCSIDEV::CmdReadCapacity16,	16,	DirIn,		FALSE },
+	// READ(12)
+	{ 0xa8, &SCSIDEV::CmdRead10,			12,	DirIn,		FALSE },
+	// WRITE(12)
+	{ 0xaa, &SCSIDEV::CmdWrite10,			12,	DirOut,		FALSE },
+	// WRITE AND VERIFY(12)
+	{ 0xae, &SCSIDEV::CmdWrite10,			12,	DirOut,		FALSE },
+	// VERIFY(12)
+	{ 0xaf, &SCSIDEV::CmdVerify,			12,	DirNone,	FALSE },
+	// 終端
+	{ 0x00, NULL,							0,	DirNone,	FALSE }
+};
+
+//---------------------------------------------------------------------------
+//
+//	CD-DAのコマンド
 //
 //---------------------------------------------------------------------------
-void FASTCALL SCSIDEV::Execute()
-{
-	ASSERT(this);
-
-#if defined(DISK_LOG)
-	Log(Log::Normal, "実行フェーズ コマンド$%02X", ctrl.cmd[0]);
-#endif	// DISK_LOG
-
-	// フェーズ設定
-	ctrl.phase = BUS::execute;
-
-	// データ転送のための初期化
-	ctrl.offset = 0;
-	ctrl.blocks = 1;
-#if USE_WAIT_CTRL == 1
-	ctrl.execstart = ::GetTimeUs();
-#endif	// USE_WAIT_CTRL
-
-	// コマンド別処理
-	switch (ctrl.cmd[0]) {
-		// TEST UNIT READY
-		case 0x00:
-			CmdTestUnitReady();
-			return;
-
-		// REZERO
-		case 0x01:
-			CmdRezero();
-			return;
-
-		// REQUEST SENSE
-		case 0x03:
-			CmdRequestSense();
-			return;
+const SCSIDEV::command_t SCSIDEV::AudioTable[] = {
+	// READ TOC
+	{ 0x43, &SCSIDEV::CmdReadToc,			10,	DirIn,		FALSE },
+	// PLAY AUDIO(10)
+	{ 0x45, &SCSIDEV::CmdPlayAudio10,		10,	DirNone,	TRUE },
+	// PLAY AUDIO MSF
+	{ 0x47, &SCSIDEV::CmdPlayAudioMSF,		10,	DirNone,	TRUE },
+	// PLAY AUDIO TRACK
+	{ 0x48, &SCSIDEV::CmdPlayAudioTrack,	10,	DirNone,	TRUE },
+	// 終端
+	{ 0x00, NULL,							0,	DirNone,	FALSE }
+};
 
-		// FORMAT UNIT
-		case 0x04:
-			CmdFormat();
-			return;
-
-		// REASSIGN BLOCKS
-		case 0x07:
-			CmdReassign();
-			return;
-
-		// READ(6)
-		case 0x08:
-			CmdRead6();
-			return;
-
-		// WRITE(6)
-		case 0x0a:
-			CmdWrite6();
-			return;
-
-		// SEEK(6)
-		case 0x0b:
-			CmdSeek6();
-			return;
-
-		// INQUIRY
-		case 0x12:
-			CmdInquiry();
-			return;
-
-		// MODE SELECT
-		case 0x15:
-			CmdModeSelect();
-			return;
-
-		// MDOE SENSE
-		case 0x1a:
-			CmdModeSense();
-			return;
-
-		// START STOP UNIT
-		case 0x1b:
-			CmdStartStop();
-			return;
-
-		// SEND DIAGNOSTIC
-		case 0x1d:
-			CmdSendDiag();
-			return;
-
-		// PREVENT/ALLOW MEDIUM REMOVAL
-		case 0x1e:
-			CmdRemoval();
-			return;
-
-		// READ CAPACITY
-		case 0x25:
-			CmdReadCapacity();
-			return;
+//---------------------------------------------------------------------------
+//
+//	ホストブリッジのコマンド
+//
+//---------------------------------------------------------------------------
+const SCSIDEV::command_t SCSIDEV::BridgeTable[] = {
+	// GET MESSAGE(10)
+	{ 0x28, &SCSIDEV::CmdGetMessage10,		10,	DirIn,		TRUE },
+	// SEND MESSAGE(10)
+	{ 0x2a, &SCSIDEV::CmdSendMessage10,		10,	DirOut,		TRUE },
+	// 終端
+	{ 0x00, NULL,							0,	DirNone,	FALSE }
+};
 
-		// READ(10)
-		case 0x28:
-			CmdRead10();
-			return;
+//---------------------------------------------------------------------------
+//
+//	コマンドテーブル(デバイス種別とオペコードで直接引く)
+//
+//---------------------------------------------------------------------------
+SCSIDEV::command_t SCSIDEV::CommandTable[ClassMax][0x100];
 
-		// WRITE(10)
-		case 0x2a:
-			CmdWrite10();
-			return;
+//---------------------------------------------------------------------------
+//
+//	コマンドテーブル構築
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::InitCommand()
+{
+	// SASI HD(SCSIとして扱われた場合)とHD、MO
+	AddCommand(ClassSASI, CommonTable);
+	AddCommand(ClassSASI, BlockTable);
+	AddCommand(ClassHD, CommonTable);
+	AddCommand(ClassHD, BlockTable);
+	AddCommand(ClassMO, CommonTable);
+	AddCommand(ClassMO, BlockTable);
 
-		// SEEK(10)
-		case 0x2b:
-			CmdSeek10();
-			return;
+	// CD-ROMはCD-DAを加える
+	AddCommand(ClassCD, CommonTable);
+	AddCommand(ClassCD, BlockTable);
+	AddCommand(ClassCD, AudioTable);
 
-		// WRITE and VERIFY
-		case 0x2e:
-			CmdWrite10();
-			return;
+	// ホストブリッジはREAD/WRITEをメッセージ送受信に差し替える
+	AddCommand(ClassBridge, CommonTable);
+	AddCommand(ClassBridge, BridgeTable);
+}
 
-		// VERIFY
-		case 0x2f:
-			CmdVerify();
-			return;
+//---------------------------------------------------------------------------
+//
+//	コマンドテーブルへ追加
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::AddCommand(int devclass, const command_t *list)
+{
+	ASSERT((devclass >= 0) && (devclass < ClassMax));
+	ASSERT(list);
 
-		// SYNCHRONIZE CACHE
-		case 0x35:
-			CmdSynchronizeCache();
-			return;
+	for (; list->func; list++) {
+		ASSERT(list->opcode < 0x100);
+		ASSERT(list->length == BUS::GetCommandByteCount(list->opcode));
+		CommandTable[devclass][list->opcode] = *list;
+	}
+}
 
-		// READ DEFECT DATA(10)
-		case 0x37:
-			CmdReadDefectData10();
-			return;
+//---------------------------------------------------------------------------
+//
+//	実行フェーズ
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::Execute()
+{
+	const command_t *cmd;
+	DWORD lun;
 
-		// READ TOC
-		case 0x43:
-			CmdReadToc();
-			return;
+	ASSERT(this);
 
-		// PLAY AUDIO(10)
-		case 0x45:
-			CmdPlayAudio10();
-			return;
+#if defined(DISK_LOG)
+	Log(Log::Normal, "実行フェーズ コマンド$%02X", ctrl.cmd[0]);
+#endif	// DISK_LOG
 
-		// PLAY AUDIO MSF
-		case 0x47:
-			CmdPlayAudioMSF();
-			return;
+	// フェーズ設定
+	ctrl.phase = BUS::execute;
 
-		// PLAY AUDIO TRACK
-		case 0x48:
-			CmdPlayAudioTrack();
-			return;
+	// データ転送のための初期化
+	ctrl.offset = 0;
+	ctrl.blocks = 1;
+#if USE_WAIT_CTRL == 1
+	ctrl.execstart = ::GetTimeUs();
+#endif	// USE_WAIT_CTRL
 
-		// MODE SELECT(10)
-		case 0x55:
-			CmdModeSelect10();
-			return;
+	// 切断中のコマンドがあればキューに積む
+	if (QueueCommand()) {
+		return;
+	}
 
-		// MDOE SENSE(10)
-		case 0x5a:
-			CmdModeSense10();
-			return;
+	// 論理ユニットのデバイス種別でコマンドテーブルを引く
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	cmd = &CommandTable[ctrl.devclass[lun]][ctrl.cmd[0] & 0xff];
+	if (!cmd->func) {
+		// それ以外は対応していない
+		Log(Log::Normal, "未対応コマンド $%02X", ctrl.cmd[0]);
+		CmdInvalid();
+		return;
+	}
 
-		// SPECIFY(SASIのみ/SxSI利用時の警告抑制)
-		case 0xc2:
-			CmdInvalid();
-			return;
+	// ユニットアテンションの報告(許可されたコマンドを除く)
+	if (!cmd->attn && ctrl.unit[lun] && !ctrl.unit[lun]->CheckAttn()) {
+		Error();
+		return;
 	}
 
-	// それ以外は対応していない
-	Log(Log::Normal, "未対応コマンド $%02X", ctrl.cmd[0]);
-	CmdInvalid();
+	// コマンド別処理
+	(this->*cmd->func)();
 }
 
 //---------------------------------------------------------------------------
@@ -6842,8 +11949,8 @@ void FASTCALL SCSIDEV::CmdInquiry()
 		return;
 	}
 
-	// 同期転送サポート情報の追加
-	if (scsi.syncenable) {
+	// 同期転送サポート情報の追加(標準データのみ)
+	if (scsi.syncenable && (ctrl.cmd[1] & 0x01) == 0) {
 		ctrl.buffer[7] |= (1 << 4);
 	}
 
@@ -7068,16 +12175,28 @@ void FASTCALL SCSIDEV::CmdReadCapacity()
 
 //---------------------------------------------------------------------------
 //
-//	READ(10)
+//	READ CAPACITY(16)
 //
 //---------------------------------------------------------------------------
-void FASTCALL SCSIDEV::CmdRead10()
+void FASTCALL SCSIDEV::CmdReadCapacity16()
 {
 	DWORD lun;
-	DWORD record;
+	int length;
 
 	ASSERT(this);
 
+#if defined(DISK_LOG)
+	Log(Log::Normal, "READ CAPACITY(16)コマンド");
+#endif	// DISK_LOG
+
+	// SERVICE ACTION INのうちREAD CAPACITY(16)のみ
+	if ((ctrl.cmd[1] & 0x1f) != 0x10) {
+		Log(Log::Normal, "未対応コマンド $%02X/%02X",
+			ctrl.cmd[0], ctrl.cmd[1] & 0x1f);
+		CmdInvalid();
+		return;
+	}
+
 	// 論理ユニット
 	lun = (ctrl.cmd[1] >> 5) & 0x07;
 	if (!ctrl.unit[lun]) {
@@ -7085,26 +12204,53 @@ void FASTCALL SCSIDEV::CmdRead10()
 		return;
 	}
 
-	// ホストブリッジならメッセージ受信
-	if (ctrl.unit[lun]->GetID() == MAKEID('S', 'C', 'B', 'R')) {
-		CmdGetMessage10();
+	// アロケーションレングス0は処理しない
+	if ((ctrl.cmd[10] | ctrl.cmd[11] | ctrl.cmd[12] | ctrl.cmd[13]) == 0) {
+		Status();
+		return;
+	}
+
+	// ドライブでコマンド処理
+	length = ctrl.unit[lun]->ReadCapacity(ctrl.cmd, ctrl.buffer);
+	ASSERT(length >= 0);
+	if (length <= 0) {
+		Error();
+		return;
+	}
+
+	// レングス設定
+	ctrl.length = length;
+
+	// データインフェーズ
+	DataIn();
+}
+
+//---------------------------------------------------------------------------
+//
+//	READ(10)
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::CmdRead10()
+{
+	DWORD lun;
+	UL64 record;
+
+	ASSERT(this);
+
+	// 論理ユニット
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun]) {
+		Error();
 		return;
 	}
 
 	// レコード番号とブロック数を取得
-	record = ctrl.cmd[2];
-	record <<= 8;
-	record |= ctrl.cmd[3];
-	record <<= 8;
-	record |= ctrl.cmd[4];
-	record <<= 8;
-	record |= ctrl.cmd[5];
-	ctrl.blocks = ctrl.cmd[7];
-	ctrl.blocks <<= 8;
-	ctrl.blocks |= ctrl.cmd[8];
+	record = GetRecord();
 
 #if defined(DISK_LOG)
-	Log(Log::Normal, "READ(10)コマンド レコード=%08X ブロック=%d", record, ctrl.blocks);
+	Log(Log::Normal,
+		"READ(%d)コマンド レコード=%08llX ブロック=%d",
+		BUS::GetCommandByteCount(ctrl.cmd[0]), record, ctrl.blocks);
 #endif	// DISK_LOG
 
 	// ブロック数0は処理しない
@@ -7114,15 +12260,24 @@ void FASTCALL SCSIDEV::CmdRead10()
 	}
 
 	// ドライブでコマンド処理
-	ctrl.length = ctrl.unit[lun]->Read(ctrl.buffer, record);
-	if (ctrl.length <= 0) {
+	if (!XferSetup(ctrl.unit[lun])) {
 		// 失敗(エラー)
 		Error();
 		return;
 	}
+	ctrl.next = record;
 
-	// 次のブロックを設定
-	ctrl.next = record + 1;
+	// 読み込みを待つなら一旦切断
+	if (XferDisconnect()) {
+		return;
+	}
+
+	ctrl.length = XferRead(ctrl.unit[lun], ctrl.buffer);
+	if (ctrl.length <= 0) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
 
 	// データインフェーズ
 	DataIn();
@@ -7136,7 +12291,7 @@ void FASTCALL SCSIDEV::CmdRead10()
 void FASTCALL SCSIDEV::CmdWrite10()
 {
 	DWORD lun;
-	DWORD record;
+	UL64 record;
 
 	ASSERT(this);
 
@@ -7147,27 +12302,13 @@ void FASTCALL SCSIDEV::CmdWrite10()
 		return;
 	}
 
-	// ホストブリッジならメッセージ受信
-	if (ctrl.unit[lun]->GetID() == MAKEID('S', 'C', 'B', 'R')) {
-		CmdSendMessage10();
-		return;
-	}
-
 	// レコード番号とブロック数を取得
-	record = ctrl.cmd[2];
-	record <<= 8;
-	record |= ctrl.cmd[3];
-	record <<= 8;
-	record |= ctrl.cmd[4];
-	record <<= 8;
-	record |= ctrl.cmd[5];
-	ctrl.blocks = ctrl.cmd[7];
-	ctrl.blocks <<= 8;
-	ctrl.blocks |= ctrl.cmd[8];
+	record = GetRecord();
 
 #if defined(DISK_LOG)
 	Log(Log::Normal,
-		"WRTIE(10)コマンド レコード=%08X ブロック=%d", record, ctrl.blocks);
+		"WRTIE(%d)コマンド レコード=%08llX ブロック=%d",
+		BUS::GetCommandByteCount(ctrl.cmd[0]), record, ctrl.blocks);
 #endif	// DISK_LOG
 
 	// ブロック数0は処理しない
@@ -7177,7 +12318,12 @@ void FASTCALL SCSIDEV::CmdWrite10()
 	}
 
 	// ドライブでコマンド処理
-	ctrl.length = ctrl.unit[lun]->WriteCheck(record);
+	if (!XferSetup(ctrl.unit[lun])) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+	ctrl.length = ctrl.unit[lun]->WriteCheck(record, XferNext());
 	if (ctrl.length <= 0) {
 		// 失敗(エラー)
 		Error();
@@ -7185,7 +12331,10 @@ void FASTCALL SCSIDEV::CmdWrite10()
 	}
 
 	// 次のブロックを設定
-	ctrl.next = record + 1;
+	ctrl.next = record + ctrl.curblocks;
+
+	// 受信中に書き込み先のトラックを揃える
+	XferAhead(record);
 
 	// データアウトフェーズ
 	DataOut();
@@ -7235,7 +12384,7 @@ void FASTCALL SCSIDEV::CmdVerify()
 {
 	DWORD lun;
 	BOOL status;
-	DWORD record;
+	UL64 record;
 
 	ASSERT(this);
 
@@ -7247,20 +12396,12 @@ void FASTCALL SCSIDEV::CmdVerify()
 	}
 
 	// レコード番号とブロック数を取得
-	record = ctrl.cmd[2];
-	record <<= 8;
-	record |= ctrl.cmd[3];
-	record <<= 8;
-	record |= ctrl.cmd[4];
-	record <<= 8;
-	record |= ctrl.cmd[5];
-	ctrl.blocks = ctrl.cmd[7];
-	ctrl.blocks <<= 8;
-	ctrl.blocks |= ctrl.cmd[8];
+	record = GetRecord();
 
 #if defined(DISK_LOG)
 	Log(Log::Normal,
-		"VERIFYコマンド レコード=%08X ブロック=%d", record, ctrl.blocks);
+		"VERIFY(%d)コマンド レコード=%08llX ブロック=%d",
+		BUS::GetCommandByteCount(ctrl.cmd[0]), record, ctrl.blocks);
 #endif	// DISK_LOG
 
 	// ブロック数0は処理しない
@@ -7284,8 +12425,13 @@ void FASTCALL SCSIDEV::CmdVerify()
 		return;
 	}
 
-	// テスト読み込み
-	ctrl.length = ctrl.unit[lun]->Read(ctrl.buffer, record);
+	// 比較するデータを受け取る(XferOutで比較)
+	if (!XferSetup(ctrl.unit[lun])) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+	ctrl.length = ctrl.unit[lun]->VerifyCheck(record, XferNext());
 	if (ctrl.length <= 0) {
 		// 失敗(エラー)
 		Error();
@@ -7293,7 +12439,10 @@ void FASTCALL SCSIDEV::CmdVerify()
 	}
 
 	// 次のブロックを設定
-	ctrl.next = record + 1;
+	ctrl.next = record + ctrl.curblocks;
+
+	// 受信中に比較するトラックを揃える
+	XferAhead(record);
 
 	// データアウトフェーズ
 	DataOut();
@@ -7317,12 +12466,91 @@ void FASTCALL SCSIDEV::CmdSynchronizeCache()
 		return;
 	}
 
-	// 成功したことにする(未実装)
+	// キャッシュを媒体へ反映
+	if (!ctrl.unit[lun]->SynchronizeCache(ctrl.cmd)) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
 
 	// ステータスフェーズ
 	Status();
 }
 
+//---------------------------------------------------------------------------
+//
+//	WRITE SAME(10)
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::CmdWriteSame10()
+{
+	DWORD lun;
+
+	ASSERT(this);
+
+#if defined(DISK_LOG)
+	Log(Log::Normal, "WRITE SAME(10)コマンド");
+#endif	// DISK_LOG
+
+	// 論理ユニット
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun]) {
+		Error();
+		return;
+	}
+
+	// ドライブでコマンド処理
+	ctrl.length = ctrl.unit[lun]->WriteSameCheck(ctrl.cmd);
+	if (ctrl.length <= 0) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+
+	// データアウトフェーズ
+	DataOut();
+}
+
+//---------------------------------------------------------------------------
+//
+//	UNMAP
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::CmdUnmap()
+{
+	DWORD lun;
+
+	ASSERT(this);
+
+#if defined(DISK_LOG)
+	Log(Log::Normal, "UNMAPコマンド");
+#endif	// DISK_LOG
+
+	// 論理ユニット
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun]) {
+		Error();
+		return;
+	}
+
+	// パラメータリスト長0は処理しない
+	if (ctrl.cmd[7] == 0 && ctrl.cmd[8] == 0) {
+		Status();
+		return;
+	}
+
+	// ドライブでコマンド処理
+	ctrl.length = ctrl.unit[lun]->UnmapCheck(ctrl.cmd);
+	if (ctrl.length <= 0) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+
+	// データアウトフェーズ
+	DataOut();
+}
+
 //---------------------------------------------------------------------------
 //
 //	READ DEFECT DATA(10)
@@ -7573,7 +12801,7 @@ void FASTCALL SCSIDEV::CmdGetMessage10()
 	}
 
 	// ホストブリッジでないならエラー
-	if (ctrl.unit[lun]->GetID() != MAKEID('S', 'C', 'B', 'R')) {
+	if (ctrl.devclass[lun] != ClassBridge) {
 		Error();
 		return;
 	}
@@ -7622,7 +12850,7 @@ void FASTCALL SCSIDEV::CmdSendMessage10()
 	}
 
 	// ホストブリッジでないならエラー
-	if (ctrl.unit[lun]->GetID() != MAKEID('S', 'C', 'B', 'R')) {
+	if (ctrl.devclass[lun] != ClassBridge) {
 		Error();
 		return;
 	}
@@ -7807,10 +13035,8 @@ void FASTCALL SCSIDEV::Receive()
 
 			// 最初のデータ(オフセット0)によりレングスを再設定
 			if (ctrl.offset == 0) {
-				if (ctrl.cmd[0] >= 0x20) {
-					// 10バイトCDB
-					ctrl.length = 10;
-				}
+				// 10/12/16バイトCDB
+				ctrl.length = BUS::GetCommandByteCount(ctrl.cmd[0]);
 			}
 			break;
 
@@ -7947,6 +13173,39 @@ void FASTCALL SCSIDEV::ReceiveNext()
 						Log(Log::Normal,
 							"メッセージコード ABORT $%02X", data);
 #endif	// DISK_LOG
+						// このイニシエータのコマンドを破棄
+						QueueAbort(scsi.initiator, 0, 0);
+
+						// バスフリー
+						BusFree();
+						return;
+					}
+
+					// ABORT TAG
+					if (data == 0x0D) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード ABORT TAG $%02X", data);
+#endif	// DISK_LOG
+						// 直前のキュータグのコマンドを破棄
+						if (scsi.tagmsg != 0) {
+							QueueAbort(scsi.initiator, scsi.tagmsg, scsi.tag);
+						}
+
+						// バスフリー
+						BusFree();
+						return;
+					}
+
+					// CLEAR QUEUE
+					if (data == 0x0E) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード CLEAR QUEUE $%02X", data);
+#endif	// DISK_LOG
+						// 全てのコマンドを破棄
+						QueueAbort(-1, 0, 0);
+
 						// バスフリー
 						BusFree();
 						return;
@@ -7972,6 +13231,23 @@ void FASTCALL SCSIDEV::ReceiveNext()
 						Log(Log::Normal,
 							"メッセージコード IDENTIFY $%02X", data);
 #endif	// DISK_LOG
+						// 切断許可
+						scsi.discpriv = (data & 0x40) != 0;
+					}
+
+					// キュータグ(SIMPLE/HEAD OF QUEUE/ORDERED)
+					if (data >= 0x20 && data <= 0x22) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード QUEUE TAG $%02X $%02X",
+							data, scsi.msb[i + 1]);
+#endif	// DISK_LOG
+						scsi.tagmsg = data;
+						scsi.tag = scsi.msb[i + 1];
+
+						// タグをとばして次へ
+						i += 2;
+						continue;
 					}
 
 					// 拡張メッセージ
@@ -8060,12 +13336,19 @@ void FASTCALL SCSIDEV::SendBurst()
 
 	// レングス!=0なら送信
 	if (ctrl.length != 0) {
+		// 送信中に次のバッファを取り寄せる
+		if (ctrl.phase == BUS::datain && ctrl.blocks > 1) {
+			XferAhead(ctrl.next);
+		}
+
 		// バースト送信
 		if (ctrl.phase == BUS::datain && scsi.syncoffset > 0) {
 			len = ctrl.bus->SendHandShake(
-				ctrl.buffer, ctrl.length, scsi.syncoffset);
+				ctrl.pinbuf ? ctrl.pinbuf : ctrl.buffer,
+				ctrl.length, scsi.syncoffset);
 		} else {
-			len = ctrl.bus->SendHandShake(ctrl.buffer, ctrl.length);
+			len = ctrl.bus->SendHandShake(
+				ctrl.pinbuf ? ctrl.pinbuf : ctrl.buffer, ctrl.length);
 		}
 
 		// 全て送信できなければステータスフェーズへ移行
@@ -8087,6 +13370,11 @@ void FASTCALL SCSIDEV::SendBurst()
 	// データ引き取り後の処理(リード/データインのみ)
 	if (ctrl.phase == BUS::datain) {
 		if (ctrl.blocks != 0) {
+			// 読み込みを待つなら一旦切断
+			if (XferDisconnect()) {
+				return;
+			}
+
 			// 次のバッファを設定(offset, lengthをセットすること)
 			result = XferIn(ctrl.buffer);
 		}
@@ -8116,6 +13404,12 @@ void FASTCALL SCSIDEV::SendBurst()
 
 				// コマンドフェーズ
 				Command();
+			} else if (scsi.reconnect) {
+				// 再接続のIDENTIFY送信完了
+				scsi.reconnect = FALSE;
+
+				// データ転送を再開
+				XferResume();
 			} else {
 				// バスフリーフェーズ
 				BusFree();
@@ -8236,12 +13530,8 @@ void FASTCALL SCSIDEV::ReceiveBurst()
 	switch (ctrl.phase) {
 		// コマンドフェーズ
 		case BUS::command:
-			// コマンドデータ転送
-			len = 6;
-			if (ctrl.buffer[0] >= 0x20 && ctrl.buffer[0] <= 0x7D) {
-				// 10バイトCDB
-				len = 10;
-			}
+			// コマンドデータ転送(10/12/16バイトCDB)
+			len = BUS::GetCommandByteCount(ctrl.buffer[0]);
 			for (i = 0; i < len; i++) {
 				ctrl.cmd[i] = (DWORD)ctrl.buffer[i];
 #if defined(DISK_LOG)
@@ -8277,6 +13567,39 @@ void FASTCALL SCSIDEV::ReceiveBurst()
 						Log(Log::Normal,
 							"メッセージコード ABORT $%02X", data);
 #endif	// DISK_LOG
+						// このイニシエータのコマンドを破棄
+						QueueAbort(scsi.initiator, 0, 0);
+
+						// バスフリー
+						BusFree();
+						return;
+					}
+
+					// ABORT TAG
+					if (data == 0x0D) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード ABORT TAG $%02X", data);
+#endif	// DISK_LOG
+						// 直前のキュータグのコマンドを破棄
+						if (scsi.tagmsg != 0) {
+							QueueAbort(scsi.initiator, scsi.tagmsg, scsi.tag);
+						}
+
+						// バスフリー
+						BusFree();
+						return;
+					}
+
+					// CLEAR QUEUE
+					if (data == 0x0E) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード CLEAR QUEUE $%02X", data);
+#endif	// DISK_LOG
+						// 全てのコマンドを破棄
+						QueueAbort(-1, 0, 0);
+
 						// バスフリー
 						BusFree();
 						return;
@@ -8302,6 +13625,23 @@ void FASTCALL SCSIDEV::ReceiveBurst()
 						Log(Log::Normal,
 							"メッセージコード IDENTIFY $%02X", data);
 #endif	// DISK_LOG
+						// 切断許可
+						scsi.discpriv = (data & 0x40) != 0;
+					}
+
+					// キュータグ(SIMPLE/HEAD OF QUEUE/ORDERED)
+					if (data >= 0x20 && data <= 0x22) {
+#if defined(DISK_LOG)
+						Log(Log::Normal,
+							"メッセージコード QUEUE TAG $%02X $%02X",
+							data, scsi.msb[i + 1]);
+#endif	// DISK_LOG
+						scsi.tagmsg = data;
+						scsi.tag = scsi.msb[i + 1];
+
+						// タグをとばして次へ
+						i += 2;
+						continue;
 					}
 
 					// 拡張メッセージ
@@ -8393,3 +13733,456 @@ BOOL FASTCALL SCSIDEV::XferMsg(DWORD msg)
 
 	return TRUE;
 }
+
+//---------------------------------------------------------------------------
+//
+//	切断判定
+//	※次のバッファの読み込みを待つなら切断メッセージを送ってTRUE
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL SCSIDEV::XferDisconnect()
+{
+#if USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+	DWORD lun;
+
+	ASSERT(this);
+
+	// IDENTIFYで切断が許可されていること
+	if (!scsi.discpriv || scsi.initiator < 0) {
+		return FALSE;
+	}
+
+	// 論理ユニット
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun]) {
+		return FALSE;
+	}
+
+	// 次に送るトラックがキャッシュにあれば切断しない
+	// (キャッシュ参照はトラック単位なので先頭のレコードで判定する)
+	if (ctrl.remain == 0 || !ctrl.unit[lun]->Prefetch(ctrl.next, 1)) {
+		return FALSE;
+	}
+
+#if defined(DISK_LOG)
+	Log(Log::Normal, "切断 レコード=%08llX", ctrl.next);
+#endif	// DISK_LOG
+
+	// 再接続に備えてキューに積む(一杯なら切断しない)
+	if (!QueueAdd(TRUE)) {
+		return FALSE;
+	}
+
+	// 前のバッファの参照を解放
+	XferRelease();
+
+	// SAVE DATA POINTER + DISCONNECT
+	ctrl.length = 2;
+	ctrl.blocks = 1;
+	ctrl.buffer[0] = 0x02;
+	ctrl.buffer[1] = 0x04;
+	MsgIn();
+	return TRUE;
+#else
+	return FALSE;
+#endif	// USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+}
+
+//---------------------------------------------------------------------------
+//
+//	再接続後の転送再開
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::XferResume()
+{
+	DWORD lun;
+
+	ASSERT(this);
+
+	// キューから取り出したコマンドは最初から実行
+	if (!scsi.resume) {
+		scsi.dequeued = TRUE;
+		Execute();
+		return;
+	}
+	scsi.resume = FALSE;
+
+	// 論理ユニット
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	if (!ctrl.unit[lun]) {
+		Error();
+		return;
+	}
+
+	// 切断した位置から読み込み
+	ctrl.length = XferRead(ctrl.unit[lun], ctrl.buffer);
+	if (ctrl.length <= 0) {
+		// 失敗(エラー)
+		Error();
+		return;
+	}
+
+	// データインフェーズ
+	DataIn();
+}
+
+//---------------------------------------------------------------------------
+//
+//	タグ付きコマンドをキューに積む
+//	※キューに積むかBUSYを返したらTRUE
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL SCSIDEV::QueueCommand()
+{
+	DWORD lun;
+	int i;
+
+	ASSERT(this);
+
+	// 再接続したコマンドはそのまま実行
+	if (scsi.dequeued) {
+		scsi.dequeued = FALSE;
+		return FALSE;
+	}
+
+	// 受け付け順
+	scsi.curseq = scsi.seq++;
+
+	// 切断中のコマンドが無いかHEAD OF QUEUEならすぐ実行
+	if (scsi.queued == 0 || scsi.tagmsg == 0x21) {
+		return FALSE;
+	}
+
+#if USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+	// タグ付きで切断が許可されていればキューに積んで切断
+	if (scsi.tagmsg != 0 && scsi.discpriv && scsi.initiator >= 0) {
+		if (!QueueAdd(FALSE)) {
+			// TASK SET FULL
+			ctrl.status = 0x28;
+			ctrl.message = 0x00;
+			Status();
+			return TRUE;
+		}
+
+#if defined(DISK_LOG)
+		Log(Log::Normal, "キューに追加 コマンド$%02X タグ$%02X",
+			ctrl.cmd[0], scsi.tag);
+#endif	// DISK_LOG
+
+		// DISCONNECT
+		ctrl.length = 1;
+		ctrl.blocks = 1;
+		ctrl.buffer[0] = 0x04;
+		MsgIn();
+		return TRUE;
+	}
+#endif	// USE_BURST_BUS == 1 && USE_DISCONNECT == 1
+
+	// 同じ論理ユニットに切断中のコマンドがなければ実行
+	lun = (ctrl.cmd[1] >> 5) & 0x07;
+	for (i = 0; i < QueueMax; i++) {
+		if (scsi.queue[i].used &&
+			((scsi.queue[i].cmd[1] >> 5) & 0x07) == lun) {
+			break;
+		}
+	}
+	if (i >= QueueMax) {
+		return FALSE;
+	}
+
+	// BUSY
+	ctrl.status = 0x08;
+	ctrl.message = 0x00;
+	Status();
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	キューに追加
+//	※started=TRUEは転送途中の位置を保存する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL SCSIDEV::QueueAdd(BOOL started)
+{
+	queue_t *q;
+	int i;
+
+	ASSERT(this);
+
+	// 空きを探す
+	for (i = 0; i < QueueMax; i++) {
+		if (!scsi.queue[i].used) {
+			break;
+		}
+	}
+	if (i >= QueueMax) {
+		return FALSE;
+	}
+	q = &scsi.queue[i];
+
+	// コマンドとタグ
+	q->used = TRUE;
+	q->started = started;
+	q->initiator = scsi.initiator;
+	memcpy(q->cmd, ctrl.cmd, sizeof(q->cmd));
+	q->tagmsg = scsi.tagmsg;
+	q->tag = scsi.tag;
+	q->seq = scsi.curseq;
+	q->start = ::GetTimeUs();
+
+	// 並べ替えのためのレコード位置
+	if (started) {
+		q->record = ctrl.next;
+		q->blocks = ctrl.remain;
+		q->bufblocks = ctrl.bufblocks;
+	} else {
+		q->bufblocks = 0;
+		switch (ctrl.cmd[0]) {
+			// READ(6)/WRITE(6)
+			case 0x08:
+			case 0x0a:
+				q->record = ctrl.cmd[1] & 0x1f;
+				q->record <<= 8;
+				q->record |= ctrl.cmd[2];
+				q->record <<= 8;
+				q->record |= ctrl.cmd[3];
+				q->blocks = ctrl.cmd[4];
+				if (q->blocks == 0) {
+					q->blocks = 0x100;
+				}
+				break;
+
+			// READ/WRITE/VERIFY(10/12/16)、WRITE SAME(10)
+			case 0x28:
+			case 0x2a:
+			case 0x2e:
+			case 0x2f:
+			case 0x41:
+			case 0x88:
+			case 0x8a:
+			case 0x8e:
+			case 0x8f:
+			case 0xa8:
+			case 0xaa:
+			case 0xae:
+			case 0xaf:
+				q->record = GetRecord();
+				q->blocks = ctrl.blocks;
+				break;
+
+			// 媒体にアクセスしないコマンド
+			default:
+				q->record = 0;
+				q->blocks = 0;
+				break;
+		}
+	}
+
+	scsi.queued++;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	次に再接続するコマンドを選ぶ
+//	※ORDEREDの前後は入れ替えない。HEAD OF QUEUE、転送途中、キャッシュに
+//	  あるものの順に優先し、同じ優先度なら直前のレコードから昇順に選ぶ
+//
+//---------------------------------------------------------------------------
+int FASTCALL SCSIDEV::QueueSelect()
+{
+	queue_t *q;
+	Disk *unit;
+	DWORD now;
+	UL64 dist;
+	UL64 bestdist;
+	BOOL late;
+	int prio;
+	int bestprio;
+	int best;
+	int i;
+	int j;
+
+	ASSERT(this);
+
+	// 待ち時間を超えたコマンドがあればキャッシュを待たない
+	now = ::GetTimeUs();
+	late = FALSE;
+	for (i = 0; i < QueueMax; i++) {
+		if (scsi.queue[i].used &&
+			(now - scsi.queue[i].start) >= ReconnectTimeout) {
+			late = TRUE;
+		}
+	}
+
+	best = -1;
+	bestprio = -1;
+	bestdist = 0;
+	for (i = 0; i < QueueMax; i++) {
+		q = &scsi.queue[i];
+		if (!q->used) {
+			continue;
+		}
+
+		// ORDEREDより後のコマンドとORDERED自身は先に受け付けたものを待つ
+		if (q->tagmsg != 0x21) {
+			for (j = 0; j < QueueMax; j++) {
+				if (j == i || !scsi.queue[j].used) {
+					continue;
+				}
+				if ((int)(scsi.queue[j].seq - q->seq) < 0 &&
+					(q->tagmsg == 0x22 || scsi.queue[j].tagmsg == 0x22)) {
+					break;
+				}
+			}
+			if (j < QueueMax) {
+				continue;
+			}
+		}
+
+		// 優先度
+		if (q->tagmsg == 0x21) {
+			prio = 3;
+		} else {
+			// 読み込むトラックがキャッシュにあるか(無ければ取り寄せる)
+			prio = q->started ? 2 : 1;
+			unit = ctrl.unit[(q->cmd[1] >> 5) & 0x07];
+			if (unit && q->blocks > 0 && (q->started ||
+				q->cmd[0] == 0x08 || q->cmd[0] == 0x28 ||
+				q->cmd[0] == 0x88 || q->cmd[0] == 0xa8)) {
+				if (unit->Prefetch(q->record, 1)) {
+					if (!late) {
+						continue;
+					}
+					prio = 0;
+				}
+			}
+		}
+
+		// エレベータ順(直前のレコードより前なら一周後として扱う)
+		dist = 0;
+		if (q->blocks > 0) {
+			dist = q->record - scsi.head;
+		}
+
+		if (prio > bestprio || (prio == bestprio && dist < bestdist)) {
+			best = i;
+			bestprio = prio;
+			bestdist = dist;
+		}
+	}
+
+	return best;
+}
+
+//---------------------------------------------------------------------------
+//
+//	キューから取り除く
+//	※initiatorが負なら全て、tagmsgが0ならイニシエータの全てが対象
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::QueueAbort(int initiator, DWORD tagmsg, DWORD tag)
+{
+	int i;
+
+	ASSERT(this);
+
+	for (i = 0; i < QueueMax; i++) {
+		if (!scsi.queue[i].used) {
+			continue;
+		}
+		if (initiator >= 0 && scsi.queue[i].initiator != initiator) {
+			continue;
+		}
+		if (tagmsg != 0 && (scsi.queue[i].tagmsg == 0 ||
+			scsi.queue[i].tag != tag)) {
+			continue;
+		}
+
+		scsi.queue[i].used = FALSE;
+		scsi.queued--;
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	切断中のコマンド破棄
+//	※論理ユニットを取り外す時に呼ぶ。再接続先が無くなるので応答はしない
+//
+//---------------------------------------------------------------------------
+void FASTCALL SCSIDEV::Purge(int lun)
+{
+	int i;
+
+	ASSERT(this);
+	ASSERT((lun >= 0) && (lun < UnitMax));
+
+	for (i = 0; i < QueueMax; i++) {
+		if (!scsi.queue[i].used) {
+			continue;
+		}
+		if ((int)((scsi.queue[i].cmd[1] >> 5) & 0x07) != lun) {
+			continue;
+		}
+
+		Log(Log::Warning, "切断中のコマンドを破棄 ID=%d LUN=%d", ctrl.id, lun);
+		scsi.queue[i].used = FALSE;
+		scsi.queued--;
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	レコード番号とブロック数を取得
+//	※ctrl.blocksにブロック数を設定する(10/12/16バイトCDB)
+//
+//---------------------------------------------------------------------------
+UL64 FASTCALL SCSIDEV::GetRecord()
+{
+	UL64 record;
+	int i;
+	int len;
+
+	ASSERT(this);
+
+	// 10バイトCDB(32bitレコード、16bitブロック数)
+	len = 4;
+	ctrl.blocks = ctrl.cmd[7];
+	ctrl.blocks <<= 8;
+	ctrl.blocks |= ctrl.cmd[8];
+
+	switch (BUS::GetCommandByteCount(ctrl.cmd[0])) {
+		// 12バイトCDB(32bitレコード、32bitブロック数)
+		case 12:
+			ctrl.blocks = ctrl.cmd[6];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[7];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[8];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[9];
+			break;
+
+		// 16バイトCDB(64bitレコード、32bitブロック数)
+		case 16:
+			ctrl.blocks = ctrl.cmd[10];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[11];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[12];
+			ctrl.blocks <<= 8;
+			ctrl.blocks |= ctrl.cmd[13];
+			len = 8;
+			break;
+	}
+
+	// レコード番号(CDBの2バイト目から)
+	record = 0;
+	for (i = 0; i < len; i++) {
+		record <<= 8;
+		record |= ctrl.cmd[2 + i];
+	}
+
+	return record;
+}
@@ -27,6 +27,11 @@
 #define USE_WAIT_CTRL	1				// 1:タイミング調整有効
 #define USE_BURST_BUS	1				// 1:データバースト送受信有効
 #define USE_SYNC_TRANS	0				// 1:同期転送有効
+#ifndef BAREMETAL
+#define USE_DISCONNECT	1				// 1:切断/再接続有効
+#else
+#define USE_DISCONNECT	0				// 1:切断/再接続有効(ベアメタルは未対応)
+#endif	// BAREMETAL
 #define USE_MZ1F23_1024_SUPPORT		1	// 1:MZ-1F23(20M/セクタサイズ1024)
 #define REMOVE_FIXED_SASIHD_SIZE	1	// 1:SASIHDのサイズ固定制限を解除する
 #define BRIDGE_PRODUCT	"RASCSI BRIDGE"	// ブリッジデバイスの製品名
@@ -128,6 +133,22 @@ public:
 	}
 										// フェーズ取得
 
+	static int FASTCALL GetCommandByteCount(DWORD opcode)
+	{
+		// グループコードで決まる
+		if (opcode >= 0x20 && opcode <= 0x7D) {
+			return 10;
+		}
+		if (opcode >= 0x80 && opcode <= 0x9F) {
+			return 16;
+		}
+		if (opcode >= 0xA0 && opcode <= 0xBF) {
+			return 12;
+		}
+		return 6;
+	}
+										// CDB長取得
+
 	virtual DWORD FASTCALL Aquire() const = 0;
 										// 信号取り込み
 
@@ -192,6 +213,8 @@ public:
 	virtual int FASTCALL ReceiveHandShake(
 		BYTE *buf, int len, int syncoffset = 0) = 0;
 										// 一括データ受信ハンドシェイク
+	virtual BOOL FASTCALL ReselectHandShake(int id, int initiator) = 0;
+										// リセレクションハンドシェイク
 #endif	// USE_BURST_BUS
 };
 
@@ -224,6 +247,7 @@ public:
 #define DISK_PARAMNOT		0x00052601	// PARAMETERS NOT SUPPORTED
 #define DISK_PARAMVALUE		0x00052602	// PARAMETERS VALUE INVALID
 #define DISK_PARAMSAVE		0x00053900	// SAVING PARAMETERS NOT SUPPORTED
+#define DISK_NORESOURCE		0x000b5503	// INSUFFICIENT RESOURCES
 #define DISK_NODEFECT		0x00010000	// DEFECT LIST NOT FOUND
 
 #if 0
@@ -243,7 +267,9 @@ class DiskTrack
 {
 public:
 	enum {
-		NumSectors = 32					// トラック毎のセクタ数
+		NumSectors = 32,				// トラック毎のセクタ数(既定値)
+		MinSectors = 8,					// トラック毎のセクタ数(最小)
+		MaxSectors = 256				// トラック毎のセクタ数(最大)
 	};
 
 	// 内部データ定義
@@ -251,13 +277,17 @@ public:
 		int track;						// トラックナンバー
 		int size;						// セクタサイズ(8 or 9)
 		int sectors;					// セクタ数(<=0x100)
+		int trksec;						// トラック毎のセクタ数
 		DWORD length;					// データバッファ長
 		BYTE *buffer;					// データバッファ
 		BOOL init;						// ロード済みか
 		BOOL changed;					// 変更済みフラグ
-		DWORD maplen;					// 変更済みマップ長
-		BOOL *changemap;				// 変更済みマップ
+		DWORD maplen;					// 変更済みマップ長(DWORD数)
+		DWORD *changemap;				// 変更済みマップ(ビットマップ)
+		BOOL pool;						// バッファはプールから割り当て
 		BOOL raw;						// RAWモード
+		BYTE *rawbuf;					// RAW読み込み用バッファ(プール)
+		DWORD rawlen;					// RAW読み込み用バッファ長
 		fsize_t imgoffset;				// 実データまでのオフセット
 	} disktrk_t;
 
@@ -268,18 +298,34 @@ public:
 	virtual ~DiskTrack();
 										// デストラクタ
 	void FASTCALL Init(
-		Disk *p, int track, int size, int sectors,
+		Disk *p, int track, int size, int sectors, int trksec,
 		BOOL raw = FALSE, fsize_t imgoff = 0);
 										// 初期化
+	void FASTCALL SetBuffer(
+		BYTE *buf, DWORD length, DWORD *map, DWORD maplen);
+										// バッファ設定(プール)
+	void FASTCALL SetRawBuffer(BYTE *buf, DWORD length);
+										// RAW読み込み用バッファ設定(プール)
 	BOOL FASTCALL Load();
 										// ロード
+#ifndef BAREMETAL
+	int FASTCALL LoadAsync();
+										// 非同期ロード要求
+	BOOL FASTCALL LoadComplete(int id);
+										// 非同期ロード完了
+	BOOL FASTCALL IsComplete(int id) const;
+										// 非同期ロード完了チェック
+#endif	// BAREMETAL
 	BOOL FASTCALL Save();
 										// セーブ
 
 	// リード・ライト
-	BOOL FASTCALL Read(BYTE *buf, int sec) const;
+	BOOL FASTCALL Read(BYTE *buf, int sec, int count = 1) const;
 										// セクタリード
-	BOOL FASTCALL Write(const BYTE *buf, int sec);
+	BOOL FASTCALL Compare(
+		const BYTE *buf, int sec, int count, BOOL& same) const;
+										// セクタ比較
+	BOOL FASTCALL Write(const BYTE *buf, int sec, int count = 1);
 										// セクタライト
 
 	// その他
@@ -287,8 +333,27 @@ public:
 										// トラック取得
 	BOOL FASTCALL IsChanged() const		{ return dt.changed; }
 										// 変更フラグチェック
+	int FASTCALL GetSectors() const		{ return dt.sectors; }
+										// セクタ数取得
+	BYTE* FASTCALL GetBuffer() const	{ return dt.buffer; }
+										// バッファ取得
+	BOOL FASTCALL IsPool() const		{ return dt.pool; }
+										// プールのトラックか
+	void FASTCALL SetDisk(Disk *p)		{ disk = p; }
+										// 読み込み元ディスク設定
+	BOOL FASTCALL GetChangeRange(int& first, int& last) const;
+										// 変更範囲取得
+	void FASTCALL ClearChanged();
+										// 変更フラグクリア
+	fsize_t FASTCALL GetOffset(int sec) const;
+										// セクタのファイルオフセット取得
+	static int FASTCALL MapWords(int sectors) { return (sectors + 31) >> 5; }
+										// 変更済みマップのDWORD数
 
 private:
+	BOOL FASTCALL Prepare(fsize_t& offset, int& length);
+										// ロード準備
+
 	// 内部データ
 	Disk *disk;
 										// ディスク
@@ -308,58 +373,489 @@ public:
 	typedef struct {
 		DiskTrack *disktrk;				// 割り当てトラック
 		DWORD serial;					// 最終シリアル
+		int hnext;						// ハッシュチェイン(次)
+		int prev;						// LRUリスト(前)
+		int next;						// LRUリスト(次)/空きリスト
+		DWORD dirtytime;				// 変更された時刻(ms)
+		BOOL saving;					// 非同期保存中
+		int pin;						// 参照固定数(追い出し禁止)
 	} cache_t;
 
+	// 非同期保存要求
+	typedef struct {
+		int id;							// 非同期I/O要求番号
+		int list;						// 連続トラックセーブ対象の先頭
+		int num;						// トラック数
+		DWORD length;					// 書き込み長
+		BOOL done;						// 書き込み結果
+	} savereq_t;
+
+	// 統計
+	typedef struct {
+		UL64 hits;						// ヒット(セクタ単位)
+		UL64 misses;					// ミス(トラックのロード)
+		UL64 prefetch;					// 先読みで補ったミス
+		UL64 evictions;					// 追い出し
+		UL64 readbytes;					// イメージからの読み込み量
+		UL64 writebytes;				// イメージへの書き込み量
+		UL64 loadtime;					// ロード待ち時間の合計(us)
+		UL64 flushes;					// 同期回数
+		UL64 flushtime;					// 同期時間の合計(us)
+		DWORD flushmax;					// 同期時間の最大(us)
+		int tracks;						// キャッシュトラック数
+		int used;						// 使用中トラック数
+		int dirty;						// 変更済みトラック数
+	} cachestat_t;
+
 	// キャッシュ数
 	enum {
-		CacheMax = 16
+		CacheMax = 16					// 既定のキャッシュトラック数
 	};
 
+	// RAM常駐
+	enum {
+		RamSaveMax = 64,				// 一度に書き戻す最大トラック数
+		RamLoadSize = 0x100000,			// 読み込み単位(バイト)
+		HugePageSize = 0x200000			// ヒュージページサイズ(バイト)
+	};
+
+	// ゼロ化
+	enum {
+		ZeroMax = 0x100000				// ゼロを書き込む単位(バイト)
+	};
+
+	// 共有
+	enum {
+		ShareMax = 16					// 共有できる最大ディスク数
+	};
+
+#ifndef BAREMETAL
+	// 先読み
+	enum {
+		ReadAheadMax = 4,				// 最大先読みトラック数
+		ReadAheadDef = 2,				// 既定の先読みトラック数
+		ReadAheadSeq = 8				// 連続アクセス判定セクタ数
+	};
+
+	// ライトバック
+	enum {
+		WriteBackAge = 1000,			// 書き戻しまでの時間(ms)
+		WriteBackInterval = 100			// 書き戻しスレッドの周期(ms)
+	};
+
+	// 先読み状態
+	enum {
+		ReadAheadFree,					// 未使用
+		ReadAheadRequest,				// 要求済み
+		ReadAheadLoading,				// 読み込み中
+		ReadAheadDone					// 読み込み完了
+	};
+
+	// 先読みワーク
+	typedef struct {
+		int track;						// トラック
+		int state;						// 状態
+		int aio;						// 非同期I/O要求番号(-1でスレッド)
+		DiskTrack *disktrk;				// 読み込み先トラック
+	} readahead_t;
+#endif	// BAREMETAL
+
 public:
 	// 基本ファンクション
-	DiskCache(Disk *p, int size, int blocks, fsize_t imgoff = 0);
+	DiskCache(Disk *p, int size, UL64 blocks, fsize_t imgoff = 0,
+		int tracks = CacheMax, int trksec = DiskTrack::NumSectors);
 										// コンストラクタ
 	virtual ~DiskCache();
 										// デストラクタ
-	void FASTCALL SetRawMode(BOOL raw);
+	BOOL FASTCALL IsValid() const		{ return (BOOL)(pool != NULL); }
+										// 有効チェック(プール確保済みか)
+	BOOL FASTCALL SetRawMode(BOOL raw);
 										// CD-ROM rawモード設定
+	BOOL FASTCALL SetMapMode(BOOL map);
+										// メモリマップモード設定
+	BOOL FASTCALL IsMapMode() const		{ return (BOOL)(mapbuf && !map_ram); }
+										// メモリマップモード取得
+	BOOL FASTCALL SetRamMode(BOOL ram);
+										// RAM常駐モード設定
+	BOOL FASTCALL IsRamMode() const		{ return map_ram; }
+										// RAM常駐モード取得
+
+	// 共有
+	static DiskCache* FASTCALL Share(
+		Disk *p, int size, UL64 blocks, fsize_t imgoff);
+										// 共有キャッシュ取得
+	void FASTCALL Publish();
+										// 共有キャッシュとして登録
+	BOOL FASTCALL Release(Disk *p);
+										// 参照解放
+	int FASTCALL GetShareCount() const	{ return share_num; }
+										// 参照数取得
 
 	// アクセス
 	BOOL FASTCALL Save();
-										// 全セーブ＆解放
-	BOOL FASTCALL Read(BYTE *buf, int block);
+										// 全セーブ
+	BOOL FASTCALL Sync(UL64 block, int count);
+										// 範囲同期
+	BOOL FASTCALL Read(BYTE *buf, UL64 block, int count = 1);
 										// セクタリード
-	BOOL FASTCALL Write(const BYTE *buf, int block);
+	BOOL FASTCALL Compare(
+		const BYTE *buf, UL64 block, int count, BOOL& same);
+										// セクタ比較
+	BOOL FASTCALL Write(const BYTE *buf, UL64 block, int count = 1);
 										// セクタライト
+	BOOL FASTCALL Zero(UL64 block, int count, BOOL unmap);
+										// セクタゼロ化
+	int FASTCALL Pin(UL64 block, int count, BYTE **ptr);
+										// セクタ参照の固定
+	BOOL FASTCALL Prefetch(UL64 block, int count);
+										// セクタの取り寄せ
+	void FASTCALL Unpin(UL64 block);
+										// セクタ参照の固定解除
 	BOOL FASTCALL GetCache(int index, int& track, DWORD& serial) const;
 										// キャッシュ情報取得
+	int FASTCALL GetCacheMax() const	{ return cache_max; }
+										// キャッシュトラック数取得
+	void FASTCALL GetStat(cachestat_t *buffer);
+										// 統計取得
+#ifndef BAREMETAL
+	void FASTCALL SetReadAhead(int tracks);
+										// 先読みトラック数設定
+	BOOL FASTCALL SetWriteBack(BOOL enable);
+										// ライトバック設定
+#endif	// BAREMETAL
 
 private:
 	// 内部管理
+	BOOL FASTCALL ReadSector(BYTE *buf, UL64 block, int count);
+										// セクタリード(ロック済み)
+	BOOL FASTCALL WriteSector(const BYTE *buf, UL64 block, int count);
+										// セクタライト(ロック済み)
+	BOOL FASTCALL ZeroFile(fsize_t offset, fsize_t length, BOOL unmap);
+										// イメージ上の範囲のゼロ化(ロック済み)
+	BOOL FASTCALL SaveAll();
+										// 全セーブ(ロック済み)
+	BOOL FASTCALL SaveTrack(int index);
+										// トラックセーブ(ロック済み)
+	BOOL FASTCALL SaveRun(
+		int index, int first, int last, BOOL async = FALSE);
+										// 連続トラックセーブ(ロック済み)
+	BOOL FASTCALL SaveWait(BOOL unlock = FALSE);
+										// 非同期セーブ完了待ち(ロック済み)
+	void FASTCALL SaveBusyWait();
+										// ライトバック完了待ちの終了を待つ(ロック済み)
+	void FASTCALL Flushed(DWORD start);
+										// 同期時間の記録(ロック済み)
+	BOOL FASTCALL SaveRam(int first, int last);
+										// RAM常駐イメージセーブ(ロック済み)
+	BOOL FASTCALL SaveRamRun(int& track, int last, BOOL unlock = FALSE);
+										// RAM常駐連続トラックセーブ(ロック済み)
+	void FASTCALL FreeRam();
+										// RAM常駐イメージ解放
+	void FASTCALL Rebind(Disk *p);
+										// 読み込み元ディスク変更
+#ifndef BAREMETAL
+	void FASTCALL Lock()				{ pthread_mutex_lock(&lock); }
+										// ロック(統計取得のため常に行う)
+	void FASTCALL Unlock()				{ pthread_mutex_unlock(&lock); }
+										// アンロック
+#else
+	void FASTCALL Lock()				{}
+										// ロック
+	void FASTCALL Unlock()				{}
+										// アンロック
+#endif	// BAREMETAL
 	void FASTCALL Clear();
 										// トラックをすべてクリア
+	BOOL FASTCALL InitPool(int tracks);
+										// トラックプール初期化
+	DiskTrack* FASTCALL AllocTrack();
+										// トラック確保
+	void FASTCALL FreeTrack(DiskTrack *disktrk);
+										// トラック返却
 	DiskTrack* FASTCALL Assign(int track);
-										// トラックのロード
-	BOOL FASTCALL Load(int index, int track, DiskTrack *disktrk = NULL);
+										// トラックの割り当て
+	int FASTCALL Lookup(int track) const;
+										// トラックの検索
+	void FASTCALL Hash(int index);
+										// ハッシュ登録
+	void FASTCALL Unhash(int index);
+										// ハッシュ削除
+	void FASTCALL LinkHead(int index);
+										// LRUリスト先頭へ追加
+	void FASTCALL Unlink(int index);
+										// LRUリストから削除
+	BOOL FASTCALL Load(int index, int track, DiskTrack *disktrk);
 										// トラックのロード
 	void FASTCALL Update();
 										// シリアル番号更新
+	fsize_t FASTCALL GetMapOffset(UL64 block) const;
+										// マップ上のオフセット取得
+	int FASTCALL GetSectors(int track) const;
+										// トラックのセクタ数取得
+#ifndef BAREMETAL
+	void FASTCALL ReadAheadCheck(UL64 block, int count);
+										// 連続アクセスの検出
+	void FASTCALL ReadAhead(int track);
+										// 先読み要求
+	BOOL FASTCALL ReadAheadStart(int index, int track);
+										// 先読み開始
+	BOOL FASTCALL ReadAheadWake();
+										// 先読みスレッドの起床
+	BOOL FASTCALL ReadAheadTake(int track, DiskTrack **disktrk);
+										// 先読みトラックの取り込み
+	void FASTCALL ReadAheadFinish(int index);
+										// 非同期先読みの回収
+	void FASTCALL ReadAheadCancel();
+										// 先読み取り消し
+	BOOL FASTCALL StartReadAhead();
+										// 先読みスレッド起動
+	static void* ReadAheadThread(void *param);
+										// 先読みスレッド
+	void FASTCALL ReadAheadMain();
+										// 先読みスレッド主処理
+	static void* WriteBackThread(void *param);
+										// ライトバックスレッド
+	void FASTCALL WriteBackMain();
+										// ライトバックスレッド主処理
+#endif	// BAREMETAL
 
 	// 内部データ
 	Disk *disk;
 										// ディスク
-	cache_t cache[CacheMax];
+	cache_t *cache;
 										// キャッシュ管理
+	int cache_max;
+										// キャッシュトラック数
+	int *hashtbl;
+										// トラック→キャッシュのハッシュ
+	int hash_mask;
+										// ハッシュマスク
+	int lru_head;
+										// LRUリスト先頭(最新)
+	int lru_tail;
+										// LRUリスト末尾(最古)
+	int free_head;
+										// 空きリスト先頭
+	int *save_list;
+										// 連続トラックセーブ対象
+	struct iovec *save_iov;
+										// 連続トラックセーブ用ベクタ
+#ifndef BAREMETAL
+	savereq_t save_req[Fileio::AsyncMax];
+										// 非同期保存要求
+#endif	// BAREMETAL
+	int save_num;
+										// 非同期保存要求数
+	int save_used;
+										// 非同期保存中のトラック数
+	BOOL save_busy;
+										// 非同期保存の完了待ち中(ロック開放中)
+	DiskTrack *pool;
+										// トラックプール
+	BYTE *pool_buf;
+										// トラックプールのバッファ(スラブ)
+	DWORD *pool_map;
+										// トラックプールの変更済みマップ(スラブ)
+	BYTE *pool_raw;
+										// トラックプールのRAW読み込み用バッファ(スラブ)
+	BYTE *pool_zero;
+										// ゼロのトラック(スラブの末尾)
+	DiskTrack **pool_free;
+										// トラックプール空きスタック
+	int pool_max;
+										// トラックプール最大数
+	int pool_num;
+										// トラックプール空き数
 	DWORD serial;
 										// 最終アクセスシリアルナンバ
 	int sec_size;
 										// セクタサイズ(8 or 9 or 11)
-	int sec_blocks;
+	UL64 sec_blocks;
 										// セクタブロック数
+	int trk_num;
+										// トラック数
+	int trk_sectors;
+										// トラック毎のセクタ数
+	int trk_shift;
+										// トラック毎のセクタ数(シフト数)
 	BOOL cd_raw;
 										// CD-ROM RAWモード
 	fsize_t imgoffset;
 										// 実データまでのオフセット
+	BYTE *mapbuf;
+										// メモリマップ(Fileioが所有)
+	fsize_t map_start;
+										// メモリマップ変更範囲(先頭)
+	fsize_t map_end;
+										// メモリマップ変更範囲(終端)
+	BOOL map_ram;
+										// RAM常駐(mapbufを自前で確保)
+	size_t ram_len;
+										// RAM常駐イメージの確保長
+	DWORD *ram_dirty;
+										// RAM常駐の変更済みトラックマップ
+	BOOL ram_busy;
+										// RAM常駐の書き戻し中(ロック開放中)
+	Disk *share_user[ShareMax];
+										// 共有しているディスク
+	int share_num;
+										// 共有しているディスク数
+	BOOL share_pub;
+										// 共有キャッシュとして登録済み
+	DiskCache *share_next;
+										// 共有キャッシュリスト(次)
+#ifndef BAREMETAL
+	dev_t share_dev;
+										// 共有キー(デバイス)
+	ino_t share_ino;
+										// 共有キー(iノード)
+#endif	// BAREMETAL
+	static DiskCache *share_head;
+										// 共有キャッシュリスト(先頭)
+#ifndef BAREMETAL
+	int ra_depth;
+										// 先読みトラック数(0で無効)
+	UL64 ra_next;
+										// 連続アクセス時の次ブロック
+	int ra_seq;
+										// 連続アクセス回数
+	int ra_track;
+										// 最後に先読みを要求したトラック
+	readahead_t ra[ReadAheadMax];
+										// 先読みワーク
+	BOOL ra_run;
+										// 先読みスレッド動作中
+	pthread_t ra_thread;
+										// 先読みスレッド
+	pthread_mutex_t ra_lock;
+										// 先読みロック
+	pthread_cond_t ra_cond;
+										// 先読み条件変数
+	BOOL wb_run;
+										// ライトバックスレッド動作中
+	pthread_t wb_thread;
+										// ライトバックスレッド
+	pthread_mutex_t lock;
+										// キャッシュロック
+	pthread_cond_t wb_cond;
+										// ライトバック条件変数
+#endif	// BAREMETAL
+	int wb_dirty;
+										// 変更済みトラック数
+	int wb_limit;
+										// 即時書き戻しを行う変更済みトラック数
+	cachestat_t cache_stat;
+										// 統計(キャッシュロック)
+	UL64 ra_bytes;
+										// 先読み量(先読みロック)
+};
+
+//===========================================================================
+//
+//	ディスクオーバーレイ
+//	※ベースイメージは読み込み専用のまま、書き込みを差分ファイルへ振り向ける
+//	  差分ファイルはヘッダ、変更マップ(セクタ毎の1ビット)、データ領域の順で
+//	  データ領域はベースイメージと同じ配置の疎ファイルとする
+//
+//===========================================================================
+class DiskOverlay
+{
+public:
+	enum {
+		Version = 1,					// 差分ファイルのバージョン
+		HeaderSize = 0x200,				// ヘッダ長(変更マップの位置)
+		DataAlign = 0x1000,				// データ領域の境界
+		CopyMax = 0x100000				// 反映時に一度に複写する長さ
+	};
+
+	// 差分ファイルのヘッダ
+	typedef struct {
+		char magic[16];					// 識別子
+		DWORD version;					// バージョン
+		DWORD size;						// セクタサイズ(8～11)
+		DWORD blocks;					// 総セクタ数(下位32bit)
+		DWORD blocks_hi;				// 総セクタ数(上位32bit)
+	} header_t;
+
+public:
+	// 基本ファンクション
+	DiskOverlay();
+										// コンストラクタ
+	virtual ~DiskOverlay();
+										// デストラクタ
+	BOOL FASTCALL Open(
+		const Filepath& path, int size, UL64 blocks, fsize_t imgoff);
+										// オープン(ベースイメージのパスを指定)
+	void FASTCALL Close();
+										// クローズ
+
+	// アクセス(オフセットはベースイメージ上の位置)
+	BOOL FASTCALL Merge(BYTE *buf, int length, fsize_t offset);
+										// 差分の重ね合わせ
+	BOOL FASTCALL WriteAt(const BYTE *buf, int length, fsize_t offset);
+										// 位置指定書き込み
+	BOOL FASTCALL WriteVAt(const struct iovec *iov, int iovcnt, fsize_t offset);
+										// 位置指定ベクタ書き込み
+	BOOL FASTCALL ZeroAt(fsize_t offset, fsize_t length);
+										// 位置指定ゼロ化
+	BOOL FASTCALL Flush();
+										// 書き込み内容を媒体へ反映
+	BOOL FASTCALL CanPunchHole()		{ return fio.CanPunchHole(); }
+										// 領域の解放に対応しているか
+
+	// 差分操作
+	BOOL FASTCALL Commit(const Filepath& path);
+										// ベースイメージへ反映
+	BOOL FASTCALL Discard();
+										// 破棄
+	UL64 FASTCALL GetCount() const		{ return count; }
+										// 差分のあるセクタ数取得
+
+private:
+	BOOL FASTCALL Mark(UL64 block, DWORD num);
+										// 変更マップ設定と保存(ロック済み)
+	BOOL FASTCALL Clear();
+										// 変更マップ初期化と保存(ロック済み)
+	BOOL FASTCALL WriteMap(size_t first, size_t num);
+										// 変更マップ書き込み
+	UL64 FASTCALL NextRun(UL64 block, UL64 last, DWORD& num) const;
+										// 差分のある連続セクタ検索
+	fsize_t FASTCALL GetDataOffset(fsize_t offset) const
+										{ return data_offset + offset - imgoffset; }
+										// 差分ファイル上の位置取得
+#ifndef BAREMETAL
+	void FASTCALL Lock()				{ pthread_mutex_lock(&lock); }
+										// ロック
+	void FASTCALL Unlock()				{ pthread_mutex_unlock(&lock); }
+										// アンロック
+#else
+	void FASTCALL Lock()				{}
+										// ロック
+	void FASTCALL Unlock()				{}
+										// アンロック
+#endif	// BAREMETAL
+
+	// 内部データ
+	Fileio fio;
+										// 差分ファイル
+	DWORD *map;
+										// 変更マップ(ビットマップ)
+	size_t maplen;
+										// 変更マップ長(DWORD数)
+	int size;
+										// セクタサイズ
+	UL64 blocks;
+										// 総セクタ数
+	UL64 count;
+										// 差分のあるセクタ数
+	fsize_t imgoffset;
+										// ベースイメージの実データまでのオフセット
+	fsize_t data_offset;
+										// 差分ファイルのデータ領域の位置
+#ifndef BAREMETAL
+	pthread_mutex_t lock;
+										// 変更マップのロック
+#endif	// BAREMETAL
 };
 
 //===========================================================================
@@ -370,6 +866,17 @@ private:
 class Disk
 {
 public:
+	// 転送サイズ
+	enum {
+		XferDef = 0x10000,				// 既定の転送サイズ(バイト)
+		XferMax = 0x100000				// 最大の転送サイズ(バイト)
+	};
+
+	// UNMAP
+	enum {
+		UnmapDescMax = 256				// 一度に受け付けるブロック記述子数
+	};
+
 	// 内部ワーク
 	typedef struct {
 		DWORD id;						// メディアID
@@ -381,11 +888,12 @@ public:
 		BOOL attn;						// アテンション
 		BOOL reset;						// リセット
 		int size;						// セクタサイズ
-		DWORD blocks;					// 総セクタ数
+		UL64 blocks;					// 総セクタ数
 		DWORD lun;						// LUN
 		DWORD code;						// ステータスコード
 		DiskCache *dcache;				// ディスクキャッシュ
 		fsize_t imgoffset;				// 実データまでのオフセット
+		BOOL punch;						// 領域の解放に対応
 	} disk_t;
 
 public:
@@ -420,12 +928,17 @@ public:
 										// 書き込み禁止チェック
 	BOOL FASTCALL IsReadOnly() const	{ return disk.readonly; }
 										// Read Onlyチェック
+	BOOL FASTCALL IsThin() const
+		{ return disk.punch && !disk.writep && disk.dcache != NULL; }
+										// シンプロビジョニングチェック
 	BOOL FASTCALL IsRemovable() const	{ return disk.removable; }
 										// リムーバブルチェック
 	BOOL FASTCALL IsLocked() const		{ return disk.lock; }
 										// ロックチェック
 	BOOL FASTCALL IsAttn() const		{ return disk.attn; }
 										// 交換チェック
+	BOOL FASTCALL CheckAttn();
+										// アテンションチェック
 	BOOL FASTCALL Flush();
 										// キャッシュフラッシュ
 	void FASTCALL GetDisk(disk_t *buffer) const;
@@ -461,12 +974,26 @@ public:
 										// FORMAT UNITコマンド
 	BOOL FASTCALL Reassign(const DWORD *cdb);
 										// REASSIGN UNITコマンド
-	virtual int FASTCALL Read(BYTE *buf, DWORD block);
+	virtual int FASTCALL Read(BYTE *buf, UL64 block);
 										// READコマンド
-	int FASTCALL WriteCheck(DWORD block);
+	virtual int FASTCALL ReadBlocks(BYTE *buf, UL64 block, int count);
+										// READコマンド(複数ブロック)
+	virtual int FASTCALL PinBlocks(BYTE **ptr, UL64 block, int count);
+										// READコマンド(キャッシュ参照の固定)
+	void FASTCALL UnpinBlocks(UL64 block);
+										// READコマンド(キャッシュ参照の固定解除)
+	BOOL FASTCALL Prefetch(UL64 block, int count);
+										// READコマンド(取り寄せ)
+	int FASTCALL WriteCheck(UL64 block, int count = 1);
 										// WRITEチェック
-	BOOL FASTCALL Write(const BYTE *buf, DWORD block);
+	int FASTCALL VerifyCheck(UL64 block, int count);
+										// VERIFYチェック(BytChk=1)
+	int FASTCALL VerifyBlocks(const BYTE *buf, UL64 block, int count);
+										// VERIFYコマンド(バイト比較)
+	BOOL FASTCALL Write(const BYTE *buf, UL64 block);
 										// WRITEコマンド
+	BOOL FASTCALL WriteBlocks(const BYTE *buf, UL64 block, int count);
+										// WRITEコマンド(複数ブロック)
 	BOOL FASTCALL Seek(const DWORD *cdb);
 										// SEEKコマンド
 	BOOL FASTCALL Assign(const DWORD *cdb);
@@ -479,10 +1006,20 @@ public:
 										// SEND DIAGNOSTICコマンド
 	BOOL FASTCALL Removal(const DWORD *cdb);
 										// PREVENT/ALLOW MEDIUM REMOVALコマンド
-	int FASTCALL ReadCapacity(const DWORD *cdb, BYTE *buf);
-										// READ CAPACITYコマンド
+	virtual int FASTCALL ReadCapacity(const DWORD *cdb, BYTE *buf);
+										// READ CAPACITY(10/16)コマンド
 	BOOL FASTCALL Verify(const DWORD *cdb);
 										// VERIFYコマンド
+	BOOL FASTCALL SynchronizeCache(const DWORD *cdb);
+										// SYNCHRONIZE CACHEコマンド
+	int FASTCALL WriteSameCheck(const DWORD *cdb);
+										// WRITE SAMEチェック
+	BOOL FASTCALL WriteSame(const DWORD *cdb, BYTE *buf, int bufsize);
+										// WRITE SAME(10)コマンド
+	int FASTCALL UnmapCheck(const DWORD *cdb);
+										// UNMAPチェック
+	BOOL FASTCALL Unmap(const DWORD *cdb, const BYTE *buf);
+										// UNMAPコマンド
 	virtual int FASTCALL ReadToc(const DWORD *cdb, BYTE *buf);
 										// READ TOCコマンド
 	virtual BOOL FASTCALL PlayAudio(const DWORD *cdb);
@@ -493,12 +1030,58 @@ public:
 										// PLAY AUDIO TRACKコマンド
 	void FASTCALL InvalidCmd()			{ disk.code = DISK_INVALIDCMD; }
 										// サポートしていないコマンド
+	void FASTCALL NoResource()			{ disk.code = DISK_NORESOURCE; }
+										// 資源不足
 
 	// その他
 	BOOL FASTCALL IsCacheWB() { return cache_wb; }
 										// キャッシュモード取得
 	void FASTCALL SetCacheWB(BOOL enable) { cache_wb = enable; }
 										// キャッシュモード設定
+	BOOL FASTCALL IsCacheMap() const	{ return cache_map; }
+										// メモリマップモード取得
+	void FASTCALL SetCacheMap(BOOL enable) { cache_map = enable; }
+										// メモリマップモード設定
+	BOOL FASTCALL IsCacheRam() const	{ return cache_ram; }
+										// RAM常駐モード取得
+	void FASTCALL SetCacheRam(BOOL enable) { cache_ram = enable; }
+										// RAM常駐モード設定
+	BOOL FASTCALL IsCacheDirect() const	{ return cache_direct; }
+										// ダイレクトI/Oモード取得
+	void FASTCALL SetCacheDirect(BOOL enable) { cache_direct = enable; }
+										// ダイレクトI/Oモード設定
+	int FASTCALL GetCacheSize() const	{ return cache_mb; }
+										// キャッシュサイズ(MB)取得
+	void FASTCALL SetCacheSize(int mb)	{ cache_mb = mb; }
+										// キャッシュサイズ(MB)設定
+	int FASTCALL GetCacheTracks() const;
+										// キャッシュトラック数取得
+	BOOL FASTCALL GetCacheStat(DiskCache::cachestat_t *buffer) const;
+										// キャッシュ統計取得
+	int FASTCALL GetTrackSectors() const;
+										// トラック毎のセクタ数取得
+	void FASTCALL SetTrackSectors(int sectors) { cache_trk = sectors; }
+										// トラック毎のセクタ数設定
+	int FASTCALL GetReadAhead() const	{ return cache_ra; }
+										// 先読みトラック数取得
+	void FASTCALL SetReadAhead(int tracks) { cache_ra = tracks; }
+										// 先読みトラック数設定
+	int FASTCALL GetXferSize() const	{ return xfer_size ? xfer_size : XferDef; }
+										// 1回の転送サイズ取得
+	void FASTCALL SetXferSize(int size)	{ xfer_size = size; }
+										// 1回の転送サイズ設定
+	int FASTCALL GetSectorSize() const	{ return (1 << disk.size); }
+										// セクタサイズ取得
+	BOOL FASTCALL IsOverlayMode() const	{ return overlay_mode; }
+										// オーバーレイモード取得
+	void FASTCALL SetOverlayMode(BOOL enable) { overlay_mode = enable; }
+										// オーバーレイモード設定
+	DiskOverlay* FASTCALL GetOverlay() const { return overlay; }
+										// オーバーレイ取得(無効ならNULL)
+	BOOL FASTCALL CommitOverlay();
+										// オーバーレイをベースイメージへ反映
+	BOOL FASTCALL DiscardOverlay();
+										// オーバーレイを破棄
 	Fileio* FASTCALL GetFio() { return &fio; };
 										// ファイルIO取得
 
@@ -522,6 +1105,16 @@ protected:
 										// ベンダ特殊ページ追加
 	BOOL FASTCALL CheckReady();
 										// レディチェック
+	BOOL FASTCALL ZeroBlocks(UL64 block, UL64 count, BOOL unmap);
+										// ブロックのゼロ化
+	BOOL FASTCALL CreateCache();
+										// キャッシュ生成
+	void FASTCALL SetupCache();
+										// キャッシュ設定反映
+	void FASTCALL DeleteCache();
+										// キャッシュ削除
+	void FASTCALL CloseImage();
+										// イメージクローズ
 
 	// 内部データ
 	disk_t disk;
@@ -530,6 +1123,24 @@ protected:
 										// パス(GetPath用)
 	BOOL cache_wb;
 										// キャッシュモード
+	BOOL cache_map;
+										// メモリマップモード
+	BOOL cache_ram;
+										// RAM常駐モード
+	BOOL cache_direct;
+										// ダイレクトI/Oモード
+	int cache_mb;
+										// キャッシュサイズ(MB、0で既定)
+	int cache_ra;
+										// 先読みトラック数
+	int cache_trk;
+										// トラック毎のセクタ数(0で既定)
+	int xfer_size;
+										// 1回の転送サイズ(0で既定)
+	BOOL overlay_mode;
+										// オーバーレイモード
+	DiskOverlay *overlay;
+										// オーバーレイ
 	Fileio fio;
 										// ファイルIO
 };
@@ -576,6 +1187,13 @@ public:
 										// INQUIRYコマンド
 	BOOL FASTCALL ModeSelect(const DWORD *cdb, const BYTE *buf, int length);
 										// MODE SELECT(6)コマンド
+	int FASTCALL ReadCapacity(const DWORD *cdb, BYTE *buf);
+										// READ CAPACITY(10/16)コマンド
+
+protected:
+	// サブ処理
+	int FASTCALL InquiryVPD(const DWORD *cdb, BYTE *buf);
+										// VPDページ作成
 };
 
 //===========================================================================
@@ -807,8 +1425,12 @@ public:
 	// コマンド
 	int FASTCALL Inquiry(const DWORD *cdb, BYTE *buf, DWORD major, DWORD minor);
 										// INQUIRYコマンド
-	int FASTCALL Read(BYTE *buf, DWORD block);
+	int FASTCALL Read(BYTE *buf, UL64 block);
 										// READコマンド
+	int FASTCALL ReadBlocks(BYTE *buf, UL64 block, int count);
+										// READコマンド(複数ブロック)
+	int FASTCALL PinBlocks(BYTE **ptr, UL64 block, int count);
+										// READコマンド(キャッシュ参照の固定)
 	int FASTCALL ReadToc(const DWORD *cdb, BYTE *buf);
 										// READ TOCコマンド
 	BOOL FASTCALL PlayAudio(const DWORD *cdb);
@@ -844,7 +1466,7 @@ private:
 	// トラック管理
 	void FASTCALL ClearTrack();
 										// トラッククリア
-	int FASTCALL SearchTrack(DWORD lba) const;
+	int FASTCALL SearchTrack(UL64 lba) const;
 										// トラック検索
 	CDTrack* track[TrackMax];
 										// トラックオブジェクト
@@ -922,6 +1544,23 @@ public:
 		UnitMax = 8
 	};
 
+	// デバイス種別(コマンドテーブルの選択)
+	enum {
+		ClassSASI,						// SASI HD
+		ClassHD,						// SCSI HD
+		ClassMO,						// SCSI MO
+		ClassCD,						// SCSI CD-ROM
+		ClassBridge,					// SCSI ホストブリッジ
+		ClassMax
+	};
+
+	// コマンドのデータ方向
+	enum {
+		DirNone,						// データ転送なし
+		DirIn,							// データイン
+		DirOut							// データアウト
+	};
+
 #if USE_WAIT_CTRL == 1
 	// タイミング調整用
 	enum {
@@ -939,7 +1578,7 @@ public:
 		BUS *bus;						// バス
 
 		// コマンド
-		DWORD cmd[10];					// コマンドデータ
+		DWORD cmd[16];					// コマンドデータ
 		DWORD status;					// ステータスデータ
 		DWORD message;					// メッセージデータ
 
@@ -952,13 +1591,20 @@ public:
 		BYTE *buffer;					// 転送バッファ
 		int bufsize;					// 転送バッファサイズ
 		DWORD blocks;					// 転送ブロック数
-		DWORD next;						// 次のレコード
+		UL64 next;						// 次のレコード
+		DWORD remain;					// 未読み書きのレコード数
+		DWORD bufblocks;				// バッファあたりのレコード数
+		DWORD curblocks;				// 現在のバッファのレコード数
+		BYTE *pinbuf;					// 送信データ(キャッシュ参照、NULLでbuffer)
+		Disk *pinunit;					// キャッシュ参照中の論理ユニット
+		UL64 pinblock;					// キャッシュ参照中のレコード
 		DWORD offset;					// 転送オフセット
 		DWORD length;					// 転送残り長さ
 
 		// 論理ユニット
 		Disk *unit[UnitMax];
 										// 論理ユニット
+		int devclass[UnitMax];			// デバイス種別
 	} ctrl_t;
 
 public:
@@ -973,6 +1619,12 @@ public:
 	// 外部API
 	virtual BUS::phase_t FASTCALL Process();
 										// 実行
+	virtual BOOL FASTCALL IsDisconnected() const {return FALSE;}
+										// 切断中か
+	virtual BUS::phase_t FASTCALL Reconnect() {return ctrl.phase;}
+										// 再接続
+	virtual void FASTCALL Purge(int /*lun*/) {}
+										// 切断中のコマンド破棄
 
 	// 接続
 	void FASTCALL Connect(int id, BUS *sbus);
@@ -1045,6 +1697,22 @@ protected:
 	void FASTCALL CmdInvalid();
 										// サポートしていないコマンド
 
+	// コマンドテーブル
+	typedef struct {
+		DWORD opcode;					// オペコード
+		void (FASTCALL SASIDEV::*func)();
+										// 処理(NULLで終端)
+		int length;						// CDB長
+		int dir;						// データ方向
+		BOOL attn;						// ユニットアテンション中も実行する
+	} command_t;
+	static void FASTCALL InitCommand();
+										// コマンドテーブル構築
+	static const command_t SASITable[];
+										// SASIのコマンド
+	static command_t CommandTable[0x100];
+										// コマンドテーブル(オペコード順)
+
 	// データ転送
 	virtual void FASTCALL Send();
 										// データ送信
@@ -1062,6 +1730,20 @@ protected:
 										// バースト受信
 #endif	// USE_BURST_BUS
 
+	BOOL FASTCALL XferSetup(Disk *unit);
+										// ブロック転送準備
+	DWORD FASTCALL XferNext();
+										// 次のバッファのレコード数
+	void FASTCALL XferShrink(DWORD count);
+										// 現在のバッファのレコード数を短縮
+	int FASTCALL XferRead(Disk *unit, BYTE *buf);
+										// ブロック読み込み
+	void FASTCALL XferRelease();
+										// キャッシュ参照の解放
+	void FASTCALL XferAhead(UL64 block);
+										// 転送先の取り寄せ
+	virtual BOOL FASTCALL XferDisconnect() {return FALSE;}
+										// 切断判定
 	BOOL FASTCALL XferIn(BYTE* buf);
 										// データ転送IN
 	BOOL FASTCALL XferOut(BOOL cont);
@@ -1088,6 +1770,30 @@ protected:
 class SCSIDEV : public SASIDEV
 {
 public:
+	// 再接続
+	enum {
+		ReconnectTimeout = 1000 * 1000,	// 取り寄せを待たずに再接続する時間(us)
+		ReconnectLimit = 10 * 1000 * 1000,	// 再接続をあきらめる時間(us)
+		ReselectBackoff = 1000,			// リセレクション失敗後の待ち時間(us)
+		ReselectBackoffMax = 100 * 1000,	// リセレクション失敗後の最大待ち時間(us)
+		QueueMax = 8					// 切断中にしておける最大コマンド数
+	};
+
+	// 切断中のコマンド
+	typedef struct {
+		BOOL used;						// 使用中
+		BOOL started;					// 転送途中で切断した
+		int initiator;					// イニシエータID
+		DWORD cmd[16];					// コマンド
+		DWORD tagmsg;					// キュータグメッセージ(0でタグ無し)
+		DWORD tag;						// キュータグ
+		DWORD seq;						// 受け付け順
+		DWORD start;					// 切断開始時間
+		UL64 record;					// 次のレコード
+		DWORD blocks;					// 残りレコード数
+		DWORD bufblocks;				// バッファあたりのレコード数
+	} queue_t;
+
 	// 内部データ定義
 	typedef struct {
 		// 同期転送
@@ -1099,6 +1805,24 @@ public:
 		BOOL atnmsg;
 		int msc;
 		BYTE msb[256];
+
+		// 切断/再接続
+		int initiator;					// イニシエータID(-1で不明)
+		BOOL discpriv;					// 切断許可(IDENTIFYで受信)
+		BOOL reconnect;					// 再接続のIDENTIFY送信中
+		BOOL resume;					// 再接続後に転送を再開する
+		BOOL dequeued;					// キューから取り出したコマンド
+		DWORD reseltime;				// 最後にリセレクションに失敗した時間
+		DWORD reselwait;				// 次のリセレクションまでの待ち時間(us)
+
+		// タグ付きキューイング
+		DWORD tagmsg;					// キュータグメッセージ(0でタグ無し)
+		DWORD tag;						// キュータグ
+		queue_t queue[QueueMax];		// 切断中のコマンド
+		int queued;						// 切断中のコマンド数
+		DWORD seq;						// 受け付け順カウンタ
+		DWORD curseq;					// 実行中のコマンドの受け付け順
+		UL64 head;						// 直前に処理したレコードの次
 	} scsi_t;
 
 	enum {
@@ -1117,6 +1841,12 @@ public:
 	// 外部API
 	BUS::phase_t FASTCALL Process();
 										// 実行
+	BOOL FASTCALL IsDisconnected() const {return (scsi.queued > 0);}
+										// 切断中か
+	BUS::phase_t FASTCALL Reconnect();
+										// 再接続
+	void FASTCALL Purge(int lun);
+										// 切断中のコマンド破棄
 
 	// その他
 	BOOL FASTCALL IsSASI() const {return FALSE;}
@@ -1152,18 +1882,24 @@ private:
 										// PREVENT/ALLOW MEDIUM REMOVALコマンド
 	void FASTCALL CmdReadCapacity();
 										// READ CAPACITYコマンド
+	void FASTCALL CmdReadCapacity16();
+										// READ CAPACITY(16)コマンド
 	void FASTCALL CmdRead10();
-										// READ(10)コマンド
+										// READ(10/12/16)コマンド
 	void FASTCALL CmdWrite10();
-										// WRITE(10)コマンド
+										// WRITE(10/12/16)コマンド
 	void FASTCALL CmdSeek10();
 										// SEEK(10)コマンド
 	void FASTCALL CmdVerify();
-										// VERIFYコマンド
+										// VERIFY(10/12/16)コマンド
 	void FASTCALL CmdSynchronizeCache();
 										// SYNCHRONIZE CACHE コマンド
 	void FASTCALL CmdReadDefectData10();
 										// READ DEFECT DATA(10) コマンド
+	void FASTCALL CmdWriteSame10();
+										// WRITE SAME(10)コマンド
+	void FASTCALL CmdUnmap();
+										// UNMAPコマンド
 	void FASTCALL CmdReadToc();
 										// READ TOCコマンド
 	void FASTCALL CmdPlayAudio10();
@@ -1199,6 +1935,44 @@ private:
 
 	BOOL FASTCALL XferMsg(DWORD msg);
 										// データ転送MSG
+	BOOL FASTCALL XferDisconnect();
+										// 切断判定
+	void FASTCALL XferResume();
+										// 再接続後の転送再開
+	BOOL FASTCALL QueueCommand();
+										// タグ付きコマンドをキューに積む
+	BOOL FASTCALL QueueAdd(BOOL started);
+										// キューに追加
+	int FASTCALL QueueSelect();
+										// 次に再接続するコマンドを選ぶ
+	void FASTCALL QueueAbort(int initiator, DWORD tagmsg, DWORD tag);
+										// キューから取り除く
+	UL64 FASTCALL GetRecord();
+										// レコード番号とブロック数を取得
+
+	// コマンドテーブル
+	typedef struct {
+		DWORD opcode;					// オペコード
+		void (FASTCALL SCSIDEV::*func)();
+										// 処理(NULLで終端)
+		int length;						// CDB長
+		int dir;						// データ方向
+		BOOL attn;						// ユニットアテンション中も実行する
+	} command_t;
+	static void FASTCALL InitCommand();
+										// コマンドテーブル構築
+	static void FASTCALL AddCommand(int devclass, const command_t *list);
+										// コマンドテーブルへ追加
+	static const command_t CommonTable[];
+										// 共通のコマンド
+	static const command_t BlockTable[];
+										// ブロックデバイス(HD/MO/CD)のコマンド
+	static const command_t AudioTable[];
+										// CD-DAのコマンド
+	static const command_t BridgeTable[];
+										// ホストブリッジのコマンド
+	static command_t CommandTable[ClassMax][0x100];
+										// コマンドテーブル(デバイス種別、オペコード順)
 
 	scsi_t scsi;
 										// 内部データ
@@ -35,6 +35,12 @@ Fileio::Fileio()
 	m_bOpen = FALSE;
 	m_szPath[0] = '\0';
 	m_position = 0;
+	m_pMap = NULL;
+	m_MapSize = 0;
+	m_pAsync = NULL;
+	m_bDirectReq = FALSE;
+	m_bDirect = FALSE;
+	m_pChunk = NULL;
 }
 
 //---------------------------------------------------------------------------
@@ -44,6 +50,15 @@ Fileio::Fileio()
 //---------------------------------------------------------------------------
 Fileio::~Fileio()
 {
+	// 非同期I/Oエンジン停止
+	StopAsync();
+
+	// メモリマップ解除
+	Unmap();
+
+	// チャンク圧縮イメージ解放
+	CloseChunk();
+
 	// 解放
 	if (handle != -1) {
 		close(handle);
@@ -134,6 +149,7 @@ BOOL FASTCALL Fileio::Open(LPCTSTR fname, OpenMode mode)
 	}
 
 	// キャッシュファイルを解放
+	CloseChunk();
 	close(handle);
 	handle = -1;
 	m_bOpen = FALSE;
@@ -183,6 +199,16 @@ BOOL FASTCALL Fileio::Open(LPCTSTR fname, OpenMode mode)
 		return FALSE;
 	}
 
+	// チャンク圧縮イメージなら展開して読む(書き込みはできない)
+	if (mode == ReadOnly || mode == ReadWrite) {
+		if (!OpenChunk() || (m_pChunk && mode == ReadWrite)) {
+			CloseChunk();
+			close(handle);
+			handle = -1;
+			return FALSE;
+		}
+	}
+
 	// パスとモードを保存
 	m_bOpen = TRUE;
 	strcpy(m_szPath, (LPTSTR)fname);
@@ -269,10 +295,16 @@ BOOL FASTCALL Fileio::Read(void *buffer, int size)
 	ASSERT(size > 0);
 	ASSERT(m_bOpen);
 
-	// 読み込み
-	count = read(handle, buffer, size);
-	if (count != size) {
-		return FALSE;
+	// 読み込み(チャンク圧縮イメージは現在位置から展開)
+	if (m_pChunk) {
+		if (!ReadChunk(buffer, size, m_position)) {
+			return FALSE;
+		}
+	} else {
+		count = read(handle, buffer, size);
+		if (count != size) {
+			return FALSE;
+		}
 	}
 
 	// 現在値を更新
@@ -307,6 +339,119 @@ BOOL FASTCALL Fileio::Write(const void *buffer, int size)
 	return TRUE;
 }
 
+//---------------------------------------------------------------------------
+//
+//	位置指定読み込み
+//	※ファイル位置は変化しない
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::ReadAt(void *buffer, int size, fsize_t offset)
+{
+	int count;
+
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// チャンク圧縮イメージは展開して読む
+	if (m_pChunk) {
+		return ReadChunk(buffer, size, offset);
+	}
+
+	// 読み込み(ダイレクトI/Oの境界に合わなければ解除してやり直す)
+	count = pread(handle, buffer, size, offset);
+	if (count < 0 && DirectFallback()) {
+		count = pread(handle, buffer, size, offset);
+	}
+	if (count != size) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定書き込み
+//	※ファイル位置は変化しない
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::WriteAt(const void *buffer, int size, fsize_t offset)
+{
+	int count;
+
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// 書き込み(ダイレクトI/Oの境界に合わなければ解除してやり直す)
+	count = pwrite(handle, buffer, size, offset);
+	if (count < 0 && DirectFallback()) {
+		count = pwrite(handle, buffer, size, offset);
+	}
+	if (count != size) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定ベクタ書き込み
+//	※ファイル上で連続する複数のバッファを一度に書き込む
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::WriteVAt(const struct iovec *iov, int count, fsize_t offset)
+{
+	struct iovec vec[WriteVMax];
+	ssize_t len;
+	int num;
+	int i;
+
+	ASSERT(this);
+	ASSERT(iov);
+	ASSERT(count > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	while (count > 0) {
+		// 一度に渡せる数に分割
+		num = (count > WriteVMax) ? WriteVMax : count;
+		memcpy(vec, iov, sizeof(struct iovec) * num);
+
+		// 途中までしか書けなかった場合は残りを書き込む
+		i = 0;
+		while (i < num) {
+			len = pwritev(handle, &vec[i], num - i, offset);
+			if (len < 0 && DirectFallback()) {
+				len = pwritev(handle, &vec[i], num - i, offset);
+			}
+			if (len <= 0) {
+				return FALSE;
+			}
+			offset += len;
+			while (i < num && (size_t)len >= vec[i].iov_len) {
+				len -= vec[i].iov_len;
+				i++;
+			}
+			if (i < num) {
+				vec[i].iov_base = (BYTE *)vec[i].iov_base + len;
+				vec[i].iov_len -= len;
+			}
+		}
+
+		iov += num;
+		count -= num;
+	}
+
+	return TRUE;
+}
+
 //---------------------------------------------------------------------------
 //
 //	シーク
@@ -328,8 +473,8 @@ BOOL FASTCALL Fileio::Seek(fsize_t offset, BOOL relative)
 		return TRUE;
 	}
 
-	// シーク
-	if (lseek(handle, offset, SEEK_SET) != offset) {
+	// シーク(チャンク圧縮イメージは位置の更新のみ)
+	if (!m_pChunk && lseek(handle, offset, SEEK_SET) != offset) {
 		return FALSE;
 	}
 
@@ -351,6 +496,11 @@ fsize_t FASTCALL Fileio::GetFileSize()
 	ASSERT(this);
 	ASSERT(m_bOpen);
 
+	// チャンク圧縮イメージは展開後のサイズ
+	if (m_pChunk) {
+		return (fsize_t)m_pChunk->hdr.length;
+	}
+
 	// ファイルサイズを64bitで取得
 	end = lseek(handle, 0, SEEK_END);
 
@@ -376,227 +526,1616 @@ fsize_t FASTCALL Fileio::GetFilePos() const
 
 //---------------------------------------------------------------------------
 //
-//	クローズ
+//	メモリマップ
+//	※ファイル全体をマップする。既にマップ済みならそれを返す
 //
 //---------------------------------------------------------------------------
-void FASTCALL Fileio::Close()
+BYTE* FASTCALL Fileio::Map(BOOL write)
 {
+	fsize_t size;
+	void *p;
+
 	ASSERT(this);
 	ASSERT(m_bOpen);
 
-	// 先頭にシーク
-	lseek(handle, 0, SEEK_SET);
-	m_position = 0;
+	// マップ済み
+	if (m_pMap) {
+		return m_pMap;
+	}
 
-	// クローズ
-	m_bOpen = FALSE;
+	// チャンク圧縮イメージはマップできない
+	if (m_pChunk) {
+		return NULL;
+	}
+
+	// 書き込みはReadWriteでオープンしている必要がある
+	if (write && m_Mode != ReadWrite) {
+		return NULL;
+	}
+
+	// ファイルサイズ取得
+	size = GetFileSize();
+	if (size <= 0 || (fsize_t)(size_t)size != size) {
+		return NULL;
+	}
+
+	// マップ
+	p = mmap(NULL, (size_t)size,
+		write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, handle, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	// 先読みはカーネルに任せる
+	madvise(p, (size_t)size, MADV_NORMAL);
+
+	m_pMap = (BYTE *)p;
+	m_MapSize = size;
+	return m_pMap;
 }
-#else
+
 //---------------------------------------------------------------------------
 //
-//	コンストラクタ
+//	メモリマップ解除
 //
 //---------------------------------------------------------------------------
-Fileio::Fileio()
+void FASTCALL Fileio::Unmap()
 {
-	// ワーク初期化
-	handle.obj.fs = 0;
-	m_bOpen = FALSE;
-	m_szPath[0] = '\0';
-	m_position = 0;
+	ASSERT(this);
+
+	if (m_pMap) {
+		munmap(m_pMap, (size_t)m_MapSize);
+		m_pMap = NULL;
+		m_MapSize = 0;
+	}
 }
 
 //---------------------------------------------------------------------------
 //
-//	デストラクタ
+//	メモリマップ同期
+//	※指定範囲をページ境界に広げて書き戻しを要求する。waitなら完了を待つ
 //
 //---------------------------------------------------------------------------
-Fileio::~Fileio()
+BOOL FASTCALL Fileio::Sync(fsize_t offset, fsize_t length, BOOL wait)
 {
-	// 解放
-	if (handle.obj.fs) {
-		f_close(&handle);
+	fsize_t mask;
+	fsize_t end;
+
+	ASSERT(this);
+	ASSERT(offset >= 0);
+	ASSERT(length >= 0);
+
+	// マップされていなければ不要
+	if (!m_pMap || length == 0) {
+		return TRUE;
+	}
+
+	// ページ境界に合わせる
+	mask = (fsize_t)sysconf(_SC_PAGESIZE) - 1;
+	end = offset + length;
+	offset &= ~mask;
+	if (end > m_MapSize) {
+		end = m_MapSize;
 	}
+
+	// 書き戻し要求
+	if (msync(m_pMap + offset, (size_t)(end - offset),
+		wait ? MS_SYNC : MS_ASYNC) != 0) {
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	ロード
+//	書き込み内容を媒体へ反映
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Fileio::Load(const Filepath& path, void *buffer, int size)
+BOOL FASTCALL Fileio::Flush()
 {
 	ASSERT(this);
-	ASSERT(buffer);
-	ASSERT(size > 0);
-	ASSERT(!m_bOpen);
-
-	// オープン
-	if (!Open(path, ReadOnly)) {
-		return FALSE;
-	}
+	ASSERT(m_bOpen);
 
-	// 読み込み
-	if (!Read(buffer, size)) {
-		Close();
+	if (fdatasync(handle) != 0) {
 		return FALSE;
 	}
 
-	// クローズ
-	Close();
-
 	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	セーブ
+//	ファイルサイズ切り詰め
+//	※切り詰めた領域の割り当ては解放される(疎ファイルの穴に戻る)
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Fileio::Save(const Filepath& path, void *buffer, int size)
+BOOL FASTCALL Fileio::Truncate(fsize_t size)
 {
 	ASSERT(this);
-	ASSERT(buffer);
-	ASSERT(size > 0);
-	ASSERT(!m_bOpen);
-
-	// オープン
-	if (!Open(path, WriteOnly)) {
-		return FALSE;
-	}
+	ASSERT(m_bOpen);
+	ASSERT(size >= 0);
 
-	// 書き込み
-	if (!Write(buffer, size)) {
-		Close();
+	if (ftruncate(handle, size) != 0) {
 		return FALSE;
 	}
 
-	// クローズ
-	Close();
-
 	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	オープン
+//	範囲のゼロ化
+//	※データを書かずにファイルシステムの操作でゼロにする(サイズは変えない)
+//	  unmap指定時は領域の割り当ても解放する(疎ファイルの穴にする)
+//	  対応していなければFALSEを返すので、呼び出し側でゼロを書き込むこと
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Fileio::Open(LPCTSTR fname, OpenMode mode)
+BOOL FASTCALL Fileio::ZeroAt(fsize_t offset, fsize_t length, BOOL unmap)
 {
-	FRESULT fr;
-	Filepath fpath;
-
 	ASSERT(this);
-	ASSERT(fname);
-	ASSERT(!m_bOpen);
+	ASSERT(m_bOpen);
+	ASSERT(offset >= 0);
+	ASSERT(length > 0);
 
-	// ヌル文字列からの読み込みは必ず失敗させる
-	if (fname[0] == _T('\0')) {
+	// チャンク圧縮イメージは書き込めない
+	if (m_pChunk) {
 		return FALSE;
 	}
 
-	// キャッシュファイルと同一か
-	if (handle.obj.fs) {
-		if (strcmp(fname, m_szPath) == 0 && mode == m_Mode) {
-			m_bOpen = TRUE;
+	// 割り当てを残す場合はZERO_RANGE、未対応なら穴を開けて代用する
+	if (!unmap) {
+		if (fallocate(handle, FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE,
+			offset, length) == 0) {
 			return TRUE;
 		}
+		if (errno != EOPNOTSUPP) {
+			return FALSE;
+		}
 	}
-
-	// キャッシュファイルを解放
-	f_close(&handle);
-	handle.obj.fs = 0;
-	m_bOpen = FALSE;
-	m_szPath[0] = '\0';
-	m_position = 0;
-
-	// モード別
-	switch (mode) {
-		// 読み込みのみ
-		case ReadOnly:
-			fr = f_open(&handle, fname, FA_READ);
-			break;
-
-		// 書き込みのみ
-		case WriteOnly:
-			fr = f_open(&handle, fname, FA_CREATE_ALWAYS | FA_WRITE);
-			break;
-
-		// 読み書き両方
-		case ReadWrite:
-			fr = f_open(&handle, fname, FA_READ | FA_WRITE);
-			break;
-
-		// アペンド
-		case Append:
-			fr = f_open(&handle, fname, FA_OPEN_APPEND | FA_WRITE);
-			break;
-
-		// それ以外
-		default:
-			fr = FR_NO_PATH;
-			ASSERT(FALSE);
-			break;
-	}
-
-	// 結果評価
-	if (fr != FR_OK) {
-		return FALSE;
-	}
-
-	// リンクマップテーブル生成
-	handle.cltbl = cltbl;
-	cltbl[0] = sizeof(cltbl) / sizeof(DWORD);
-	fr = f_lseek(&handle, CREATE_LINKMAP);
-	if (fr != FR_OK) {
-		f_close(&handle);
-		handle.obj.fs = 0;
+	if (fallocate(handle, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+		offset, length) != 0) {
 		return FALSE;
 	}
 
-	// パスとモードを保存
-	m_bOpen = TRUE;
-	strcpy(m_szPath, (LPTSTR)fname);
-	m_Mode = mode;
-
-	// オープン成功
-	ASSERT(handle.obj.fs);
 	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	オープン
+//	領域の解放(穴開け)に対応しているか
+//	※ファイル終端より後ろに穴を開けてみる(データには影響しない)
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Fileio::Open(const Filepath& path, OpenMode mode)
+BOOL FASTCALL Fileio::CanPunchHole()
 {
 	ASSERT(this);
+	ASSERT(m_bOpen);
 
-	return Open(path.GetPath(), mode);
+	// チャンク圧縮イメージは書き込めない
+	if (m_pChunk) {
+		return FALSE;
+	}
+
+	if (fallocate(handle, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+		GetFileSize(), 1) != 0) {
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 //---------------------------------------------------------------------------
 //
-//	1行読み込み
+//	ファイル識別子取得
+//	※同じファイルを開いているかの判定に使う
 //
 //---------------------------------------------------------------------------
-BOOL FASTCALL Fileio::ReadLine(LPTSTR buffer, int size)
+BOOL FASTCALL Fileio::GetFileId(dev_t& dev, ino_t& ino) const
 {
+	struct stat st;
+
 	ASSERT(this);
-	ASSERT(buffer);
-	ASSERT(size > 0);
 	ASSERT(m_bOpen);
 
-	// 読み込み
-	if (f_gets(buffer, size -1, &handle) == NULL) {
+	if (fstat(handle, &st) != 0) {
 		return FALSE;
 	}
 
-	// 現在値を更新
-	m_position = (fsize_t)f_tell(&handle);
-
+	dev = st.st_dev;
+	ino = st.st_ino;
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ダイレクトI/O設定
+//	※ページキャッシュを経由せずに読み書きする。オフセットと長さは
+//	  DirectBlock、バッファはDirectAlignの境界に合わせること
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::SetDirect(BOOL enable)
+{
+	int flags;
+
+	ASSERT(this);
+	ASSERT(m_bOpen);
+
+	// チャンク圧縮イメージは展開して読むので対象外
+	if (m_pChunk) {
+		return !enable;
+	}
+
+#ifdef O_DIRECT
+	// 非同期I/Oの途中では切り替えない
+	CompleteAll();
+
+	flags = fcntl(handle, F_GETFL);
+	if (flags < 0) {
+		return FALSE;
+	}
+	if (enable) {
+		flags |= O_DIRECT;
+	} else {
+		flags &= ~O_DIRECT;
+	}
+	if (fcntl(handle, F_SETFL, flags) != 0) {
+		// ファイルシステムが対応していない
+		m_bDirectReq = FALSE;
+		__atomic_store_n(&m_bDirect, FALSE, __ATOMIC_RELEASE);
+		return FALSE;
+	}
+
+	m_bDirectReq = enable;
+	__atomic_store_n(&m_bDirect, enable, __ATOMIC_RELEASE);
+	return TRUE;
+#else
+	return !enable;
+#endif	// O_DIRECT
+}
+
+//---------------------------------------------------------------------------
+//
+//	ダイレクトI/O解除(境界違反時)
+//	※EINVALで失敗した場合にO_DIRECTを外す。やり直すべきならTRUE
+//	  (他スレッドが既に外していても自分の再試行の前に外れていることを保証)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::DirectFallback()
+{
+#ifdef O_DIRECT
+	int flags;
+
+	ASSERT(this);
+
+	if (errno != EINVAL || !m_bDirectReq) {
+		return FALSE;
+	}
+
+	flags = fcntl(handle, F_GETFL);
+	if (flags < 0 || fcntl(handle, F_SETFL, flags & ~O_DIRECT) != 0) {
+		return FALSE;
+	}
+	__atomic_store_n(&m_bDirect, FALSE, __ATOMIC_RELEASE);
+	return TRUE;
+#else
+	return FALSE;
+#endif	// O_DIRECT
+}
+
+//---------------------------------------------------------------------------
+//
+//	ダイレクトI/O用バッファ確保
+//	※DirectAlignの境界に合わせる。freeで解放できる
+//
+//---------------------------------------------------------------------------
+void* FASTCALL Fileio::AllocBuffer(size_t length)
+{
+	void *p;
+
+	if (posix_memalign(&p, DirectAlign, length) != 0) {
+		return NULL;
+	}
+
+	return p;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期位置指定読み込み要求
+//	※要求番号を返す。要求できなければ-1(呼び出し元で同期読み込みする)
+//
+//---------------------------------------------------------------------------
+int FASTCALL Fileio::SubmitReadAt(void *buffer, int size, fsize_t offset)
+{
+	struct iovec iov;
+
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+
+	// チャンク圧縮イメージは展開が必要なので同期で読む
+	if (m_pChunk) {
+		return -1;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = (size_t)size;
+	return SubmitVAt(FALSE, &iov, 1, offset);
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期位置指定ベクタ書き込み要求
+//	※要求番号を返す。要求できなければ-1(呼び出し元で同期書き込みする)
+//	  バッファの内容はComplete(IsComplete)で完了を確認するまで保持すること
+//
+//---------------------------------------------------------------------------
+int FASTCALL Fileio::SubmitWriteVAt(
+	const struct iovec *iov, int count, fsize_t offset)
+{
+	ASSERT(this);
+
+	return SubmitVAt(TRUE, iov, count, offset);
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/O要求
+//
+//---------------------------------------------------------------------------
+int FASTCALL Fileio::SubmitVAt(
+	BOOL write, const struct iovec *iov, int count, fsize_t offset)
+{
+	int id;
+	int i;
+	asyncreq_t *req;
+
+	ASSERT(this);
+	ASSERT(iov);
+	ASSERT((count > 0) && (count <= WriteVMax));
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// エンジンを起動
+	if (!m_pAsync && !StartAsync()) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&m_pAsync->lock);
+
+	// 空きを探す
+	for (id = 0; id < AsyncMax; id++) {
+		if (m_pAsync->req[id].state == AsyncFree) {
+			break;
+		}
+	}
+	if (id >= AsyncMax) {
+		pthread_mutex_unlock(&m_pAsync->lock);
+		return -1;
+	}
+
+	// 要求を作成
+	req = &m_pAsync->req[id];
+	req->write = write;
+	req->count = count;
+	req->offset = offset;
+	req->length = 0;
+	for (i = 0; i < count; i++) {
+		req->iov[i] = iov[i];
+		req->length += iov[i].iov_len;
+	}
+	req->result = FALSE;
+
+	// 投入
+	id = Submit(id);
+	pthread_mutex_unlock(&m_pAsync->lock);
+
+	return id;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/O投入(ロック済み)
+//
+//---------------------------------------------------------------------------
+int FASTCALL Fileio::Submit(int id)
+{
+	asyncreq_t *req;
+#ifdef HAVE_IO_URING
+	unsigned tail;
+	unsigned index;
+	struct io_uring_sqe *sqe;
+#endif	// HAVE_IO_URING
+
+	ASSERT(this);
+	ASSERT(m_pAsync);
+	ASSERT((id >= 0) && (id < AsyncMax));
+
+	req = &m_pAsync->req[id];
+
+	// ワーカスレッドへ渡す
+	if (m_pAsync->ring < 0) {
+		req->state = AsyncQueued;
+		pthread_cond_broadcast(&m_pAsync->cond);
+		return id;
+	}
+
+#ifdef HAVE_IO_URING
+	// 投入エントリを作成(ワークの数はリングより少ないので溢れない)
+	tail = *m_pAsync->sq_tail;
+	index = tail & *m_pAsync->sq_mask;
+	sqe = &((struct io_uring_sqe *)m_pAsync->sqe_ptr)[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = handle;
+	sqe->off = (uint64_t)req->offset;
+	sqe->addr = (uint64_t)(uintptr_t)req->iov;
+	sqe->len = (uint32_t)req->count;
+	sqe->user_data = (uint64_t)id;
+	m_pAsync->sq_array[index] = index;
+	__atomic_store_n(m_pAsync->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	// カーネルへ通知
+	req->state = AsyncRunning;
+	while (syscall(__NR_io_uring_enter, m_pAsync->ring, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			// 投入できなければ同期実行して完了とする
+			req->result = Execute(req, 0);
+			req->state = AsyncDone;
+			break;
+		}
+	}
+#endif	// HAVE_IO_URING
+
+	return id;
+}
+
+//---------------------------------------------------------------------------
+//
+//	io_uring完了キュー回収(ロック済み)
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::Reap()
+{
+#ifdef HAVE_IO_URING
+	unsigned head;
+	struct io_uring_cqe *cqe;
+	asyncreq_t *req;
+
+	ASSERT(this);
+	ASSERT(m_pAsync);
+	ASSERT(m_pAsync->ring >= 0);
+
+	head = *m_pAsync->cq_head;
+	while (head != __atomic_load_n(m_pAsync->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &((struct io_uring_cqe *)m_pAsync->cqes)[
+			head & *m_pAsync->cq_mask];
+		ASSERT(cqe->user_data < AsyncMax);
+		req = &m_pAsync->req[cqe->user_data];
+		ASSERT(req->state == AsyncRunning);
+
+		if (cqe->res == -EINVAL && m_bDirectReq) {
+			// ダイレクトI/Oの境界に合わなければ解除して同期実行
+			errno = EINVAL;
+			DirectFallback();
+			req->result = Execute(req, 0);
+		} else if (cqe->res < 0) {
+			req->result = FALSE;
+		} else if ((size_t)cqe->res < req->length) {
+			// 途中までしか処理されなかった場合は残りを同期実行
+			req->result = Execute(req, (size_t)cqe->res);
+		} else {
+			req->result = TRUE;
+		}
+		req->state = AsyncDone;
+		head++;
+	}
+	__atomic_store_n(m_pAsync->cq_head, head, __ATOMIC_RELEASE);
+#endif	// HAVE_IO_URING
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/O完了待ち
+//	※結果を返し、要求番号を解放する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Complete(int id)
+{
+	asyncreq_t *req;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(m_pAsync);
+	ASSERT((id >= 0) && (id < AsyncMax));
+
+	req = &m_pAsync->req[id];
+	ASSERT(req->state != AsyncFree);
+
+	pthread_mutex_lock(&m_pAsync->lock);
+	while (req->state != AsyncDone) {
+		// ワーカスレッドか、他の完了待ちスレッドが回収するのを待つ
+		if (m_pAsync->ring < 0 || m_pAsync->reaping) {
+			pthread_cond_wait(&m_pAsync->cond, &m_pAsync->lock);
+			continue;
+		}
+
+#ifdef HAVE_IO_URING
+		// 自分で完了を待って回収する
+		m_pAsync->reaping = TRUE;
+		pthread_mutex_unlock(&m_pAsync->lock);
+		syscall(__NR_io_uring_enter,
+			m_pAsync->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		pthread_mutex_lock(&m_pAsync->lock);
+		Reap();
+		m_pAsync->reaping = FALSE;
+		pthread_cond_broadcast(&m_pAsync->cond);
+#endif	// HAVE_IO_URING
+	}
+
+	// 解放
+	result = req->result;
+	req->state = AsyncFree;
+	pthread_mutex_unlock(&m_pAsync->lock);
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/O完了チェック
+//	※待たずに確認する。TRUEならCompleteですぐに結果を得られる
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::IsComplete(int id)
+{
+	BOOL done;
+
+	ASSERT(this);
+	ASSERT(m_pAsync);
+	ASSERT((id >= 0) && (id < AsyncMax));
+
+	pthread_mutex_lock(&m_pAsync->lock);
+	if (m_pAsync->ring >= 0 && !m_pAsync->reaping) {
+		Reap();
+	}
+	done = (BOOL)(m_pAsync->req[id].state == AsyncDone);
+	pthread_mutex_unlock(&m_pAsync->lock);
+
+	return done;
+}
+
+//---------------------------------------------------------------------------
+//
+//	全非同期I/O完了待ち
+//	※結果は捨てる(呼び出し元が既に不要とした要求の後始末)
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::CompleteAll()
+{
+	int id;
+
+	ASSERT(this);
+
+	if (!m_pAsync) {
+		return;
+	}
+
+	for (id = 0; id < AsyncMax; id++) {
+		if (m_pAsync->req[id].state != AsyncFree) {
+			Complete(id);
+		}
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	同期実行(残り部分)
+//	※doneバイト処理済みの要求の残りをpreadv/pwritevで処理する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Execute(asyncreq_t *req, size_t done)
+{
+	struct iovec vec[WriteVMax];
+	ssize_t len;
+	fsize_t offset;
+	int i;
+	BOOL retry;
+
+	ASSERT(this);
+	ASSERT(req);
+	ASSERT(done <= req->length);
+
+	// 処理済みの部分を飛ばす
+	memcpy(vec, req->iov, sizeof(struct iovec) * req->count);
+	offset = req->offset + (fsize_t)done;
+	i = 0;
+	while (i < req->count && done >= vec[i].iov_len) {
+		done -= vec[i].iov_len;
+		i++;
+	}
+	if (i < req->count) {
+		vec[i].iov_base = (BYTE *)vec[i].iov_base + done;
+		vec[i].iov_len -= done;
+	}
+
+	// 途中までしか処理できなかった場合は残りを処理する
+	retry = FALSE;
+	while (i < req->count) {
+		if (req->write) {
+			len = pwritev(handle, &vec[i], req->count - i, offset);
+		} else {
+			len = preadv(handle, &vec[i], req->count - i, offset);
+		}
+		if (len < 0 && !retry && DirectFallback()) {
+			retry = TRUE;
+			continue;
+		}
+		if (len <= 0) {
+			return FALSE;
+		}
+		offset += len;
+		while (i < req->count && (size_t)len >= vec[i].iov_len) {
+			len -= vec[i].iov_len;
+			i++;
+		}
+		if (i < req->count) {
+			vec[i].iov_base = (BYTE *)vec[i].iov_base + len;
+			vec[i].iov_len -= len;
+		}
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/Oエンジン起動
+//	※io_uringを使用し、使えなければワーカスレッドで処理する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::StartAsync()
+{
+	async_t *aio;
+	pthread_attr_t attr;
+	struct sched_param schedparam;
+#ifdef HAVE_IO_URING
+	struct io_uring_params params;
+	int fd;
+#endif	// HAVE_IO_URING
+
+	ASSERT(this);
+	ASSERT(!m_pAsync);
+
+	aio = (async_t *)calloc(1, sizeof(async_t));
+	if (!aio) {
+		return FALSE;
+	}
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->cond, NULL);
+	aio->ring = -1;
+	m_pAsync = aio;
+
+#ifdef HAVE_IO_URING
+	// リングを生成(カーネルが未対応なら失敗する)
+	memset(&params, 0, sizeof(params));
+	fd = (int)syscall(__NR_io_uring_setup, AsyncMax, &params);
+	if (fd >= 0) {
+		aio->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		aio->cq_len = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+		aio->sqe_len = params.sq_entries * sizeof(struct io_uring_sqe);
+		aio->sq_ptr = (BYTE *)mmap(NULL, aio->sq_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQ_RING);
+		aio->cq_ptr = (BYTE *)mmap(NULL, aio->cq_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_CQ_RING);
+		aio->sqe_ptr = (BYTE *)mmap(NULL, aio->sqe_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQES);
+		if (aio->sq_ptr != MAP_FAILED && aio->cq_ptr != MAP_FAILED &&
+			aio->sqe_ptr != MAP_FAILED) {
+			aio->ring = fd;
+		} else {
+			// マップできなければワーカスレッドで処理する
+			if (aio->sq_ptr != MAP_FAILED) {
+				munmap(aio->sq_ptr, aio->sq_len);
+			}
+			if (aio->cq_ptr != MAP_FAILED) {
+				munmap(aio->cq_ptr, aio->cq_len);
+			}
+			if (aio->sqe_ptr != MAP_FAILED) {
+				munmap(aio->sqe_ptr, aio->sqe_len);
+			}
+			close(fd);
+		}
+	}
+	if (aio->ring >= 0) {
+		aio->sq_tail = (unsigned *)(aio->sq_ptr + params.sq_off.tail);
+		aio->sq_mask = (unsigned *)(aio->sq_ptr + params.sq_off.ring_mask);
+		aio->sq_array = (unsigned *)(aio->sq_ptr + params.sq_off.array);
+		aio->cq_head = (unsigned *)(aio->cq_ptr + params.cq_off.head);
+		aio->cq_tail = (unsigned *)(aio->cq_ptr + params.cq_off.tail);
+		aio->cq_mask = (unsigned *)(aio->cq_ptr + params.cq_off.ring_mask);
+		aio->cqes = aio->cq_ptr + params.cq_off.cqes;
+		return TRUE;
+	}
+#endif	// HAVE_IO_URING
+
+	// ワーカスレッドを通常スケジューリングで生成
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	schedparam.sched_priority = 0;
+	pthread_attr_setschedparam(&attr, &schedparam);
+	aio->run = TRUE;
+	if (pthread_create(&aio->thread, &attr, AsyncThread, this) != 0) {
+		aio->run = FALSE;
+		pthread_attr_destroy(&attr);
+		StopAsync();
+		return FALSE;
+	}
+	pthread_attr_destroy(&attr);
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	非同期I/Oエンジン停止
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::StopAsync()
+{
+	async_t *aio;
+
+	ASSERT(this);
+
+	aio = m_pAsync;
+	if (!aio) {
+		return;
+	}
+
+	// 実行中の要求を待つ
+	CompleteAll();
+
+	// ワーカスレッドを停止
+	if (aio->run) {
+		pthread_mutex_lock(&aio->lock);
+		aio->run = FALSE;
+		pthread_cond_broadcast(&aio->cond);
+		pthread_mutex_unlock(&aio->lock);
+		pthread_join(aio->thread, NULL);
+	}
+
+	// リングを解放
+	if (aio->ring >= 0) {
+		munmap(aio->sq_ptr, aio->sq_len);
+		munmap(aio->cq_ptr, aio->cq_len);
+		munmap(aio->sqe_ptr, aio->sqe_len);
+		close(aio->ring);
+	}
+
+	pthread_cond_destroy(&aio->cond);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio);
+	m_pAsync = NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ワーカスレッド
+//
+//---------------------------------------------------------------------------
+void* Fileio::AsyncThread(void *param)
+{
+	Fileio *self;
+
+	self = (Fileio *)param;
+	ASSERT(self);
+
+	self->AsyncMain();
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ワーカスレッド主処理
+//	※要求された順に同期実行する
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::AsyncMain()
+{
+	int id;
+	BOOL result;
+	asyncreq_t *req;
+
+	ASSERT(this);
+	ASSERT(m_pAsync);
+
+	pthread_mutex_lock(&m_pAsync->lock);
+	while (m_pAsync->run) {
+		// 要求を探す
+		for (id = 0; id < AsyncMax; id++) {
+			if (m_pAsync->req[id].state == AsyncQueued) {
+				break;
+			}
+		}
+
+		// 要求がなければ待つ
+		if (id >= AsyncMax) {
+			pthread_cond_wait(&m_pAsync->cond, &m_pAsync->lock);
+			continue;
+		}
+
+		// ロック外で実行
+		req = &m_pAsync->req[id];
+		req->state = AsyncRunning;
+		pthread_mutex_unlock(&m_pAsync->lock);
+		result = Execute(req, 0);
+		pthread_mutex_lock(&m_pAsync->lock);
+
+		// 結果を通知
+		req->result = result;
+		req->state = AsyncDone;
+		pthread_cond_broadcast(&m_pAsync->cond);
+	}
+	pthread_mutex_unlock(&m_pAsync->lock);
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮イメージの識別子
+//
+//---------------------------------------------------------------------------
+static const char ChunkMagic[16] = "RaSCSI CHUNK";
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮イメージ判定と準備
+//	※ヘッダの識別子が一致すれば索引を読み込む。通常のファイルならTRUE
+//	  (識別子が一致してヘッダや索引が壊れている場合のみFALSE)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::OpenChunk()
+{
+	chunkhdr_t hdr;
+	chunk_t *p;
+	fsize_t size;
+	DWORD i;
+	DWORD len;
+	int count;
+
+	ASSERT(this);
+	ASSERT(handle >= 0);
+	ASSERT(!m_pChunk);
+
+	// ヘッダを読んで識別子を比較
+	count = pread(handle, &hdr, sizeof(hdr), 0);
+	if (count != (int)sizeof(hdr) ||
+		memcmp(hdr.magic, ChunkMagic, sizeof(hdr.magic)) != 0) {
+		return TRUE;
+	}
+
+	// ヘッダの確認(チャンク長は2のべき乗)
+	if (hdr.version != ChunkVersion ||
+		hdr.chunk < ChunkMin || hdr.chunk > ChunkMax ||
+		(hdr.chunk & (hdr.chunk - 1)) != 0 ||
+		hdr.num != (DWORD)((hdr.length + hdr.chunk - 1) / hdr.chunk) ||
+		hdr.num == 0) {
+		return FALSE;
+	}
+
+	// 管理ワークを確保
+	p = (chunk_t *)calloc(1, sizeof(chunk_t));
+	if (!p) {
+		return FALSE;
+	}
+	p->hdr = hdr;
+	for (i = 0; i < ChunkCache; i++) {
+		p->no[i] = (DWORD)-1;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	m_pChunk = p;
+
+	// 索引と圧縮データのバッファ
+	p->index = (UL64 *)malloc((hdr.num + 1) * sizeof(UL64));
+	p->comp = (BYTE *)malloc(hdr.chunk);
+	if (!p->index || !p->comp) {
+		CloseChunk();
+		return FALSE;
+	}
+
+	// 索引を読み込む
+	count = pread(handle, p->index,
+		(hdr.num + 1) * sizeof(UL64), sizeof(hdr));
+	if (count != (int)((hdr.num + 1) * sizeof(UL64))) {
+		CloseChunk();
+		return FALSE;
+	}
+
+	// 索引の確認(位置は単調増加、圧縮長はチャンク長以下、ファイル内に収まる)
+	size = lseek(handle, 0, SEEK_END);
+	lseek(handle, 0, SEEK_SET);
+	for (i = 0; i < hdr.num; i++) {
+		len = hdr.chunk;
+		if (i == hdr.num - 1) {
+			len = (DWORD)(hdr.length - (UL64)i * hdr.chunk);
+		}
+		if (p->index[i + 1] < p->index[i] ||
+			p->index[i + 1] - p->index[i] > len) {
+			CloseChunk();
+			return FALSE;
+		}
+	}
+	if (p->index[hdr.num] > (UL64)size) {
+		CloseChunk();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮イメージ解放
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::CloseChunk()
+{
+	int i;
+
+	ASSERT(this);
+
+	if (!m_pChunk) {
+		return;
+	}
+
+	for (i = 0; i < ChunkCache; i++) {
+		if (m_pChunk->buf[i]) {
+			free(m_pChunk->buf[i]);
+		}
+	}
+	if (m_pChunk->comp) {
+		free(m_pChunk->comp);
+	}
+	if (m_pChunk->index) {
+		free(m_pChunk->index);
+	}
+	pthread_mutex_destroy(&m_pChunk->lock);
+	free(m_pChunk);
+	m_pChunk = NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮イメージ位置指定読み込み
+//	※展開後の位置で指定する。チャンク全体を読む場合はキャッシュを経由せず
+//	  直接展開する(トラックキャッシュが前にあるので再利用は少ない)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::ReadChunk(void *buffer, int size, fsize_t offset)
+{
+	BYTE *dst;
+	BYTE *src;
+	DWORD no;
+	DWORD pos;
+	DWORD len;
+	DWORD full;
+	DWORD chunk;
+	BOOL result;
+
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_pChunk);
+
+	// 範囲外
+	if ((UL64)offset + size > m_pChunk->hdr.length) {
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&m_pChunk->lock);
+
+	dst = (BYTE *)buffer;
+	chunk = m_pChunk->hdr.chunk;
+	result = TRUE;
+	while (size > 0) {
+		// チャンク番号とチャンク内の位置、今回の長さ
+		no = (DWORD)(offset / chunk);
+		pos = (DWORD)(offset % chunk);
+		full = chunk;
+		if (no == m_pChunk->hdr.num - 1) {
+			full = (DWORD)(m_pChunk->hdr.length - (UL64)no * chunk);
+		}
+		len = full - pos;
+		if (len > (DWORD)size) {
+			len = (DWORD)size;
+		}
+
+		if (pos == 0 && len == full) {
+			// チャンク全体なら直接展開
+			if (!InflateChunk(no, dst)) {
+				result = FALSE;
+				break;
+			}
+		} else {
+			// 展開済みチャンクから複写
+			src = LoadChunk(no);
+			if (!src) {
+				result = FALSE;
+				break;
+			}
+			memcpy(dst, &src[pos], len);
+		}
+
+		dst += len;
+		offset += len;
+		size -= (int)len;
+	}
+
+	pthread_mutex_unlock(&m_pChunk->lock);
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	展開済みチャンク取得(ロック済み)
+//	※キャッシュに無ければ最も古いものを置き換えて展開する
+//
+//---------------------------------------------------------------------------
+BYTE* FASTCALL Fileio::LoadChunk(DWORD no)
+{
+	int i;
+	int c;
+
+	ASSERT(this);
+	ASSERT(m_pChunk);
+	ASSERT(no < m_pChunk->hdr.num);
+
+	// キャッシュ検索
+	m_pChunk->seq++;
+	c = 0;
+	for (i = 0; i < ChunkCache; i++) {
+		if (m_pChunk->buf[i] && m_pChunk->no[i] == no) {
+			m_pChunk->serial[i] = m_pChunk->seq;
+			return m_pChunk->buf[i];
+		}
+
+		// 未使用か、最も古いもの
+		if (!m_pChunk->buf[c]) {
+			continue;
+		}
+		if (!m_pChunk->buf[i] ||
+			(m_pChunk->seq - m_pChunk->serial[i]) >
+			(m_pChunk->seq - m_pChunk->serial[c])) {
+			c = i;
+		}
+	}
+
+	// バッファを確保
+	if (!m_pChunk->buf[c]) {
+		m_pChunk->buf[c] = (BYTE *)malloc(m_pChunk->hdr.chunk);
+		if (!m_pChunk->buf[c]) {
+			return NULL;
+		}
+	}
+
+	// 展開
+	if (!InflateChunk(no, m_pChunk->buf[c])) {
+		m_pChunk->no[c] = (DWORD)-1;
+		return NULL;
+	}
+	m_pChunk->no[c] = no;
+	m_pChunk->serial[c] = m_pChunk->seq;
+
+	return m_pChunk->buf[c];
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク展開(ロック済み)
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::InflateChunk(DWORD no, BYTE *buffer)
+{
+	DWORD len;
+	DWORD comp;
+	int count;
+
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(m_pChunk);
+	ASSERT(no < m_pChunk->hdr.num);
+
+	// 展開後の長さ(最終チャンクは端数)と圧縮長
+	len = m_pChunk->hdr.chunk;
+	if (no == m_pChunk->hdr.num - 1) {
+		len = (DWORD)(m_pChunk->hdr.length - (UL64)no * len);
+	}
+	comp = (DWORD)(m_pChunk->index[no + 1] - m_pChunk->index[no]);
+
+	// 全て0
+	if (comp == 0) {
+		memset(buffer, 0, len);
+		return TRUE;
+	}
+
+	// 無圧縮
+	if (comp == len) {
+		count = pread(handle, buffer, len, m_pChunk->index[no]);
+		return (BOOL)(count == (int)len);
+	}
+
+	// 圧縮データを読み込んで展開
+	count = pread(handle, m_pChunk->comp, comp, m_pChunk->index[no]);
+	if (count != (int)comp) {
+		return FALSE;
+	}
+	return Decompress(m_pChunk->comp, (int)comp, buffer, (int)len);
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮イメージのヘッダ作成
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::InitChunkHeader(
+	chunkhdr_t *hdr, DWORD chunk, fsize_t length)
+{
+	ASSERT(hdr);
+	ASSERT((chunk >= ChunkMin) && (chunk <= ChunkMax));
+	ASSERT(length > 0);
+
+	memset(hdr, 0, sizeof(chunkhdr_t));
+	memcpy(hdr->magic, ChunkMagic, sizeof(hdr->magic));
+	hdr->version = ChunkVersion;
+	hdr->chunk = chunk;
+	hdr->num = (DWORD)((length + chunk - 1) / chunk);
+	hdr->length = (UL64)length;
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク圧縮
+//	※LZ4のブロック形式。圧縮長を返し、dstmaxに収まらなければ0
+//
+//---------------------------------------------------------------------------
+int FASTCALL Fileio::Compress(
+	const BYTE *src, int srclen, BYTE *dst, int dstmax)
+{
+	enum {
+		HashBits = 12,					// ハッシュのビット数
+		MinMatch = 4,					// 最短一致長
+		LastLiterals = 5,				// 末尾に必ず残すリテラル長
+		MatchLimit = 12					// 一致を探す終端(末尾からの距離)
+	};
+	int table[1 << HashBits];
+	int ip;
+	int op;
+	int anchor;
+	int ref;
+	int len;
+	int lit;
+	int n;
+	UINT seq;
+	UINT h;
+	BYTE *token;
+
+	ASSERT(src);
+	ASSERT(srclen > 0);
+	ASSERT(dst);
+
+	memset(table, 0xff, sizeof(table));
+	ip = 0;
+	op = 0;
+	anchor = 0;
+
+	// 一致を探して、リテラルと一致のシーケンスを出力
+	while (srclen >= MatchLimit && ip < srclen - MatchLimit) {
+		memcpy(&seq, &src[ip], sizeof(seq));
+		h = (seq * 2654435761U) >> (32 - HashBits);
+		ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > 0xffff ||
+			memcmp(&src[ref], &src[ip], MinMatch) != 0) {
+			ip++;
+			continue;
+		}
+
+		// 一致長を延ばす
+		len = MinMatch;
+		while (ip + len < srclen - LastLiterals && src[ref + len] == src[ip + len]) {
+			len++;
+		}
+
+		// 出力長の確認(トークン、長さ拡張、リテラル、オフセット)
+		lit = ip - anchor;
+		if (op + 1 + (lit / 255) + 1 + lit + 2 + (len / 255) + 1 > dstmax) {
+			return 0;
+		}
+
+		// トークン
+		token = &dst[op++];
+		*token = (BYTE)(((lit < 15) ? lit : 15) << 4);
+
+		// リテラル長の拡張とリテラル
+		if (lit >= 15) {
+			for (n = lit - 15; n >= 255; n -= 255) {
+				dst[op++] = 255;
+			}
+			dst[op++] = (BYTE)n;
+		}
+		memcpy(&dst[op], &src[anchor], lit);
+		op += lit;
+
+		// オフセット
+		dst[op++] = (BYTE)(ip - ref);
+		dst[op++] = (BYTE)((ip - ref) >> 8);
+
+		// 一致長の拡張
+		n = len - MinMatch;
+		*token |= (BYTE)((n < 15) ? n : 15);
+		if (n >= 15) {
+			for (n -= 15; n >= 255; n -= 255) {
+				dst[op++] = 255;
+			}
+			dst[op++] = (BYTE)n;
+		}
+
+		ip += len;
+		anchor = ip;
+	}
+
+	// 最後のリテラル
+	lit = srclen - anchor;
+	if (op + 1 + (lit / 255) + 1 + lit > dstmax) {
+		return 0;
+	}
+	dst[op++] = (BYTE)(((lit < 15) ? lit : 15) << 4);
+	if (lit >= 15) {
+		for (n = lit - 15; n >= 255; n -= 255) {
+			dst[op++] = 255;
+		}
+		dst[op++] = (BYTE)n;
+	}
+	memcpy(&dst[op], &src[anchor], lit);
+	op += lit;
+
+	return op;
+}
+
+//---------------------------------------------------------------------------
+//
+//	チャンク展開
+//	※LZ4のブロック形式。ちょうどdstlenに展開できた場合のみTRUE
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Decompress(
+	const BYTE *src, int srclen, BYTE *dst, int dstlen)
+{
+	int ip;
+	int op;
+	int len;
+	int off;
+	BYTE token;
+	BYTE b;
+
+	ASSERT(src);
+	ASSERT(srclen > 0);
+	ASSERT(dst);
+
+	ip = 0;
+	op = 0;
+	while (ip < srclen) {
+		token = src[ip++];
+
+		// リテラル長
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= srclen) {
+					return FALSE;
+				}
+				b = src[ip++];
+				len += b;
+			} while (b == 255);
+		}
+
+		// リテラル
+		if (len > srclen - ip || len > dstlen - op) {
+			return FALSE;
+		}
+		memcpy(&dst[op], &src[ip], len);
+		ip += len;
+		op += len;
+
+		// 最後のシーケンスはリテラルのみ
+		if (ip >= srclen) {
+			break;
+		}
+
+		// オフセット
+		if (ip + 2 > srclen) {
+			return FALSE;
+		}
+		off = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (off == 0 || off > op) {
+			return FALSE;
+		}
+
+		// 一致長
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= srclen) {
+					return FALSE;
+				}
+				b = src[ip++];
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (len > dstlen - op) {
+			return FALSE;
+		}
+
+		// 一致部分の複写(重なる場合は1バイトずつ)
+		if (off >= len) {
+			memcpy(&dst[op], &dst[op - off], len);
+			op += len;
+		} else {
+			while (len-- > 0) {
+				dst[op] = dst[op - off];
+				op++;
+			}
+		}
+	}
+
+	return (BOOL)(op == dstlen);
+}
+
+//---------------------------------------------------------------------------
+//
+//	クローズ
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::Close()
+{
+	ASSERT(this);
+	ASSERT(m_bOpen);
+
+	// メモリマップ解除
+	Unmap();
+
+	// 非同期I/Oの完了を待つ
+	CompleteAll();
+
+	// ダイレクトI/O解除(ハンドルは再オープンで使い回す)
+	if (m_bDirectReq) {
+		SetDirect(FALSE);
+	}
+
+	// 先頭にシーク
+	lseek(handle, 0, SEEK_SET);
+	m_position = 0;
+
+	// クローズ
+	m_bOpen = FALSE;
+}
+#else
+//---------------------------------------------------------------------------
+//
+//	コンストラクタ
+//
+//---------------------------------------------------------------------------
+Fileio::Fileio()
+{
+	// ワーク初期化
+	handle.obj.fs = 0;
+	m_bOpen = FALSE;
+	m_szPath[0] = '\0';
+	m_position = 0;
+	m_pMap = NULL;
+	m_MapSize = 0;
+}
+
+//---------------------------------------------------------------------------
+//
+//	デストラクタ
+//
+//---------------------------------------------------------------------------
+Fileio::~Fileio()
+{
+	// 解放
+	if (handle.obj.fs) {
+		f_close(&handle);
+	}
+}
+
+//---------------------------------------------------------------------------
+//
+//	ロード
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Load(const Filepath& path, void *buffer, int size)
+{
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(!m_bOpen);
+
+	// オープン
+	if (!Open(path, ReadOnly)) {
+		return FALSE;
+	}
+
+	// 読み込み
+	if (!Read(buffer, size)) {
+		Close();
+		return FALSE;
+	}
+
+	// クローズ
+	Close();
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	セーブ
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Save(const Filepath& path, void *buffer, int size)
+{
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(!m_bOpen);
+
+	// オープン
+	if (!Open(path, WriteOnly)) {
+		return FALSE;
+	}
+
+	// 書き込み
+	if (!Write(buffer, size)) {
+		Close();
+		return FALSE;
+	}
+
+	// クローズ
+	Close();
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	オープン
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Open(LPCTSTR fname, OpenMode mode)
+{
+	FRESULT fr;
+	Filepath fpath;
+
+	ASSERT(this);
+	ASSERT(fname);
+	ASSERT(!m_bOpen);
+
+	// ヌル文字列からの読み込みは必ず失敗させる
+	if (fname[0] == _T('\0')) {
+		return FALSE;
+	}
+
+	// キャッシュファイルと同一か
+	if (handle.obj.fs) {
+		if (strcmp(fname, m_szPath) == 0 && mode == m_Mode) {
+			m_bOpen = TRUE;
+			return TRUE;
+		}
+	}
+
+	// キャッシュファイルを解放
+	f_close(&handle);
+	handle.obj.fs = 0;
+	m_bOpen = FALSE;
+	m_szPath[0] = '\0';
+	m_position = 0;
+
+	// モード別
+	switch (mode) {
+		// 読み込みのみ
+		case ReadOnly:
+			fr = f_open(&handle, fname, FA_READ);
+			break;
+
+		// 書き込みのみ
+		case WriteOnly:
+			fr = f_open(&handle, fname, FA_CREATE_ALWAYS | FA_WRITE);
+			break;
+
+		// 読み書き両方
+		case ReadWrite:
+			fr = f_open(&handle, fname, FA_READ | FA_WRITE);
+			break;
+
+		// アペンド
+		case Append:
+			fr = f_open(&handle, fname, FA_OPEN_APPEND | FA_WRITE);
+			break;
+
+		// それ以外
+		default:
+			fr = FR_NO_PATH;
+			ASSERT(FALSE);
+			break;
+	}
+
+	// 結果評価
+	if (fr != FR_OK) {
+		return FALSE;
+	}
+
+	// リンクマップテーブル生成
+	handle.cltbl = cltbl;
+	cltbl[0] = sizeof(cltbl) / sizeof(DWORD);
+	fr = f_lseek(&handle, CREATE_LINKMAP);
+	if (fr != FR_OK) {
+		f_close(&handle);
+		handle.obj.fs = 0;
+		return FALSE;
+	}
+
+	// パスとモードを保存
+	m_bOpen = TRUE;
+	strcpy(m_szPath, (LPTSTR)fname);
+	m_Mode = mode;
+
+	// オープン成功
+	ASSERT(handle.obj.fs);
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	オープン
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Open(const Filepath& path, OpenMode mode)
+{
+	ASSERT(this);
+
+	return Open(path.GetPath(), mode);
+}
+
+//---------------------------------------------------------------------------
+//
+//	1行読み込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::ReadLine(LPTSTR buffer, int size)
+{
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(m_bOpen);
+
+	// 読み込み
+	if (f_gets(buffer, size -1, &handle) == NULL) {
+		return FALSE;
+	}
+
+	// 現在値を更新
+	m_position = (fsize_t)f_tell(&handle);
+
 	return TRUE;
 }
 
@@ -654,6 +2193,77 @@ BOOL FASTCALL Fileio::Write(const void *buffer, int size)
 	return TRUE;
 }
 
+//---------------------------------------------------------------------------
+//
+//	位置指定読み込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::ReadAt(void *buffer, int size, fsize_t offset)
+{
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// FatFsにはpreadが無いのでシークして読み込む
+	if (!Seek(offset)) {
+		return FALSE;
+	}
+
+	return Read(buffer, size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定書き込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::WriteAt(const void *buffer, int size, fsize_t offset)
+{
+	ASSERT(this);
+	ASSERT(buffer);
+	ASSERT(size > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// FatFsにはpwriteが無いのでシークして書き込む
+	if (!Seek(offset)) {
+		return FALSE;
+	}
+
+	return Write(buffer, size);
+}
+
+//---------------------------------------------------------------------------
+//
+//	位置指定ベクタ書き込み
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::WriteVAt(const struct iovec *iov, int count, fsize_t offset)
+{
+	int i;
+
+	ASSERT(this);
+	ASSERT(iov);
+	ASSERT(count > 0);
+	ASSERT(offset >= 0);
+	ASSERT(m_bOpen);
+
+	// FatFsにはpwritevが無いのでシークして順に書き込む
+	if (!Seek(offset)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!Write(iov[i].iov_base, (int)iov[i].iov_len)) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 //---------------------------------------------------------------------------
 //
 //	シーク
@@ -715,6 +2325,121 @@ fsize_t FASTCALL Fileio::GetFilePos() const
 	return m_position;
 }
 
+//---------------------------------------------------------------------------
+//
+//	メモリマップ
+//	※FatFsではサポートしない
+//
+//---------------------------------------------------------------------------
+BYTE* FASTCALL Fileio::Map(BOOL /*write*/)
+{
+	ASSERT(this);
+
+	return NULL;
+}
+
+//---------------------------------------------------------------------------
+//
+//	メモリマップ解除
+//
+//---------------------------------------------------------------------------
+void FASTCALL Fileio::Unmap()
+{
+	ASSERT(this);
+}
+
+//---------------------------------------------------------------------------
+//
+//	メモリマップ同期
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Sync(
+	fsize_t /*offset*/, fsize_t /*length*/, BOOL /*wait*/)
+{
+	ASSERT(this);
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	書き込み内容を媒体へ反映
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Flush()
+{
+	ASSERT(this);
+	ASSERT(m_bOpen);
+
+	if (f_sync(&handle) != FR_OK) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ファイルサイズ切り詰め
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::Truncate(fsize_t size)
+{
+	ASSERT(this);
+	ASSERT(m_bOpen);
+	ASSERT(size >= 0);
+
+	// 切り詰める位置にシークして切り詰め
+	if (!Seek(size)) {
+		return FALSE;
+	}
+	if (f_truncate(&handle) != FR_OK) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	範囲のゼロ化
+//	※FatFsには穴開けの仕組みがないので、呼び出し側でゼロを書き込むこと
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::ZeroAt(
+	fsize_t /*offset*/, fsize_t /*length*/, BOOL /*unmap*/)
+{
+	ASSERT(this);
+	ASSERT(m_bOpen);
+
+	return FALSE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	領域の解放(穴開け)に対応しているか
+//	※FatFsには穴開けの仕組みがない
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL Fileio::CanPunchHole()
+{
+	ASSERT(this);
+	ASSERT(m_bOpen);
+
+	return FALSE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ダイレクトI/O用バッファ確保
+//	※キャッシュを経由しないFatFsでは通常の確保で良い
+//
+//---------------------------------------------------------------------------
+void* FASTCALL Fileio::AllocBuffer(size_t length)
+{
+	return malloc(length);
+}
+
 //---------------------------------------------------------------------------
 //
 //	クローズ
@@ -20,6 +20,12 @@
 #ifdef BAREMETAL
 #include "ff.h"
 #define fsize_t FSIZE_t
+
+// ベクタ書き込み用(sys/uio.h相当)
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
 #else
 #define fsize_t off_t
 #endif	// BAREMETAL
@@ -39,6 +45,101 @@ public:
 		Append							// アペンド
 	};
 
+	// ベクタ書き込みで一度に渡すバッファ数
+	enum {
+		WriteVMax = 64
+	};
+
+	// ダイレクトI/O(O_DIRECT)
+	enum {
+		DirectBlock = 512,				// オフセットと長さの境界(最小)
+		DirectAlign = 4096				// バッファの境界
+	};
+
+#ifndef BAREMETAL
+	// 非同期I/O
+	enum {
+		AsyncMax = 8					// 同時に要求できる非同期I/O数
+	};
+
+	// 非同期I/O状態
+	enum {
+		AsyncFree,						// 未使用
+		AsyncQueued,					// 要求済み(ワーカスレッド待ち)
+		AsyncRunning,					// 実行中
+		AsyncDone						// 完了
+	};
+
+	// 非同期I/O要求
+	typedef struct {
+		int state;						// 状態
+		BOOL write;						// 書き込み
+		struct iovec iov[WriteVMax];	// バッファ
+		int count;						// バッファ数
+		fsize_t offset;					// ファイルオフセット
+		size_t length;					// 合計長
+		BOOL result;					// 結果
+	} asyncreq_t;
+
+	// 非同期I/Oエンジン
+	typedef struct {
+		asyncreq_t req[AsyncMax];		// 要求
+		pthread_mutex_t lock;			// ロック
+		pthread_cond_t cond;			// 条件変数
+		BOOL reaping;					// 完了待ち中のスレッドあり
+		int ring;						// io_uring(-1ならワーカスレッド)
+		BYTE *sq_ptr;					// 投入キュー(リング)
+		size_t sq_len;					// 投入キュー長
+		BYTE *cq_ptr;					// 完了キュー(リング)
+		size_t cq_len;					// 完了キュー長
+		BYTE *sqe_ptr;					// 投入エントリ
+		size_t sqe_len;					// 投入エントリ長
+		unsigned *sq_tail;				// 投入キュー末尾
+		unsigned *sq_mask;				// 投入キューマスク
+		unsigned *sq_array;				// 投入キュー配列
+		unsigned *cq_head;				// 完了キュー先頭
+		unsigned *cq_tail;				// 完了キュー末尾
+		unsigned *cq_mask;				// 完了キューマスク
+		BYTE *cqes;						// 完了エントリ
+		BOOL run;						// ワーカスレッド動作中
+		pthread_t thread;				// ワーカスレッド
+	} async_t;
+
+	// チャンク圧縮イメージ
+	enum {
+		ChunkVersion = 1,				// バージョン
+		ChunkDef = 0x10000,				// チャンク長(既定値)
+		ChunkMin = 0x1000,				// チャンク長(最小)
+		ChunkMax = 0x100000,			// チャンク長(最大)
+		ChunkCache = 4					// 展開済みチャンクのキャッシュ数
+	};
+
+	// チャンク圧縮イメージのヘッダ
+	// ※機種によらず同じ配置になるよう固定長の型を使う
+	//   直後に各チャンクのファイル上の位置(UL64×チャンク数+1)が続く
+	//   位置の差が圧縮長で、0なら全て0、チャンク長と同じなら無圧縮
+	typedef struct {
+		char magic[16];					// 識別子
+		UINT version;					// バージョン
+		UINT chunk;						// チャンク長
+		UINT num;						// チャンク数
+		UINT reserved;					// 予約
+		UL64 length;					// 展開後のサイズ
+	} chunkhdr_t;
+
+	// チャンク圧縮イメージ管理
+	typedef struct {
+		chunkhdr_t hdr;					// ヘッダ
+		UL64 *index;					// チャンクの位置
+		BYTE *comp;						// 圧縮データの読み込みバッファ
+		BYTE *buf[ChunkCache];			// 展開済みチャンク
+		DWORD no[ChunkCache];			// 展開済みチャンクの番号
+		DWORD serial[ChunkCache];		// 最終アクセスシリアル
+		DWORD seq;						// アクセスシリアル
+		pthread_mutex_t lock;			// ロック
+	} chunk_t;
+#endif	// BAREMETAL
+
 public:
 	Fileio();
 										// コンストラクタ
@@ -61,12 +162,73 @@ public:
 										// 読み込み
 	BOOL FASTCALL Write(const void *buffer, int size);
 										// 書き込み
+	BOOL FASTCALL ReadAt(void *buffer, int size, fsize_t offset);
+										// 位置指定読み込み
+	BOOL FASTCALL WriteAt(const void *buffer, int size, fsize_t offset);
+										// 位置指定書き込み
+	BOOL FASTCALL WriteVAt(const struct iovec *iov, int count, fsize_t offset);
+										// 位置指定ベクタ書き込み
 	fsize_t FASTCALL GetFileSize();
 										// ファイルサイズ取得
 	fsize_t FASTCALL GetFilePos() const;
 										// ファイル位置取得
 	void FASTCALL Close();
 										// クローズ
+	BOOL FASTCALL IsOpen() const		{ return m_bOpen; }
+										// オープン状態チェック
+	BYTE* FASTCALL Map(BOOL write);
+										// メモリマップ
+	void FASTCALL Unmap();
+										// メモリマップ解除
+	BOOL FASTCALL Sync(fsize_t offset, fsize_t length, BOOL wait = FALSE);
+										// メモリマップ同期
+	BOOL FASTCALL Flush();
+										// 書き込み内容を媒体へ反映
+	BOOL FASTCALL Truncate(fsize_t size);
+										// ファイルサイズ切り詰め
+	BOOL FASTCALL ZeroAt(fsize_t offset, fsize_t length, BOOL unmap);
+										// 範囲のゼロ化(ファイルシステムに依頼)
+	BOOL FASTCALL CanPunchHole();
+										// 領域の解放(穴開け)に対応しているか
+	static void* FASTCALL AllocBuffer(size_t length);
+										// ダイレクトI/O用バッファ確保(freeで解放)
+#ifndef BAREMETAL
+	BOOL FASTCALL SetDirect(BOOL enable);
+										// ダイレクトI/O設定
+	BOOL FASTCALL IsDirect() const		{ return __atomic_load_n(&m_bDirect, __ATOMIC_ACQUIRE); }
+										// ダイレクトI/O取得
+#else
+	BOOL FASTCALL IsDirect() const		{ return FALSE; }
+										// ダイレクトI/O取得
+#endif	// BAREMETAL
+#ifndef BAREMETAL
+	BOOL FASTCALL GetFileId(dev_t& dev, ino_t& ino) const;
+										// ファイル識別子(デバイス、iノード)取得
+	int FASTCALL SubmitReadAt(void *buffer, int size, fsize_t offset);
+										// 非同期位置指定読み込み要求
+	int FASTCALL SubmitWriteVAt(
+		const struct iovec *iov, int count, fsize_t offset);
+										// 非同期位置指定ベクタ書き込み要求
+	BOOL FASTCALL Complete(int id);
+										// 非同期I/O完了待ち
+	BOOL FASTCALL IsComplete(int id);
+										// 非同期I/O完了チェック
+	void FASTCALL CompleteAll();
+										// 全非同期I/O完了待ち
+	BOOL FASTCALL IsUring() const		{ return (BOOL)(m_pAsync && m_pAsync->ring >= 0); }
+										// io_uring使用中か
+	BOOL FASTCALL IsChunk() const		{ return (BOOL)(m_pChunk != NULL); }
+										// チャンク圧縮イメージか
+	static void FASTCALL InitChunkHeader(
+		chunkhdr_t *hdr, DWORD chunk, fsize_t length);
+										// チャンク圧縮イメージのヘッダ作成
+	static int FASTCALL Compress(
+		const BYTE *src, int srclen, BYTE *dst, int dstmax);
+										// チャンク圧縮
+	static BOOL FASTCALL Decompress(
+		const BYTE *src, int srclen, BYTE *dst, int dstlen);
+										// チャンク展開
+#endif	// BAREMETAL
 #ifndef BAREMETAL
 	BOOL FASTCALL IsValid() const		{ return (BOOL)(handle != -1); }
 #else
@@ -76,6 +238,39 @@ public:
 
 private:
 #ifndef BAREMETAL
+	// 非同期I/O
+	BOOL FASTCALL StartAsync();
+										// 非同期I/Oエンジン起動
+	void FASTCALL StopAsync();
+										// 非同期I/Oエンジン停止
+	int FASTCALL SubmitVAt(
+		BOOL write, const struct iovec *iov, int count, fsize_t offset);
+										// 非同期I/O要求
+	int FASTCALL Submit(int id);
+										// 非同期I/O投入(ロック済み)
+	void FASTCALL Reap();
+										// io_uring完了キュー回収(ロック済み)
+	BOOL FASTCALL Execute(asyncreq_t *req, size_t done);
+										// 同期実行(残り部分)
+	BOOL FASTCALL DirectFallback();
+										// ダイレクトI/O解除(境界違反時)
+	static void* AsyncThread(void *param);
+										// ワーカスレッド
+	void FASTCALL AsyncMain();
+										// ワーカスレッド主処理
+
+	// チャンク圧縮イメージ
+	BOOL FASTCALL OpenChunk();
+										// 判定と準備
+	void FASTCALL CloseChunk();
+										// 解放
+	BOOL FASTCALL ReadChunk(void *buffer, int size, fsize_t offset);
+										// 位置指定読み込み
+	BYTE* FASTCALL LoadChunk(DWORD no);
+										// 展開済みチャンク取得(ロック済み)
+	BOOL FASTCALL InflateChunk(DWORD no, BYTE *buffer);
+										// チャンク展開(ロック済み)
+
 	int handle;							// ファイルハンドル
 #else
 	FIL handle;							// ファイルハンドル
@@ -91,6 +286,20 @@ private:
 										// オープンモード
 	fsize_t m_position;
 										// カレントポジション
+	BYTE *m_pMap;
+										// メモリマップ
+	fsize_t m_MapSize;
+										// メモリマップサイズ
+#ifndef BAREMETAL
+	async_t *m_pAsync;
+										// 非同期I/Oエンジン(初回要求時に生成)
+	BOOL m_bDirectReq;
+										// ダイレクトI/O要求
+	BOOL m_bDirect;
+										// ダイレクトI/O中(境界違反で解除)
+	chunk_t *m_pChunk;
+										// チャンク圧縮イメージ(通常のファイルはNULL)
+#endif	// BAREMETAL
 };
 
 #endif	// fileio_h
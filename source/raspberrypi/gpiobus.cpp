@@ -962,12 +962,8 @@ int FASTCALL GPIOBUS::CommandHandShake(BYTE *buf)
 		goto irq_enable_exit;
 	}
 
-	// コマンドが6バイトか10バイトか見分ける
-	if (*buf >= 0x20 && *buf <= 0x7D) {
-		count = 10;
-	} else {
-		count = 6;
-	}
+	// コマンドのバイト数(6/10/12/16)を見分ける
+	count = GetCommandByteCount(*buf);
 
 	// 次データへ
 	buf++;
@@ -1569,12 +1565,158 @@ void FASTCALL GPIOBUS::OutputReqPulse()
 }
 #endif	// USE_SYNC_TRANS == 1
 
+//---------------------------------------------------------------------------
+//
+//	リセレクションハンドシェイク
+//	※アービトレーションからSELアサートまでのみIRQを禁止する
+//
+//---------------------------------------------------------------------------
+BOOL FASTCALL GPIOBUS::ReselectHandShake(int id, int initiator)
+{
+	DWORD now;
+	BOOL ret;
+
+	ASSERT((id >= 0) && (id < 8));
+	ASSERT((initiator >= 0) && (initiator < 8));
+
+	// ターゲットモードのみ
+	if (actmode != TARGET) {
+		return FALSE;
+	}
+
+	// バスフリーを確認(バスセトルディレイ後にもう一度)
+	Aquire();
+	if (GetBSY() || GetSEL()) {
+		return FALSE;
+	}
+	SysTimer::SleepNsec(800);
+	Aquire();
+	if (GetBSY() || GetSEL()) {
+		return FALSE;
+	}
+
+	// IRQ無効
+	DisableIRQ();
+
+	// アービトレーション(BSYと自分のIDを出す)
+	SetBSY(TRUE);
+	SetDataDirection(DATA_DIR_OUT);
+	SetDAT((BYTE)(1 << id));
+
+	// アービトレーションディレイ
+	SysTimer::SleepNsec(2400);
+
+	// SELが出ていれば負け(トランシーバ無しなら上位IDも見る)
+	Aquire();
+	ret = !GetSEL();
+#if PIN_DTD < 0
+	if ((GetDAT() & ~((1 << (id + 1)) - 1)) != 0) {
+		ret = FALSE;
+	}
+#endif	// PIN_DTD < 0
+	if (!ret) {
+		SetDAT(0);
+		SetDataDirection(DATA_DIR_IN);
+		SetBSY(FALSE);
+		EnableIRQ();
+		return FALSE;
+	}
+
+	// SELアサート
+	SetControl(PIN_IND, IND_OUT);
+	SetMode(PIN_SEL, OUT);
+	SetSignal(PIN_SEL, ON);
+
+	// バスクリアディレイ+バスセトルディレイ
+	SysTimer::SleepNsec(1200);
+
+	// 自分とイニシエータのIDを出してIOアサート
+	SetDAT((BYTE)((1 << id) | (1 << initiator)));
+	SetIO(TRUE);
+
+	// 信号線が安定するまでウェイトしてからBSYを離す
+	SysTimer::SleepNsec(GPIO_DATA_SETTLING);
+	SetSignal(PIN_BSY, OFF);
+
+	// IRQ有効(応答待ちは最大でタイムアウトまで掛かる)
+	EnableIRQ();
+
+	// イニシエータのBSY応答待ち
+	ret = FALSE;
+	now = SysTimer::GetTimerLow();
+	do {
+		AquireTarget();
+		if (GetRST()) {
+			break;
+		}
+		if (GetBSY()) {
+			ret = TRUE;
+			break;
+		}
+#if PIN_TAD >= 0
+		// ターゲット信号を入力にする間隔を空ける
+		SysTimer::SleepUsec(GPIO_RESEL_POLL);
+#endif	// PIN_TAD >= 0
+	} while ((SysTimer::GetTimerLow() - now) < GPIO_RESEL_TIMEOUT);
+
+	// BSYアサートしてSELを離す
+	if (ret) {
+		SetSignal(PIN_BSY, ON);
+	}
+	SetSignal(PIN_SEL, OFF);
+	SetMode(PIN_SEL, IN);
+	SetControl(PIN_IND, IND_IN);
+
+	// 応答が無ければバスを開放
+	if (!ret) {
+		SetIO(FALSE);
+		SetDAT(0);
+		SetBSY(FALSE);
+	}
+
+	return ret;
+}
+
+//---------------------------------------------------------------------------
+//
+//	ターゲット信号出力中の信号取得
+//	※TAD付きの基板はターゲット信号を一時的に入力にしてBSYを読む
+//	  (出力値は保持されるので出力に戻せば元の状態に復帰する)
+//
+//---------------------------------------------------------------------------
+void FASTCALL GPIOBUS::AquireTarget()
+{
+#if PIN_TAD >= 0
+	// GPIOを入力にしてからトランシーバの向きを変える
+	SetMode(PIN_BSY, IN);
+	SetMode(PIN_MSG, IN);
+	SetMode(PIN_CD, IN);
+	SetMode(PIN_REQ, IN);
+	SetMode(PIN_IO, IN);
+	SetControl(PIN_TAD, TAD_IN);
+	SysTimer::SleepNsec(GPIO_DATA_SETTLING);
+
+	Aquire();
+
+	// トランシーバの向きを戻してからGPIOを出力にする
+	SetControl(PIN_TAD, TAD_OUT);
+	SetMode(PIN_BSY, OUT);
+	SetMode(PIN_MSG, OUT);
+	SetMode(PIN_CD, OUT);
+	SetMode(PIN_REQ, OUT);
+	SetMode(PIN_IO, OUT);
+#else
+	Aquire();
+#endif	// PIN_TAD >= 0
+}
+
 //---------------------------------------------------------------------------
 //
 //	SEL信号イベントポーリング
+//	※timeoutはミリ秒(負なら無制限)
 //
 //---------------------------------------------------------------------------
-int FASTCALL GPIOBUS::PollSelectEvent()
+int FASTCALL GPIOBUS::PollSelectEvent(int timeout)
 {
 	// errnoクリア
 	errno = 0;
@@ -1616,8 +1758,11 @@ int FASTCALL GPIOBUS::PollSelectEvent()
 	ret = 0;
 
 	// 割り込み待ち
-	nfds = epoll_wait(epfd, epev, 2, -1);
-	if (nfds <= 0) {
+	nfds = epoll_wait(epfd, epev, 2, timeout);
+	if (nfds == 0) {
+		return 0;
+	}
+	if (nfds < 0) {
 		return -1;
 	}
 
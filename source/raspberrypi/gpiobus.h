@@ -500,6 +500,8 @@
 #define GPIO_DATA_SETTLING	50			// データバスが安定する時間(ns)
 #define GPIO_TIMEOUT_MAX	3000 * 1000	// 信号監視のタイムアウト(3sec相当)
 #define GPIO_WATCHDOG_MAX	(1 << 25)	// 信号監視の最大カウンタ(2sec相当)
+#define GPIO_RESEL_TIMEOUT	250 * 1000	// リセレクション応答のタイムアウト(250ms)
+#define GPIO_RESEL_POLL		10			// TAD付き基板のリセレクション応答確認間隔(us)
 
 //---------------------------------------------------------------------------
 //
@@ -613,9 +615,11 @@ public:
 	int FASTCALL ReceiveHandShake(
 		BYTE *buf, int count, int syncoffset = 0);
 										// 一括データ受信ハンドシェイク
+	BOOL FASTCALL ReselectHandShake(int id, int initiator);
+										// リセレクションハンドシェイク
 
 	// SEL信号割り込み関係
-	int FASTCALL PollSelectEvent();
+	int FASTCALL PollSelectEvent(int timeout = -1);
 										// SEL信号イベントポーリング
 	void FASTCALL ClearSelectEvent();
 										// SEL信号イベントクリア
@@ -634,6 +638,8 @@ private:
 										// SCSI出力信号値設定
 	BOOL FASTCALL WaitSignal(int pin, BOOL ast);
 										// 信号変化待ち
+	void FASTCALL AquireTarget();
+										// ターゲット信号出力中の信号取得
 
 	// データ転送
 #if	USE_SYNC_TRANS == 1
@@ -60,6 +60,7 @@
 #include <poll.h>
 #include <dirent.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
@@ -76,6 +77,13 @@
 #if defined(__linux__)
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 #elif defined(__NetBSD__)
 #include <sys/param.h>
 #include <sys/sysctl.h>
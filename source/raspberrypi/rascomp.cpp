@@ -0,0 +1,341 @@
+//---------------------------------------------------------------------------
+//
+//	SCSI Target Emulator RaSCSI (*^..^*)
+//	for Raspberry Pi
+//	Powered by XM6 TypeG Technology.
+//
+//	Copyright (C) 2016-2021 GIMONS(Twitter:@kugimoto0715)
+//
+//	[ イメージ圧縮ユーティリティ ]
+//
+//---------------------------------------------------------------------------
+
+#include "os.h"
+#include "rascsi.h"
+#include "fileio.h"
+#include "filepath.h"
+
+//---------------------------------------------------------------------------
+//
+//	変数宣言
+//
+//---------------------------------------------------------------------------
+Filepath infile;					// 入力ファイル
+Filepath outfile;					// 出力ファイル
+DWORD chunksize;					// チャンク長
+BOOL decomp;						// 展開フラグ
+
+//---------------------------------------------------------------------------
+//
+//	バナー出力
+//
+//---------------------------------------------------------------------------
+BOOL Banner(int argc, char* argv[])
+{
+	printf("RaSCSI image compression utility ");
+	printf("version %01d.%01d%01d\n",
+		(int)((VERSION >> 8) & 0xf),
+		(int)((VERSION >> 4) & 0xf),
+		(int)((VERSION     ) & 0xf));
+
+	if (argc < 2 || strcmp(argv[1], "-h") == 0) {
+		printf("Usage: %s [-c KB] [-d] INPUT OUTPUT\n", argv[0]);
+		printf(" KB is chunk size in KBytes {4|8|16|32|64|128|256|512|1024}."
+			" Default is 64.\n");
+		printf(" -d is decompress operation.\n");
+		printf(" INPUT and OUTPUT are image file paths.\n");
+		printf(" Compressed images are read only. Use .hdz, .moz or .cdz\n");
+		printf(" for rascsi to detect the device type.\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	引数処理
+//
+//---------------------------------------------------------------------------
+BOOL ParseArgument(int argc, char* argv[])
+{
+	int opt;
+	int kb;
+
+	// 初期化
+	chunksize = Fileio::ChunkDef;
+	decomp = FALSE;
+
+	// 引数解析
+	opterr = 0;
+	while ((opt = getopt(argc, argv, "c:d")) != -1) {
+		switch (opt) {
+			case 'c':
+				kb = atoi(optarg);
+				if (kb <= 0 || kb > (int)(Fileio::ChunkMax / 1024)) {
+					kb = 0;
+				}
+				chunksize = (DWORD)kb * 1024;
+				break;
+
+			case 'd':
+				decomp = TRUE;
+				break;
+		}
+	}
+
+	// チャンク長チェック(2のべき乗)
+	if (chunksize < Fileio::ChunkMin || chunksize > Fileio::ChunkMax ||
+		(chunksize & (chunksize - 1)) != 0) {
+		fprintf(stderr,
+			"Error : Invalid chunk size\n");
+		return FALSE;
+	}
+
+	// ファイルチェック
+	if (argc - optind != 2) {
+		fprintf(stderr,
+			"Error : Invalid file path\n");
+		return FALSE;
+	}
+
+	infile.SetPath(argv[optind]);
+	outfile.SetPath(argv[optind + 1]);
+
+	return TRUE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	圧縮
+//
+//---------------------------------------------------------------------------
+BOOL Compress()
+{
+	Fileio in;
+	Fileio out;
+	Fileio::chunkhdr_t hdr;
+	UL64 *index;
+	BYTE *buf;
+	BYTE *comp;
+	fsize_t size;
+	UL64 pos;
+	DWORD i;
+	DWORD j;
+	DWORD len;
+	int clen;
+	BOOL result;
+
+	// 入力ファイル
+	if (!in.Open(infile, Fileio::ReadOnly)) {
+		fprintf(stderr, "Error : Can't open input file\n");
+		return FALSE;
+	}
+	if (in.IsChunk()) {
+		fprintf(stderr, "Error : Input file is already compressed\n");
+		in.Close();
+		return FALSE;
+	}
+	size = in.GetFileSize();
+	if (size <= 0) {
+		fprintf(stderr, "Error : Input file is empty\n");
+		in.Close();
+		return FALSE;
+	}
+
+	// 出力ファイル
+	if (!out.Open(outfile, Fileio::WriteOnly)) {
+		fprintf(stderr, "Error : Can't open output file\n");
+		in.Close();
+		return FALSE;
+	}
+
+	// ヘッダと索引、ワークバッファ
+	Fileio::InitChunkHeader(&hdr, chunksize, size);
+	index = (UL64 *)calloc(hdr.num + 1, sizeof(UL64));
+	buf = (BYTE *)malloc(chunksize);
+	comp = (BYTE *)malloc(chunksize);
+	result = FALSE;
+	if (!index || !buf || !comp) {
+		fprintf(stderr, "Error : Out of memory\n");
+		goto cleanup_exit;
+	}
+
+	// チャンクは索引の後ろから並べる
+	pos = sizeof(hdr) + (UL64)(hdr.num + 1) * sizeof(UL64);
+	for (i = 0; i < hdr.num; i++) {
+		index[i] = pos;
+
+		// 読み込み(最終チャンクは端数)
+		len = chunksize;
+		if (i == hdr.num - 1) {
+			len = (DWORD)(size - (fsize_t)i * chunksize);
+		}
+		if (!in.ReadAt(buf, len, (fsize_t)i * chunksize)) {
+			fprintf(stderr, "Error : Can't read input file\n");
+			goto cleanup_exit;
+		}
+
+		// 全て0なら何も書かない
+		for (j = 0; j < len; j++) {
+			if (buf[j] != 0) {
+				break;
+			}
+		}
+		if (j == len) {
+			continue;
+		}
+
+		// 圧縮して縮まなければそのまま書く
+		clen = Fileio::Compress(buf, len, comp, len - 1);
+		if (clen > 0) {
+			if (!out.WriteAt(comp, clen, pos)) {
+				fprintf(stderr, "Error : Can't write output file\n");
+				goto cleanup_exit;
+			}
+			pos += clen;
+		} else {
+			if (!out.WriteAt(buf, len, pos)) {
+				fprintf(stderr, "Error : Can't write output file\n");
+				goto cleanup_exit;
+			}
+			pos += len;
+		}
+
+		// 進捗
+		if ((i & 0xff) == 0 || i == hdr.num - 1) {
+			printf("\rCompress progress       : %3d%%",
+				(int)((UL64)(i + 1) * 100 / hdr.num));
+			fflush(stdout);
+		}
+	}
+	index[hdr.num] = pos;
+
+	// ヘッダと索引は最後に書く
+	if (!out.WriteAt(&hdr, sizeof(hdr), 0) ||
+		!out.WriteAt(index, (hdr.num + 1) * sizeof(UL64), sizeof(hdr))) {
+		fprintf(stderr, "Error : Can't write output file\n");
+		goto cleanup_exit;
+	}
+
+	printf("\rCompress progress       : %3d%%\n", 100);
+	printf("Input size              : %llu bytes\n", (UL64)size);
+	printf("Output size             : %llu bytes (%d%%)\n",
+		pos, (int)(pos * 100 / (UL64)size));
+	result = TRUE;
+
+cleanup_exit:
+	// 解放
+	if (comp) {
+		free(comp);
+	}
+	if (buf) {
+		free(buf);
+	}
+	if (index) {
+		free(index);
+	}
+	out.Close();
+	in.Close();
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	展開
+//
+//---------------------------------------------------------------------------
+BOOL Decompress()
+{
+	Fileio in;
+	Fileio out;
+	BYTE *buf;
+	fsize_t size;
+	fsize_t pos;
+	int len;
+	BOOL result;
+
+	// 入力ファイル(読み込みは透過的に展開される)
+	if (!in.Open(infile, Fileio::ReadOnly)) {
+		fprintf(stderr, "Error : Can't open input file\n");
+		return FALSE;
+	}
+	if (!in.IsChunk()) {
+		fprintf(stderr, "Error : Input file is not compressed\n");
+		in.Close();
+		return FALSE;
+	}
+	size = in.GetFileSize();
+
+	// 出力ファイル
+	if (!out.Open(outfile, Fileio::WriteOnly)) {
+		fprintf(stderr, "Error : Can't open output file\n");
+		in.Close();
+		return FALSE;
+	}
+
+	// チャンク単位で複写
+	buf = (BYTE *)malloc(Fileio::ChunkMax);
+	result = FALSE;
+	if (!buf) {
+		fprintf(stderr, "Error : Out of memory\n");
+		goto cleanup_exit;
+	}
+	for (pos = 0; pos < size; pos += len) {
+		len = Fileio::ChunkMax;
+		if (size - pos < len) {
+			len = (int)(size - pos);
+		}
+		if (!in.ReadAt(buf, len, pos)) {
+			fprintf(stderr, "Error : Can't read input file\n");
+			goto cleanup_exit;
+		}
+		if (!out.WriteAt(buf, len, pos)) {
+			fprintf(stderr, "Error : Can't write output file\n");
+			goto cleanup_exit;
+		}
+	}
+	printf("Output size             : %llu bytes\n", (UL64)size);
+	result = TRUE;
+
+cleanup_exit:
+	// 解放
+	if (buf) {
+		free(buf);
+	}
+	out.Close();
+	in.Close();
+
+	return result;
+}
+
+//---------------------------------------------------------------------------
+//
+//	主処理
+//
+//---------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+	BOOL result;
+
+	// バナー出力
+	if (!Banner(argc, argv)) {
+		exit(0);
+	}
+
+	// 引数解析
+	if (!ParseArgument(argc, argv)) {
+		exit(EINVAL);
+	}
+
+	// 圧縮または展開
+	if (decomp) {
+		result = Decompress();
+	} else {
+		result = Compress();
+	}
+
+	// 終了
+	exit(result ? 0 : EIO);
+}
@@ -59,6 +59,8 @@ FATFS fatfs;						// FatFS
 #else
 int monsocket;						// モニター用ソケット
 pthread_t monthread;				// モニタースレッド
+pthread_mutex_t monlock = PTHREAD_MUTEX_INITIALIZER;
+									// モニターコマンド処理中の排他
 static void *MonThread(void *param);
 #endif	// BAREMETAL
 BOOL haltreq;						// HALT要求
@@ -216,7 +218,18 @@ void Banner(int argc, char* argv[])
 		LogWrite(stdout,"  nhd : SCSI HD image(T98Next HD image)\n");
 		LogWrite(stdout,"  hda : SCSI HD image(APPLE GENUINE)\n");
 		LogWrite(stdout,"  mos : SCSI MO image(XM6 SCSI MO image)\n");
-		LogWrite(stdout,"  iso : SCSI CD image(ISO 9660 image)\n\n");
+		LogWrite(stdout,"  iso : SCSI CD image(ISO 9660 image)\n");
+		LogWrite(stdout,"  hdz/moz/cdz : compressed SCSI HD/MO/CD image(rascomp)\n\n");
+		LogWrite(stdout," -o OPTIONS after FILE sets device options(comma separated).\n");
+		LogWrite(stdout,"  mmap : serve I/O from memory mapped image\n");
+		LogWrite(stdout,"  ram : load whole image into RAM(implies wb)\n");
+		LogWrite(stdout,"  direct : bypass page cache(O_DIRECT)\n");
+		LogWrite(stdout,"  cache=N : track cache size in MB(1-1024)\n");
+		LogWrite(stdout,"  readahead=N : sequential read-ahead tracks(0-4)\n");
+		LogWrite(stdout,"  track=N : sectors per cache track(8-256, power of 2)\n");
+		LogWrite(stdout,"  xfer=N : bytes per bus transfer in KB(1-1024)\n");
+		LogWrite(stdout,"  overlay : keep image read-only and write to FILE.cow\n");
+		LogWrite(stdout,"  wb : write-back cache with background flush\n\n");
 		LogWrite(stdout,"Usage: %s CONFIG_FILE\n\n", argv[0]);
 		LogWrite(stdout," CONFIG_FILE is disk images config file.\n");
 
@@ -420,6 +433,78 @@ void Reset()
 	bus->Reset();
 }
 
+//---------------------------------------------------------------------------
+//
+//	切断中のコントローラがあるか
+//
+//---------------------------------------------------------------------------
+BOOL IsDisconnected()
+{
+	int i;
+
+	for (i = 0; i < CtrlMax; i++) {
+		if (ctrl[i] && ctrl[i]->IsDisconnected()) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+//---------------------------------------------------------------------------
+//
+//	切断中のコントローラを再接続
+//	※アービトレーションの優先順位に合わせて上位IDから試す
+//
+//---------------------------------------------------------------------------
+int ReconnectControler()
+{
+	int i;
+
+	for (i = CtrlMax - 1; i >= 0; i--) {
+		if (!ctrl[i] || !ctrl[i]->IsDisconnected()) {
+			continue;
+		}
+
+		// リセレクションできたらそのターゲットを走らせる
+		if (ctrl[i]->Reconnect() != BUS::busfree) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	コントローラ駆動
+//	※バスフリーになるまで実行する
+//
+//---------------------------------------------------------------------------
+void RunControler(int actid)
+{
+	BUS::phase_t phase;
+
+	ASSERT((actid >= 0) && (actid < CtrlMax));
+
+	// ターゲット走行開始
+	active = TRUE;
+
+	// バスフリーになるまでループ
+	while (running) {
+		// ターゲット駆動
+		phase = ctrl[actid]->Process();
+
+		// バスフリーになったら終了
+		if (phase == BUS::busfree) {
+			break;
+		}
+	}
+
+	// ターゲット走行終了(切断中のコマンドがあってもバスフリーなら処理しない)
+	active = FALSE;
+}
+
 //---------------------------------------------------------------------------
 //
 //	デバイス一覧表示
@@ -478,6 +563,12 @@ void ListDevice(FILE *fp)
 			LogWrite(fp, "(WRITEPROTECT)");
 		}
 
+		// オーバーレイ状態出力(差分のあるセクタ数)
+		if (pUnit->GetOverlay()) {
+			LogWrite(fp, "(OVERLAY %llu)",
+				pUnit->GetOverlay()->GetCount());
+		}
+
 		// 次の行へ
 		LogWrite(fp, "\n");
 	}
@@ -491,6 +582,83 @@ void ListDevice(FILE *fp)
 	LogWrite(fp, "+----+----+------+-------------------------------------\n");
 }
 
+//---------------------------------------------------------------------------
+//
+//	キャッシュ統計表示
+//
+//---------------------------------------------------------------------------
+void ListStat(FILE *fp)
+{
+	int i;
+	int id;
+	int un;
+	Disk *pUnit;
+	DiskCache::cachestat_t stat;
+	UL64 total;
+	UL64 ratio;
+	UL64 avg;
+	BOOL find;
+	char type[5];
+
+	find = FALSE;
+	type[4] = 0;
+	for (i = 0; i < CtrlMax * UnitNum; i++) {
+		// IDとユニット
+		id = i / UnitNum;
+		un = i % UnitNum;
+		pUnit = disk[i];
+
+		// キャッシュを持たないユニットはスキップ
+		if (pUnit == NULL || pUnit->IsNULL() ||
+			!pUnit->GetCacheStat(&stat)) {
+			continue;
+		}
+
+		// ヘッダー出力
+		if (!find) {
+			LogWrite(fp, "+----+----+------+-------------------------------------\n");
+			LogWrite(fp, "| ID | UN | TYPE | CACHE STATISTICS\n");
+			LogWrite(fp, "+----+----+------+-------------------------------------\n");
+			find = TRUE;
+		}
+
+		// ID,UNIT,タイプ出力
+		type[0] = (char)(pUnit->GetID() >> 24);
+		type[1] = (char)(pUnit->GetID() >> 16);
+		type[2] = (char)(pUnit->GetID() >> 8);
+		type[3] = (char)(pUnit->GetID());
+
+		// ヒット率(0.1%単位)
+		total = stat.hits + stat.misses + stat.prefetch;
+		ratio = total ? (stat.hits * 1000 / total) : 0;
+		LogWrite(fp, "|  %d |  %d | %s | HIT %llu MISS %llu PREFETCH %llu"
+			" (%llu.%llu%%) EVICT %llu\n",
+			id, un, type, stat.hits, stat.misses, stat.prefetch,
+			ratio / 10, ratio % 10, stat.evictions);
+
+		// 読み書き量とロード待ち時間
+		LogWrite(fp, "|    |    |      | READ %lluKB WRITE %lluKB"
+			" LOADWAIT %llums\n",
+			stat.readbytes >> 10, stat.writebytes >> 10,
+			stat.loadtime / 1000);
+
+		// 同期時間とトラックの状態
+		avg = stat.flushes ? (stat.flushtime / stat.flushes) : 0;
+		LogWrite(fp, "|    |    |      | FLUSH %llu AVG %lluus MAX %luus"
+			" TRACK %d/%d DIRTY %d\n",
+			stat.flushes, avg, stat.flushmax,
+			stat.used, stat.tracks, stat.dirty);
+	}
+
+	// キャッシュが無い場合
+	if (!find) {
+		LogWrite(fp, "No cache is active.\n");
+		return;
+	}
+
+	LogWrite(fp, "+----+----+------+-------------------------------------\n");
+}
+
 //---------------------------------------------------------------------------
 //
 //	コントローラマッピング
@@ -511,8 +679,9 @@ void MapControler(FILE *fp, Disk **map)
 			if (disk[unitno] != map[unitno]) {
 				// 元のユニットが存在する
 				if (disk[unitno]) {
-					// コントローラから切り離す
+					// コントローラから切り離す(切断中のコマンドも破棄)
 					if (ctrl[i]) {
+						ctrl[i]->Purge(j);
 						ctrl[i]->SetUnit(j, NULL);
 					}
 
@@ -608,12 +777,138 @@ void MapControler(FILE *fp, Disk **map)
 	}
 }
 
+//---------------------------------------------------------------------------
+//
+//	物理メモリ量(MB)
+//
+//---------------------------------------------------------------------------
+UL64 GetPhysMemMB()
+{
+#ifndef BAREMETAL
+	long pages;
+	long size;
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	size = sysconf(_SC_PAGESIZE);
+	if (pages > 0 && size > 0) {
+		return ((UL64)pages * (UL64)size) >> 20;
+	}
+#endif	// BAREMETAL
+
+	// 取得できなければ制限しない
+	return (UL64)-1;
+}
+
+//---------------------------------------------------------------------------
+//
+//	デバイスオプション設定
+//	※カンマ区切りのオプションをオープン前のユニットに反映する
+//
+//---------------------------------------------------------------------------
+BOOL ApplyOption(FILE *fp, Disk *pUnit, const char *opt)
+{
+	char buf[256];
+	char *p;
+	char *q;
+	int value;
+
+	ASSERT(pUnit);
+
+	// オプション指定なし
+	if (!opt || opt[0] == '\0' || strcmp(opt, "-") == 0) {
+		return TRUE;
+	}
+
+	// 作業用に複写
+	strncpy(buf, opt, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	// カンマで分割して解釈
+	p = buf;
+	while (p) {
+		q = strchr(p, ',');
+		if (q) {
+			*q++ = '\0';
+		}
+
+		if (_xstrcasecmp(p, "mmap") == 0) {
+			// メモリマップモード
+			pUnit->SetCacheMap(TRUE);
+		} else if (_xstrcasecmp(p, "ram") == 0) {
+			// RAM常駐(変更はライトバックで書き戻す)
+			pUnit->SetCacheRam(TRUE);
+			pUnit->SetCacheWB(TRUE);
+		} else if (_xstrcasecmp(p, "direct") == 0) {
+			// ダイレクトI/O(ページキャッシュを経由しない)
+			pUnit->SetCacheDirect(TRUE);
+		} else if (_xstrcasecmp(p, "wb") == 0) {
+			// ライトバック
+			pUnit->SetCacheWB(TRUE);
+		} else if (_xstrcasecmp(p, "overlay") == 0) {
+			// オーバーレイ(書き込みは差分ファイルへ)
+			pUnit->SetOverlayMode(TRUE);
+		} else if (_xstrncasecmp(p, "cache=", 6) == 0) {
+			// キャッシュサイズ(MB)
+			value = atoi(&p[6]);
+			if (value <= 0 || value > 1024) {
+				LogWrite(fp, "Error : Invalid cache size [%s]\n", p);
+				return FALSE;
+			}
+
+			// 物理メモリの半分まで(超えるとOOMで強制終了される)
+			if ((UL64)value > GetPhysMemMB() / 2) {
+				LogWrite(fp,
+					"Error : Cache size exceeds half of physical memory [%s]\n",
+					p);
+				return FALSE;
+			}
+			pUnit->SetCacheSize(value);
+		} else if (_xstrncasecmp(p, "track=", 6) == 0) {
+			// トラック毎のセクタ数(2のべき乗)
+			value = atoi(&p[6]);
+			if (value < DiskTrack::MinSectors ||
+				value > DiskTrack::MaxSectors ||
+				(value & (value - 1)) != 0) {
+				LogWrite(fp, "Error : Invalid track sectors [%s]\n", p);
+				return FALSE;
+			}
+			pUnit->SetTrackSectors(value);
+		} else if (_xstrncasecmp(p, "xfer=", 5) == 0) {
+			// 1回の転送サイズ(KB)
+			value = atoi(&p[5]);
+			if (value <= 0 || value > (Disk::XferMax >> 10)) {
+				LogWrite(fp, "Error : Invalid transfer size [%s]\n", p);
+				return FALSE;
+			}
+			pUnit->SetXferSize(value << 10);
+#ifndef BAREMETAL
+		} else if (_xstrncasecmp(p, "readahead=", 10) == 0) {
+			// 先読みトラック数
+			value = atoi(&p[10]);
+			if (value < 0 || value > DiskCache::ReadAheadMax) {
+				LogWrite(fp, "Error : Invalid readahead [%s]\n", p);
+				return FALSE;
+			}
+			pUnit->SetReadAhead(value);
+#endif	// BAREMETAL
+		} else if (p[0] != '\0') {
+			LogWrite(fp, "Error : Invalid option [%s]\n", p);
+			return FALSE;
+		}
+
+		p = q;
+	}
+
+	return TRUE;
+}
+
 //---------------------------------------------------------------------------
 //
 //	コマンド処理
 //
 //---------------------------------------------------------------------------
-BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
+BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file,
+	char *opt)
 {
 	Disk *map[CtrlMax * UnitNum];
 	int len;
@@ -637,6 +932,13 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 		return FALSE;
 	}
 
+	// 切断中のコマンドがあるコントローラは構成を変えない
+	// ※再接続先のユニットやコントローラが無くなるため
+	if ((cmd == 0 || cmd == 1) && ctrl[id] && ctrl[id]->IsDisconnected()) {
+		LogWrite(fp, "Error : Operation denied(Device has queued commands)\n");
+		return FALSE;
+	}
+
 	// 接続コマンド
 	if (cmd == 0) {					// ATTACH
 		// SASIとSCSIを見分ける
@@ -709,6 +1011,17 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 				return FALSE;
 		}
 
+		// ライトスルーに設定(オプションで変更可)
+		pUnit->SetCacheWB(FALSE);
+
+		// オプション設定
+		if (!ApplyOption(fp, pUnit, opt)) {
+			if (pUnit != scsibr) {
+				delete pUnit;
+			}
+			return FALSE;
+		}
+
 		// ファイルの確認を行う
 		if (filecheck) {
 			// パスを設定
@@ -722,9 +1035,6 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 			}
 		}
 
-		// ライトスルーに設定
-		pUnit->SetCacheWB(FALSE);
-
 		// 新しいユニットで置き換え
 		map[id * UnitNum + un] = pUnit;
 
@@ -734,7 +1044,7 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 	}
 
 	// 有効なコマンドか
-	if (cmd > 4) {
+	if (cmd > 6) {
 		LogWrite(fp, "Error : Invalid command\n");
 		return FALSE;
 	}
@@ -762,6 +1072,26 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 		return TRUE;
 	}
 
+	// オーバーレイの反映と破棄
+	if (cmd == 5 || cmd == 6) {
+		if (!pUnit->GetOverlay()) {
+			LogWrite(fp, "Error : Operation denied(Device isn't overlay)\n");
+			return FALSE;
+		}
+		if (cmd == 5) {				// COMMIT
+			if (!pUnit->CommitOverlay()) {
+				LogWrite(fp, "Error : Overlay commit failed\n");
+				return FALSE;
+			}
+		} else {					// DISCARD
+			if (!pUnit->DiscardOverlay()) {
+				LogWrite(fp, "Error : Overlay discard failed\n");
+				return FALSE;
+			}
+		}
+		return TRUE;
+	}
+
 	// MOかCDの場合だけ有効
 	if (pUnit->GetID() != MAKEID('S', 'C', 'M', 'O') &&
 		pUnit->GetID() != MAKEID('S', 'C', 'C', 'D')) {
@@ -771,6 +1101,11 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 
 	switch (cmd) {
 		case 2:						// INSERT
+			// オプション設定
+			if (!ApplyOption(fp, pUnit, opt)) {
+				return FALSE;
+			}
+
 			// パスを設定
 			filepath.SetPath(file);
 
@@ -805,7 +1140,7 @@ BOOL ProcessCmd(FILE *fp, int id, int un, int cmd, int type, char *file)
 //	コマンド解析
 //
 //---------------------------------------------------------------------------
-BOOL ParseCmd(char *argID, char *argPath)
+BOOL ParseCmd(char *argID, char *argPath, char *argOpt)
 {
 	int id;
 	int un;
@@ -904,13 +1239,16 @@ BOOL ParseCmd(char *argID, char *argPath)
 			_xstrcasecmp(ext, "hdn") == 0 ||
 			_xstrcasecmp(ext, "hdi") == 0 ||
 			_xstrcasecmp(ext, "nhd") == 0 ||
-			_xstrcasecmp(ext, "hda") == 0) {
+			_xstrcasecmp(ext, "hda") == 0 ||
+			_xstrcasecmp(ext, "hdz") == 0) {
 			// HD(SASI/SCSI)
 			type = 0;
-		} else if (strcasecmp(ext, "mos") == 0) {
+		} else if (strcasecmp(ext, "mos") == 0 ||
+			strcasecmp(ext, "moz") == 0) {
 			// MO
 			type = 2;
-		} else if (strcasecmp(ext, "iso") == 0) {
+		} else if (strcasecmp(ext, "iso") == 0 ||
+			strcasecmp(ext, "cdz") == 0) {
 			// CD
 			type = 3;
 		} else {
@@ -922,7 +1260,7 @@ BOOL ParseCmd(char *argID, char *argPath)
 	}
 
 	// コマンド実行
-	if (!ProcessCmd(stderr, id, un, 0, type, argPath)) {
+	if (!ProcessCmd(stderr, id, un, 0, type, argPath, argOpt)) {
 		return FALSE;
 	}
 
@@ -939,6 +1277,7 @@ BOOL ParseArgument(int argc, char* argv[])
 	int i;
 	char *argID;
 	char *argPath;
+	char *argOpt;
 
 	// IDとパス指定がなければ処理を中断
 	if (argc < 3) {
@@ -969,8 +1308,16 @@ BOOL ParseArgument(int argc, char* argv[])
 		}
 		argID++;
 
+		// 続けて-oがあればこのデバイスのオプションとする
+		argOpt = NULL;
+		if (argc >= 2 && _xstrcasecmp(argv[i], "-o") == 0) {
+			argc -= 2;
+			i++;
+			argOpt = argv[i++];
+		}
+
 		// コマンド解析
-		ParseCmd(argID, argPath);
+		ParseCmd(argID, argPath, argOpt);
 	}
 
 	return TRUE;
@@ -987,6 +1334,7 @@ BOOL ParseConfigFile(char *file)
 	char line[512];
 	char argID[512];
 	char argPath[512];
+	char argOpt[512];
 	int len;
 	char *p;
 	char *q;
@@ -1070,13 +1418,35 @@ BOOL ParseConfigFile(char *file)
 		memcpy(argPath, p, (q - p));
 		argPath[(q - p)] = '\0';
 
+		// 空白とタブ以外の文字まで走査
+		p = q;
+		while (p[0]) {
+			if (p[0] != ' ' && p[0] != '\t') {
+				break;
+			}
+			p++;
+		}
+
+		// 空白とタブまで走査
+		q = p;
+		while (q[0]) {
+			if (q[0] == ' ' || q[0] == '\t') {
+				break;
+			}
+			q++;
+		}
+
+		// オプション確定(省略可)
+		memcpy(argOpt, p, (q - p));
+		argOpt[(q - p)] = '\0';
+
 		// 事前チェック
 		if (argID[0] == '\0' || argPath[0] == '\0') {
 			continue;
 		}
 
 		// コマンド解析
-		ParseCmd(argID, argPath);
+		ParseCmd(argID, argPath, argOpt);
 	}
 
 	// 設定ファイルクローズ
@@ -1100,6 +1470,7 @@ void ParseCtrCmd(FILE *fp, char *line)
 	int cmd;
 	int type;
 	char *file;
+	char *opt;
 
 	// 出力先がログバッファならクリア
 	if (!fp) {
@@ -1139,6 +1510,28 @@ void ParseCtrCmd(FILE *fp, char *line)
 		return;
 	}
 
+	// キャッシュ統計表示
+	if (_xstrncasecmp(p, "stat", 4) == 0) {
+		ListStat(fp);
+		return;
+	}
+
+	// オプション指定(opt OPTIONS に続けて通常のパラメータ)
+	opt = NULL;
+	if (_xstrncasecmp(p, "opt ", 4) == 0) {
+		p += 4;
+		while (*p == ' ') {
+			p++;
+		}
+		opt = p;
+		while (*p && (*p != ' ')) {
+			p++;
+		}
+		while (*p == ' ') {
+			*p++ = 0;
+		}
+	}
+
 	// パラメータの分離
 	argv[0] = p;
 	for (i = 1; i < 5; i++) {
@@ -1175,7 +1568,7 @@ void ParseCtrCmd(FILE *fp, char *line)
 	file = argv[4];
 
 	// コマンド実行
-	ProcessCmd(fp, id, un, cmd, type, file);
+	ProcessCmd(fp, id, un, cmd, type, file, opt);
 }
 
 #ifndef BAREMETAL
@@ -1226,8 +1619,10 @@ static void *MonThread(void *param)
 				usleep(500 * 1000);
 			}
 
-			// コマンドライン処理
+			// コマンドライン処理(処理中は再接続させない)
+			pthread_mutex_lock(&monlock);
 			ParseCtrCmd(fp, line);
+			pthread_mutex_unlock(&monlock);
 		}
 
 		// 接続解放
@@ -1357,8 +1752,8 @@ int main(int argc, char* argv[])
 		actid = -1;
 		phase = BUS::busfree;
 
-		// SEL信号ポーリング
-		ret = bus->PollSelectEvent();
+		// SEL信号ポーリング(切断中のコントローラがあれば1ms毎に起きる)
+		ret = bus->PollSelectEvent(IsDisconnected() ? 1 : -1);
 		if (ret < 0) {
 			continue;
 		}
@@ -1375,8 +1770,21 @@ int main(int argc, char* argv[])
 			}
 		}
 
-		// SELECT中で無ければ中断
+		// SELECT中で無ければ切断中のコントローラを再接続
 		if (!bus->GetSEL()) {
+#ifndef BAREMETAL
+			// モニターコマンド処理中は後回し
+			if (pthread_mutex_trylock(&monlock) != 0) {
+				continue;
+			}
+#endif	// BAREMETAL
+			actid = ReconnectControler();
+			if (actid >= 0) {
+				RunControler(actid);
+			}
+#ifndef BAREMETAL
+			pthread_mutex_unlock(&monlock);
+#endif	// BAREMETAL
 			continue;
 		}
 
@@ -1420,22 +1828,8 @@ int main(int argc, char* argv[])
 			continue;
 		}
 
-		// ターゲット走行開始
-		active = TRUE;
-
-		// バスフリーになるまでループ
-		while (running) {
-			// ターゲット駆動
-			phase = ctrl[actid]->Process();
-
-			// バスフリーになったら終了
-			if (phase == BUS::busfree) {
-				break;
-			}
-		}
-
-		// ターゲット走行終了
-		active = FALSE;
+		// ターゲット走行
+		RunControler(actid);
 	}
 
 err_exit:
@@ -70,6 +70,7 @@ int main(int argc, char* argv[])
 	int cmd;
 	int type;
 	char *file;
+	char *option;
 	int len;
 	char *ext;
 	char buf[BUFSIZ];
@@ -79,23 +80,28 @@ int main(int argc, char* argv[])
 	cmd = -1;
 	type = -1;
 	file = NULL;
+	option = NULL;
 
 	// ヘルプの表示
 	if (argc < 2) {
 		fprintf(stderr, "SCSI Target Emulator RaSCSI Controller\n");
 		fprintf(stderr,
-			"Usage: %s -i ID [-u UNIT] [-c CMD] [-t TYPE] [-f FILE]\n",
+			"Usage: %s -i ID [-u UNIT] [-c CMD] [-t TYPE] [-f FILE] [-o OPTIONS]\n",
 			argv[0]);
 		fprintf(stderr, " where  ID := {0|1|2|3|4|5|6|7}\n");
 		fprintf(stderr, "        UNIT := {0|1} default setting is 0.\n");
-		fprintf(stderr, "        CMD := {attach|detach|insert|eject|protect}\n");
+		fprintf(stderr, "        CMD := {attach|detach|insert|eject|protect|commit|discard}\n");
 		fprintf(stderr, "        TYPE := {hd|mo|cd|bridge}\n");
 		fprintf(stderr, "        FILE := image file path\n");
+		fprintf(stderr, "        OPTIONS := comma separated device options {mmap|ram|direct|cache=N|track=N|readahead=N|xfer=N|wb|overlay}\n");
 		fprintf(stderr, " CMD is 'attach' or 'insert' and FILE parameter is required.\n");
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage: %s -l\n\n", argv[0]);
 		fprintf(stderr, "       Print device list.\n");
 		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage: %s -s\n\n", argv[0]);
+		fprintf(stderr, "       Print cache statistics.\n");
+		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage: %s --stop\n\n", argv[0]);
 		fprintf(stderr, "       Stop rascsi prosess.\n");
 		fprintf(stderr, "\n");
@@ -106,7 +112,7 @@ int main(int argc, char* argv[])
 
 	// 引数解析
 	opterr = 0;
-	while ((opt = getopt(argc, argv, "i:u:c:t:f:l-:")) != -1) {
+	while ((opt = getopt(argc, argv, "i:u:c:t:f:o:ls-:")) != -1) {
 		switch (opt) {
 			case 'i':
 				id = optarg[0] - '0';
@@ -125,6 +131,9 @@ int main(int argc, char* argv[])
 					case 'd':				// DETACH
 					case 'D':
 						cmd = 1;
+						if (_xstrcasecmp(optarg, "discard") == 0) {
+							cmd = 6;		// DISCARD
+						}
 						break;
 					case 'i':				// INSERT
 					case 'I':
@@ -138,6 +147,10 @@ int main(int argc, char* argv[])
 					case 'P':
 						cmd = 4;
 						break;
+					case 'c':				// COMMIT
+					case 'C':
+						cmd = 5;
+						break;
 				}
 				break;
 
@@ -168,11 +181,20 @@ int main(int argc, char* argv[])
 				file = optarg;
 				break;
 
+			case 'o':
+				option = optarg;
+				break;
+
 			case 'l':
 				sprintf(buf, "list\n");
 				SendCommand(buf);
 				exit(0);
 
+			case 's':
+				sprintf(buf, "stat\n");
+				SendCommand(buf);
+				exit(0);
+
 			case '-':
 				if (strcmp(optarg, "shutdown") == 0) {
 					sprintf(buf, "shutdown\n");
@@ -216,13 +238,16 @@ int main(int argc, char* argv[])
 				_xstrcasecmp(ext, "hdn") == 0 ||
 				_xstrcasecmp(ext, "hdi") == 0 ||
 				_xstrcasecmp(ext, "nhd") == 0 ||
-				_xstrcasecmp(ext, "hda") == 0) {
+				_xstrcasecmp(ext, "hda") == 0 ||
+				_xstrcasecmp(ext, "hdz") == 0) {
 				// HD(SASI/SCSI)
 				type = 0;
-			} else if (_xstrcasecmp(ext, "mos") == 0) {
+			} else if (_xstrcasecmp(ext, "mos") == 0 ||
+				_xstrcasecmp(ext, "moz") == 0) {
 				// MO
 				type = 2;
-			} else if (_xstrcasecmp(ext, "iso") == 0) {
+			} else if (_xstrcasecmp(ext, "iso") == 0 ||
+				_xstrcasecmp(ext, "cdz") == 0) {
 				// CD
 				type = 3;
 			}
@@ -256,7 +281,13 @@ int main(int argc, char* argv[])
 	}
 
 	// 送信コマンド生成
-	sprintf(buf, "%d %d %d %d %s\n", id, un, cmd, type, file ? file : "-");
+	if (option) {
+		sprintf(buf, "opt %s %d %d %d %d %s\n",
+			option, id, un, cmd, type, file ? file : "-");
+	} else {
+		sprintf(buf, "%d %d %d %d %s\n",
+			id, un, cmd, type, file ? file : "-");
+	}
 	if (!SendCommand(buf)) {
 		exit(ENOTCONN);
 	}